@@ -0,0 +1,110 @@
+/**
+ *	Author: Madis Ollikainen
+ *	File:	gen_log.cpp
+ *
+ *	Generator of synthetic web server logs for benchmarking.
+ *	The lines are in the Common Log Format of the example
+ *	log (example_logs/access_log_example): client address,
+ *	time stamp, request, status and size. The requests are
+ *	put together from random path segments and query strings,
+ *	which gives line lengths of about 70-200 bytes with a
+ *	median around 110, as in the example log.
+ *
+ *	The output only depends on the seed, thus the same log
+ *	can be regenerated on any machine.
+ *
+ *	Usage:
+ *		./gen_log <number_of_lines> [seed] > file.log
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+// --- A small and fast generator (xorshift64*) --- //
+struct Rng
+{
+	uint64_t s;
+	Rng(uint64_t seed) : s(seed ? seed : 1) {}
+	uint64_t next()
+	{
+		s ^= s >> 12;
+		s ^= s << 25;
+		s ^= s >> 27;
+		return s * 2685821657736338717ULL;
+	}
+	// Uniform in [0, n)
+	uint64_t below(uint64_t n) { return next() % n; }
+};
+
+
+int main( int argc, char **argv )
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <number_of_lines> [seed]\n", argv[0]);
+		return 1;
+	}
+	uint64_t n = strtoull(argv[1], 0, 10);
+	Rng rng( (argc > 2) ? strtoull(argv[2], 0, 10) : 2004 );
+
+	// --- The vocabulary of the requests --- //
+	const char* methods[] = {"GET", "GET", "GET", "GET", "GET", "GET", "POST", "HEAD"};
+	const char* roots[] = {"/twiki/bin/view", "/twiki/bin/edit", "/twiki/bin/rdiff", "/twiki/bin/oops",
+						   "/twiki/bin/attach", "/twiki/pub/TWiki", "/mailman/listinfo", "/mailman/admin",
+						   "/cgi-bin/mailgraph.cgi", "/icons", "/robots.txt", "/favicon.ico"};
+	const char* webs[] = {"Main", "TWiki", "Know", "Sandbox", "TWikiSite", "Mailman"};
+	const char* words[] = {"WebHome", "WebChanges", "WebIndex", "WebSearch", "WebNotify", "WebPreferences",
+						   "TWikiUsers", "ConfigurationVariables", "Double_bounce_sender", "NewUserTemplate",
+						   "SpamAssassin", "PeterThoeny", "TextFormattingRules", "WikiSyntax", "hsdivision",
+						   "mailgraph_0.png", "SiteMap", "TWikiRegistration", "FileAttachment", "AppendixFileSystem"};
+	const char* queries[] = {"?rev=1.2", "?topicparent=Main.WebHome", "?rev1=1.3&rev2=1.2", "?skin=print",
+							 "?template=oopsmore&param1=1.12&param2=1.12", "?search=TWiki&scope=text&regex=on",
+							 "?unlock=on", "?filename=&revInfo=1"};
+	const char* statuses[] = {"200", "200", "200", "200", "200", "200", "304", "401", "404", "302"};
+	const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	#define PICK(a) a[rng.below(sizeof(a)/sizeof(a[0]))]
+
+	// A pool of clients, a few of them busy
+	std::vector<std::string> clients(64);
+	for (size_t i=0; i<clients.size(); ++i)
+	{
+		clients[i] = std::to_string(rng.below(223) + 1) + "." + std::to_string(rng.below(256)) + "." +
+					 std::to_string(rng.below(256)) + "." + std::to_string(rng.below(256));
+	}
+
+	// --- Write the lines through a large buffer --- //
+	static char out[1 << 20];
+	setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+	time_t t = 1078700000;
+	char line[1024];
+	for (uint64_t i=0; i<n; ++i)
+	{
+		t += rng.below(4);
+		struct tm tm;
+		gmtime_r(&t, &tm);
+
+		// The path: a root, possibly a web and a topic and a query
+		std::string path = PICK(roots);
+		if(rng.below(4) != 0)
+		{
+			path += "/"; path += PICK(webs);
+			path += "/"; path += PICK(words);
+			if(rng.below(3) == 0)	{	path += PICK(queries);	}
+		}
+
+		size_t len = snprintf(line, sizeof(line), "%s - - [%02d/%s/%04d:%02d:%02d:%02d -0800] \"%s %s HTTP/1.1\" %s %u\n",
+			clients[ rng.below(4) == 0 ? rng.below(4) : rng.below(clients.size()) ].c_str(),
+			tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec,
+			PICK(methods), path.c_str(), PICK(statuses), unsigned(rng.below(20000)));
+		fwrite(line, 1, std::min(len, sizeof(line) - 1), stdout);
+	}
+	fflush(stdout);
+	return 0;
+}
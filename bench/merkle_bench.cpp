@@ -0,0 +1,185 @@
+/**
+ *	Author: Madis Ollikainen
+ *	File:	merkle_bench.cpp
+ *
+ *	Benchmark of the MerkleHasher on a log file (see
+ *	gen_log.cpp for synthetic logs). It times separately:
+ *		a)	sha256:		hashing all lines into leaves,
+ *						without building the tree (also with
+ *						sha512-256 and blake2s-256, to compare
+ *						the hash functions)
+ *		b)	getRoot:	the root of the whole tree
+ *			splitRoot:	the same root with the subtrees
+ *						built in parallel (MerkleBatch)
+ *		c)	getHashChain:	one hash chain (a full pass)
+ *		d)	verify:		checking hash chains with
+ *						selfConsistentHashChain
+ *
+ *	The results are printed as one JSON object, giving for
+ *	every phase the time, lines/s, MB/s and ns per hash. For
+ *	verify the "lines" are the verified chains.
+ *	The log file is read once before timing, so that it is
+ *	in the page cache and the timings are of the hashing.
+ *
+ *	Usage:
+ *		./merkle_bench <log_file> [threads]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "myHashInterface.hpp"
+#include "merkleHasher.hpp"
+#include "merkleBatch.hpp"
+#include "lineReader.hpp"
+
+
+// --- Seconds since an arbitrary point --- //
+static double now()
+{
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// --- Hash all the lines of the file into leaves, returns the seconds --- //
+template <class P>
+static double timeLeaves(const std::string& file)
+{
+	double t0 = now();
+	LineReader input(file);
+	const size_t BATCH = 64;
+	const char* line[BATCH];
+	size_t len[BATCH];
+	typename P::digest_t leaf[BATCH];
+	size_t n = 0;
+	bool more = true;
+	while(more)
+	{
+		more = input.next(line[n], len[n]);
+		if(more) { ++n; }
+		if( n == BATCH || (!more && n > 0) )
+		{
+			P::leaves(line, len, n, leaf);
+			n = 0;
+		}
+	}
+	return now() - t0;
+}
+
+// --- One phase of the benchmark as a JSON object --- //
+static std::string phase(const std::string& name, double secs, uint64_t lines, uint64_t bytes, uint64_t hashes)
+{
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(6)
+		<< "{\"name\": \"" << name << "\", \"seconds\": " << secs
+		<< std::setprecision(1)
+		<< ", \"lines_per_s\": " << lines/secs
+		<< ", \"mb_per_s\": " << bytes/secs/1e6
+		<< ", \"ns_per_hash\": " << 1e9*secs/hashes << "}";
+	return out.str();
+}
+
+
+int main( int argc, char **argv )
+{
+	if(argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <log_file> [threads]" << std::endl;
+		return 1;
+	}
+	std::string file = argv[1];
+	unsigned threads = (argc > 2) ? atoi(argv[2]) : 1;
+	typedef Sha256Policy P;
+
+	// --- Warm up the page cache and count the lines --- //
+	uint64_t lines = 0;
+	uint64_t bytes = 0;
+	std::string middle_line;
+	{
+		LineReader input(file);
+		if(!input.is_open())
+		{
+			std::cerr << "Can not open " << file << std::endl;
+			return 1;
+		}
+		const char* line;
+		size_t len;
+		while( input.next(line, len) )
+		{
+			++lines;
+			bytes += len + 1;
+		}
+	}
+	if(lines == 0)
+	{
+		std::cerr << file << " is empty" << std::endl;
+		return 1;
+	}
+	{
+		LineReader input(file);
+		const char* line;
+		size_t len;
+		for (uint64_t i=0; i<=lines/2 && input.next(line, len); ++i)
+		{
+			middle_line.assign(line, len);
+		}
+	}
+	// A tree of n leaves has n-1 internal nodes, 2n-1 hashes in total
+	uint64_t tree_hashes = 2*lines - 1;
+
+	// --- a) Hashing the leaves --- //
+	double t_leaves = timeLeaves<P>(file);
+	double t_sha512 = Sha512_256Policy::available() ? timeLeaves<Sha512_256Policy>(file) : 0;
+	double t_blake2s = Blake2sPolicy::available() ? timeLeaves<Blake2sPolicy>(file) : 0;
+	double t0;
+
+	// --- b) The root --- //
+	MerkleHasher<P> hasher;
+	hasher.setThreads(threads);
+	t0 = now();
+	std::string root = hasher.getRoot(file, false);
+	double t_root = now() - t0;
+
+	MerkleBatch<P> parallel(threads);
+	t0 = now();
+	bool split_ok = (P::toString(parallel.getRoot(file).root) == root);
+	double t_split = now() - t0;
+
+	// --- c) One hash chain --- //
+	t0 = now();
+	hash_chain_t chain = hasher.getHashChain(file, middle_line, false);
+	double t_chain = now() - t0;
+
+	// --- d) Verifying the chain, repeated to get a measurable time --- //
+	uint64_t verify_steps = (chain.size() > 1) ? (chain.size() - 1)/2 : 1;
+	uint64_t repeats = std::max<uint64_t>(1, 500000 / verify_steps);
+	bool ok = split_ok && !chain.empty() && chain.back().second == root;
+	t0 = now();
+	for (uint64_t r=0; r<repeats; ++r)
+	{
+		ok = hasher.selfConsistentHashChain(chain) && ok;
+	}
+	double t_verify = now() - t0;
+
+	// --- The report --- //
+	std::cout << "{\"file\": \"" << file << "\", \"lines\": " << lines << ", \"bytes\": " << bytes
+			  << ", \"threads\": " << threads
+			  << ", \"sha256_backend\": {\"one\": \"" << sha256BackendName(sha256Dispatch().one)
+			  << "\", \"many\": \"" << sha256BackendName(sha256Dispatch().many) << "\"}"
+			  << ", \"chain_length\": " << chain.size() << ", \"chain_ok\": " << (ok ? "true" : "false")
+			  << ",\n \"phases\": [\n  "
+			  << phase("sha256", t_leaves, lines, bytes, lines) << ",\n  "
+			  << phase(Sha512_256Policy::name(), t_sha512, lines, bytes, lines) << ",\n  "
+			  << phase(Blake2sPolicy::name(), t_blake2s, lines, bytes, lines) << ",\n  "
+			  << phase("getRoot", t_root, lines, bytes, tree_hashes) << ",\n  "
+			  << phase("splitRoot", t_split, lines, bytes, tree_hashes) << ",\n  "
+			  << phase("getHashChain", t_chain, lines, bytes, tree_hashes) << ",\n  "
+			  << phase("verify", t_verify, repeats, repeats*chain.size()*64, repeats*verify_steps)
+			  << "]}" << std::endl;
+
+	return ok ? 0 : 1;
+}
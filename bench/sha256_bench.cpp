@@ -0,0 +1,135 @@
+/**
+ *	Author: Madis Ollikainen
+ *	File:	sha256_bench.cpp
+ *
+ *	Microbenchmark of the SHA256 backends (sha256Backend.hpp)
+ *	against the original OpenSSL based sha256() wrapper. It
+ *	hashes random messages with access log like lengths (the
+ *	leaves) and 64 byte messages (the internal nodes), checks
+ *	that all backends agree with OpenSSL and prints the time
+ *	per hash and the throughput for each backend.
+ *
+ *	Usage:
+ *		./sha256_bench [number_of_messages]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+
+#include "myHashInterface.hpp"
+#include "sha256Backend.hpp"
+
+
+// --- Seconds since an arbitrary point --- //
+static double now()
+{
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// --- Print one result row --- //
+static void report(const std::string& name, const std::string& what, double secs, size_t n, size_t bytes)
+{
+	std::cout << std::left << std::setw(10) << name << std::setw(8) << what << std::right
+			  << std::setw(10) << std::fixed << std::setprecision(1) << 1e9*secs/n << " ns/hash"
+			  << std::setw(10) << std::setprecision(1) << bytes/secs/1e6 << " MB/s" << std::endl;
+}
+
+
+int main( int argc, char **argv )
+{
+	size_t n = (argc > 1) ? strtoull(argv[1], 0, 10) : 1000000;
+	const size_t BATCH = 64;
+
+	// --- Random messages: 100-300 byte leaves and 64 byte nodes --- //
+	std::mt19937 rng(42);
+	std::uniform_int_distribution<int> len_dist(100, 300);
+	std::uniform_int_distribution<int> byte_dist(32, 126);
+	std::vector<std::string> lines(n);
+	size_t leaf_bytes = 0;
+	for (size_t i=0; i<n; ++i)
+	{
+		lines[i].resize(len_dist(rng));
+		for (size_t j=0; j<lines[i].size(); ++j)	{	lines[i][j] = char(byte_dist(rng));	}
+		leaf_bytes += lines[i].size();
+	}
+	std::vector<uint8_t> pairs(64*n);
+	for (size_t i=0; i<pairs.size(); ++i)	{	pairs[i] = uint8_t(rng());	}
+
+	std::vector<const uint8_t*> leaf_ptr(n), node_ptr(n);
+	std::vector<size_t> leaf_len(n), node_len(n, 64);
+	for (size_t i=0; i<n; ++i)
+	{
+		leaf_ptr[i] = reinterpret_cast<const uint8_t*>(lines[i].data());
+		leaf_len[i] = lines[i].size();
+		node_ptr[i] = &pairs[64*i];
+	}
+
+	// --- The reference digests from OpenSSL --- //
+	std::vector<uint8_t> ref_leaf(32*n), ref_node(32*n), out(32*n);
+	for (size_t i=0; i<n; ++i)	{	SHA256(leaf_ptr[i], leaf_len[i], &ref_leaf[32*i]);	}
+	for (size_t i=0; i<n; ++i)	{	SHA256(node_ptr[i], 64, &ref_node[32*i]);	}
+
+	// --- OpenSSL one message at a time --- //
+	double t0 = now();
+	for (size_t i=0; i<n; ++i)	{	SHA256(leaf_ptr[i], leaf_len[i], &out[32*i]);	}
+	double t_ssl_leaf = now() - t0;
+	t0 = now();
+	for (size_t i=0; i<n; ++i)	{	SHA256(node_ptr[i], 64, &out[32*i]);	}
+	double t_ssl_node = now() - t0;
+
+	std::cout << n << " messages, leaves of 100-300 bytes, nodes of 64 bytes, batches of " << BATCH << std::endl;
+	std::cout << "default backends: one=" << sha256BackendName(sha256Dispatch().one)
+			  << " many=" << sha256BackendName(sha256Dispatch().many) << std::endl << std::endl;
+
+	// --- The original wrapper, returning hex std::strings --- //
+	size_t sink = 0;
+	t0 = now();
+	for (size_t i=0; i<n; ++i)	{	sink += sha256(lines[i])[0];	}
+	double t_wrap = now() - t0;
+	report("sha256()", "leaves", t_wrap, n, leaf_bytes);
+	report("SHA256()", "leaves", t_ssl_leaf, n, leaf_bytes);
+	report("SHA256()", "nodes", t_ssl_node, n, 64*n);
+
+	// --- The backends, hashing batches of messages --- //
+	bool all_ok = true;
+	for (int b=SHA256_SCALAR; b<=SHA256_AVX512; ++b)
+	{
+		std::string name = sha256BackendName(sha256_backend_t(b));
+		if( !sha256SetBackend(name) )
+		{
+			std::cout << std::left << std::setw(10) << name << "not supported by this CPU" << std::endl;
+			continue;
+		}
+
+		t0 = now();
+		for (size_t i=0; i<n; i+=BATCH)
+		{
+			sha256Many(&leaf_ptr[i], &leaf_len[i], std::min(BATCH, n-i), &out[32*i]);
+		}
+		double t_leaf = now() - t0;
+		bool ok = (out == ref_leaf);
+
+		t0 = now();
+		for (size_t i=0; i<n; i+=BATCH)
+		{
+			sha256Many(&node_ptr[i], &node_len[i], std::min(BATCH, n-i), &out[32*i]);
+		}
+		double t_node = now() - t0;
+		ok = ok && (out == ref_node);
+
+		report(name, "leaves", t_leaf, n, leaf_bytes);
+		report(name, "nodes", t_node, n, 64*n);
+		if(!ok)
+		{
+			std::cout << name << ": MISMATCH against OpenSSL!" << std::endl;
+			all_ok = false;
+		}
+	}
+
+	return (all_ok && sink != 1) ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+/**
+ *	Author: Madis Ollikainen
+ *	File:	sign_load.cpp
+ *
+ *	Load generator for the signing daemon (see signd.cpp).
+ *	Every client is a thread with a connection of its own,
+ *	which keeps up to window records in flight: it sends a
+ *	record whenever it has less unanswered records than that,
+ *	so a slow daemon slows the clients down.
+ *
+ *	The latency of a record is the time from sending it to
+ *	receiving its hash chain. Every answer is also checked:
+ *	the leaf of the chain must be the hash of the record, the
+ *	chain must be consistent and end in the signed root.
+ *
+ *	The results are printed as one JSON object: the records
+ *	per second and the latency percentiles in milliseconds.
+ *
+ *	Usage:
+ *		./sign_load <socket> [clients] [records_per_client] [window]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "myHashInterface.hpp"
+#include "mySignatureInterface.hpp"
+#include "merkleHasher.hpp"
+
+typedef Sha256Policy P;
+
+
+// --- Seconds since an arbitrary point --- //
+static double now()
+{
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// --- The record i of client c, about as long as a log line --- //
+static std::string record(unsigned c, uint64_t i)
+{
+	std::ostringstream out;
+	out << "10.0." << c % 256 << "." << i % 256 << " - - [client " << c << " record " << i
+		<< "] \"GET /twiki/bin/view/Main/Record" << i * 2654435761u % 100000 << " HTTP/1.1\" 200 " << 1000 + i % 9000;
+	return out.str();
+}
+
+// --- Check an answer of the daemon to the record --- //
+static bool checkAnswer(const std::string& answer, const std::string& rec, MerkleHasher<P>& hasher)
+{
+	std::vector<std::string> field;
+	std::istringstream in(answer);
+	std::string f;
+	while( std::getline(in, f, '\t') )
+	{
+		field.push_back(f);
+	}
+	if( field.size() != 5 )
+	{
+		return false;
+	}
+	hash_chain_t chain;
+	std::istringstream steps(field[4]);
+	std::string step;
+	while( steps >> step )
+	{
+		size_t colon = step.find(':');
+		if( colon == std::string::npos )
+		{
+			return false;
+		}
+		chain.push_back( std::make_pair(atoi(step.c_str()), step.substr(colon + 1)) );
+	}
+	P::digest_t leaf;
+	P::leaf(rec.data(), rec.size(), leaf);
+	return chain.size() >= 1 && chain[0].second == P::toString(leaf)
+		&& hasher.selfConsistentHashChain(chain) && chain.back().second == signedRoot(field[3]);
+}
+
+// --- The results of one client --- //
+struct client_result_t
+{
+	std::vector<double> latency;
+	uint64_t failed;
+	bool ok;
+	client_result_t() : failed(0), ok(true) {}
+};
+
+// --- One client: send the records, keeping up to window in flight --- //
+static void runClient(const std::string& path, unsigned c, uint64_t records, uint64_t window, client_result_t& res)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if( fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 )
+	{
+		res.ok = false;
+		if( fd >= 0 ) { ::close(fd); }
+		return;
+	}
+
+	MerkleHasher<P> hasher;
+	std::vector<double> sent_at(records);
+	res.latency.reserve(records);
+	uint64_t sent = 0;
+	uint64_t answered = 0;
+	std::string out;
+	std::string in;
+	std::vector<char> buf(1 << 16);
+	while( answered < records )
+	{
+		// Queue records up to the window
+		while( sent < records && sent - answered < window && out.size() < (1 << 16) )
+		{
+			out += record(c, sent) + "\n";
+			sent_at[sent++] = now();
+		}
+		pollfd p = { fd, short(POLLIN | (out.empty() ? 0 : POLLOUT)), 0 };
+		if( ::poll(&p, 1, 10000) <= 0 )
+		{
+			res.ok = false;
+			break;
+		}
+		if( p.revents & POLLOUT )
+		{
+			ssize_t n = ::send(fd, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+			if( n > 0 )
+			{
+				out.erase(0, n);
+			}
+		}
+		if( p.revents & (POLLIN | POLLHUP | POLLERR) )
+		{
+			ssize_t n = ::read(fd, buf.data(), buf.size());
+			if( n <= 0 )
+			{
+				res.ok = false;
+				break;
+			}
+			in.append(buf.data(), n);
+			double t = now();
+			size_t begin = 0;
+			size_t end;
+			while( (end = in.find('\n', begin)) != std::string::npos )
+			{
+				std::string answer = in.substr(begin, end - begin);
+				begin = end + 1;
+				uint64_t nr = strtoull(answer.c_str(), 0, 10);
+				if( nr != answered + 1 || !checkAnswer(answer, record(c, answered), hasher) )
+				{
+					res.failed++;
+				}
+				res.latency.push_back(t - sent_at[answered]);
+				answered++;
+			}
+			in.erase(0, begin);
+		}
+	}
+	::close(fd);
+}
+
+
+int main( int argc, char **argv )
+{
+	if(argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <socket> [clients] [records_per_client] [window]" << std::endl;
+		return 1;
+	}
+	std::string path = argv[1];
+	unsigned clients = (argc > 2) ? atoi(argv[2]) : 16;
+	uint64_t records = (argc > 3) ? strtoull(argv[3], 0, 10) : 10000;
+	uint64_t window = (argc > 4) ? strtoull(argv[4], 0, 10) : 64;
+	clients = std::max(1u, clients);
+	window = std::max<uint64_t>(1, window);
+
+	std::vector<client_result_t> results(clients);
+	std::vector<std::thread> threads;
+	double t0 = now();
+	for (unsigned c=0; c<clients; ++c)
+	{
+		threads.push_back( std::thread(runClient, path, c, records, window, std::ref(results[c])) );
+	}
+	for (unsigned c=0; c<clients; ++c)
+	{
+		threads[c].join();
+	}
+	double secs = now() - t0;
+
+	// --- Merge the latencies of the clients --- //
+	std::vector<double> latency;
+	uint64_t failed = 0;
+	bool ok = true;
+	for (unsigned c=0; c<clients; ++c)
+	{
+		latency.insert(latency.end(), results[c].latency.begin(), results[c].latency.end());
+		failed += results[c].failed;
+		ok = ok && results[c].ok;
+	}
+	std::sort(latency.begin(), latency.end());
+	auto percentile = [&](double q)
+		{
+			return latency.empty() ? 0 : 1e3 * latency[ std::min(latency.size() - 1, size_t(q * latency.size())) ];
+		};
+
+	// --- The report --- //
+	std::cout << std::fixed << std::setprecision(3)
+			  << "{\"socket\": \"" << path << "\", \"clients\": " << clients << ", \"records\": " << latency.size()
+			  << ", \"window\": " << window << ", \"seconds\": " << secs
+			  << std::setprecision(1) << ", \"records_per_s\": " << latency.size()/secs
+			  << std::setprecision(3) << ",\n \"latency_ms\": {\"p50\": " << percentile(0.50) << ", \"p90\": " << percentile(0.90)
+			  << ", \"p99\": " << percentile(0.99) << ", \"max\": " << percentile(1.0) << "}"
+			  << ", \"failed\": " << failed << ", \"connected\": " << (ok ? "true" : "false") << "}" << std::endl;
+
+	return (ok && failed == 0) ? 0 : 1;
+}
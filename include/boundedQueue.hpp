@@ -0,0 +1,71 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	boundedQueue.hpp
+ *
+ *	Implements the class template BoundedQueue, a blocking
+ *	queue with a fixed capacity, through which the stages of
+ *	LeafPipeline and the Decompressor hand over their work.
+ */
+
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+// --- A blocking queue with a fixed capacity --- //
+template <class T>
+class BoundedQueue
+{
+
+public:
+
+	BoundedQueue(size_t capacity) : cap(capacity), closed(false) {}
+
+	// --- Push, blocks while the queue is full --- //
+	void push(const T& item)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		not_full.wait(lock, [this]{ return items.size() < cap; });
+		items.push_back(item);
+		not_empty.notify_one();
+	}
+
+	// --- Pop, blocks while the queue is empty. Returns --- //
+	// --- false once the queue is closed and drained.   --- //
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		not_empty.wait(lock, [this]{ return !items.empty() || closed; });
+		if(items.empty())
+		{
+			return false;
+		}
+		item = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	// --- No more items will be pushed --- //
+	void close()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		closed = true;
+		not_empty.notify_all();
+	}
+
+private:
+	size_t cap;
+	bool closed;
+	std::deque<T> items;
+	std::mutex mtx;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+
+}; // END BoundedQueue
+
+
+#endif // BOUNDED_QUEUE_HPP
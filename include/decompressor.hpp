@@ -0,0 +1,396 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	decompressor.hpp
+ *
+ *	Implements the Decompressor class, which decompresses a
+ *	gzip (or, compiled with -DHAVE_ZSTD, a zstd) stream on a
+ *	thread of its own, so that the decompression overlaps the
+ *	hashing of the lines. LineReader reads compressed logs
+ *	through it as if they were plain files.
+ *
+ *	The decompressed data is handed over in blocks: a fixed
+ *	number of blocks circulate between a free and a full
+ *	BoundedQueue, thus the memory use stays flat. Streams of
+ *	several members (or frames), as written by appending to a
+ *	compressed log, are decompressed one after the other.
+ */
+
+#ifndef DECOMPRESSOR_HPP
+#define DECOMPRESSOR_HPP
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "boundedQueue.hpp"
+
+
+// ------------------------------------ //
+// ----- Decompressor DECLARATION ----- //
+// ------------------------------------ //
+class Decompressor
+{
+
+public:
+
+	// --- The formats, recognised by their magic bytes --- //
+	enum format_t { PLAIN, GZIP, ZSTD };
+
+	// The number of bytes needed to recognise the format
+	static const size_t MAGIC_SIZE = 4;
+
+	// --- The format of data starting with the given bytes --- //
+	// ZSTD is only recognised if it is compiled in.
+	static format_t detect(const char* head, size_t len);
+
+	// --- The format of a file, PLAIN if it can not be read --- //
+	static format_t detectFile(const std::string& file);
+
+	// --- Start decompressing fd, of which head was already read --- //
+	Decompressor(int fd, format_t format, const char* head, size_t head_len);
+
+	// --- Stops the thread, also when not read to the end --- //
+	~Decompressor();
+
+	// --- Read up to len decompressed bytes, 0 at the end --- //
+	size_t read(char* out, size_t len);
+
+	// --- Whether the stream was broken or could not be read --- //
+	bool failed() const { return broken; }
+
+private:
+	Decompressor(const Decompressor&);
+	Decompressor& operator=(const Decompressor&);
+
+	// --- A block of decompressed data --- //
+	struct Block
+	{
+		std::vector<char> data;
+		size_t size;
+	};
+
+	// --- The decompressing thread --- //
+	void run();
+
+	// --- Read compressed input, the head first --- //
+	size_t input(char* out, size_t len);
+
+	// --- Decompress the whole stream, passing the output to emit --- //
+	template <class E>
+	bool inflateGzip(E& emit);
+#ifdef HAVE_ZSTD
+	template <class E>
+	bool inflateZstd(E& emit);
+#endif
+
+	int fd;
+	format_t format;
+	std::string head;
+	size_t head_pos;
+
+	std::vector<Block> blocks;
+	BoundedQueue<Block*> free_q;
+	BoundedQueue<Block*> full_q;
+	std::thread thread;
+	std::atomic<bool> broken;
+
+	// The block being read and the read position in it
+	Block* current;
+	size_t current_pos;
+
+	static const size_t BLOCK_SIZE = 1 << 20;
+	static const size_t BLOCKS = 4;
+	static const size_t INPUT_SIZE = 256 << 10;
+
+}; // END DECOMPRESSOR DECLARATION
+
+
+
+// --------------------------------------- //
+// ----- Decompressor IMPLEMENTATION ----- //
+// --------------------------------------- //
+
+
+// --- The format of data starting with the given bytes --- //
+inline Decompressor::format_t Decompressor::detect(const char* head, size_t len)
+{
+	const unsigned char* h = reinterpret_cast<const unsigned char*>(head);
+	if( len >= 2 && h[0] == 0x1f && h[1] == 0x8b )
+	{
+		return GZIP;
+	}
+#ifdef HAVE_ZSTD
+	if( len >= 4 && h[0] == 0x28 && h[1] == 0xb5 && h[2] == 0x2f && h[3] == 0xfd )
+	{
+		return ZSTD;
+	}
+#endif
+	return PLAIN;
+} // END detect
+
+
+// --- The format of a file --- //
+inline Decompressor::format_t Decompressor::detectFile(const std::string& file)
+{
+	char magic[MAGIC_SIZE];
+	ssize_t n = 0;
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if( fd >= 0 )
+	{
+		n = pread(fd, magic, sizeof(magic), 0);
+		::close(fd);
+	}
+	return detect(magic, (n > 0) ? n : 0);
+} // END detectFile
+
+
+// --- Start decompressing fd --- //
+inline Decompressor::Decompressor(int input_fd, format_t f, const char* h, size_t h_len)
+	: fd(input_fd), format(f), head(h, h_len), head_pos(0), blocks(BLOCKS),
+	  free_q(BLOCKS), full_q(BLOCKS), broken(false), current(0), current_pos(0)
+{
+	for (size_t i=0; i<blocks.size(); ++i)
+	{
+		blocks[i].data.resize(BLOCK_SIZE);
+		free_q.push(&blocks[i]);
+	}
+	thread = std::thread(&Decompressor::run, this);
+} // END Decompressor
+
+
+// --- Stops the thread --- //
+// Closing the free queue wakes the thread if it waits for a block.
+inline Decompressor::~Decompressor()
+{
+	free_q.close();
+	thread.join();
+} // END ~Decompressor
+
+
+// --- Read up to len decompressed bytes --- //
+inline size_t Decompressor::read(char* out, size_t len)
+{
+	size_t got = 0;
+	while( got < len )
+	{
+		if( current == 0 )
+		{
+			// Only wait for a block if there is nothing to return
+			if( got > 0 || !full_q.pop(current) )
+			{
+				break;
+			}
+			current_pos = 0;
+		}
+		size_t n = std::min(len - got, current->size - current_pos);
+		memcpy(out + got, current->data.data() + current_pos, n);
+		got += n;
+		current_pos += n;
+		if( current_pos == current->size )
+		{
+			free_q.push(current);
+			current = 0;
+		}
+	}
+	return got;
+} // END read
+
+
+// --- Read compressed input, the head first --- //
+inline size_t Decompressor::input(char* out, size_t len)
+{
+	if( head_pos < head.size() )
+	{
+		size_t n = std::min(len, head.size() - head_pos);
+		memcpy(out, head.data() + head_pos, n);
+		head_pos += n;
+		return n;
+	}
+	ssize_t n;
+	do
+	{
+		n = ::read(fd, out, len);
+	} while(n < 0 && errno == EINTR);
+	if( n < 0 )
+	{
+		broken = true;
+		return 0;
+	}
+	return n;
+} // END input
+
+
+// --- The decompressing thread --- //
+// The output is collected into blocks, a full block is
+// handed to the reader. Returns once the stream ends or
+// the reader is gone.
+inline void Decompressor::run()
+{
+	Block* b = 0;
+	bool stopped = false;
+	auto emit = [&](const char* data, size_t len)
+		{
+			while( len > 0 )
+			{
+				if( b == 0 )
+				{
+					if( !free_q.pop(b) )
+					{
+						stopped = true;
+						return false;
+					}
+					b->size = 0;
+				}
+				size_t n = std::min(len, b->data.size() - b->size);
+				memcpy(b->data.data() + b->size, data, n);
+				b->size += n;
+				data += n;
+				len -= n;
+				if( b->size == b->data.size() )
+				{
+					full_q.push(b);
+					b = 0;
+				}
+			}
+			return true;
+		};
+
+	bool ok = false;
+	if( format == GZIP )
+	{
+		ok = inflateGzip(emit);
+	}
+#ifdef HAVE_ZSTD
+	else if( format == ZSTD )
+	{
+		ok = inflateZstd(emit);
+	}
+#endif
+	if( !ok && !stopped )
+	{
+		broken = true;
+	}
+	if( b != 0 && b->size > 0 && !stopped )
+	{
+		full_q.push(b);
+	}
+	full_q.close();
+} // END run
+
+
+// --- Decompress a gzip stream --- //
+// Returns false if the stream is broken or ends in the middle of a member.
+template <class E>
+bool Decompressor::inflateGzip(E& emit)
+{
+	std::vector<char> in(INPUT_SIZE);
+	std::vector<char> out(INPUT_SIZE);
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	// 16 + MAX_WBITS: gzip only
+	if( inflateInit2(&z, 16 + MAX_WBITS) != Z_OK )
+	{
+		return false;
+	}
+	bool ok = true;
+	bool in_member = true;
+	bool more = true;
+	bool eof = false;
+	while( ok && more )
+	{
+		if( z.avail_in == 0 && !eof )
+		{
+			size_t n = input(in.data(), in.size());
+			eof = (n == 0);
+			z.next_in = reinterpret_cast<Bytef*>(in.data());
+			z.avail_in = n;
+		}
+		if( eof && z.avail_in == 0 && !in_member )
+		{
+			break;
+		}
+		// A new member after the end of the last one
+		if( !in_member )
+		{
+			inflateReset(&z);
+			in_member = true;
+		}
+		z.next_out = reinterpret_cast<Bytef*>(out.data());
+		z.avail_out = out.size();
+		int ret = inflate(&z, Z_NO_FLUSH);
+		if( (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || (ret == Z_BUF_ERROR && eof) )
+		{
+			// Broken, or cut off in the middle of a member
+			ok = false;
+			break;
+		}
+		more = emit(out.data(), out.size() - z.avail_out);
+		if( ret == Z_STREAM_END )
+		{
+			in_member = false;
+		}
+	}
+	inflateEnd(&z);
+	return ok && more && !in_member && !broken;
+} // END inflateGzip
+
+
+#ifdef HAVE_ZSTD
+// --- Decompress a zstd stream --- //
+// Returns false if the stream is broken or ends in the middle of a frame.
+template <class E>
+bool Decompressor::inflateZstd(E& emit)
+{
+	std::vector<char> in(ZSTD_DStreamInSize());
+	std::vector<char> out(ZSTD_DStreamOutSize());
+	ZSTD_DStream* z = ZSTD_createDStream();
+	if( z == 0 )
+	{
+		return false;
+	}
+	ZSTD_initDStream(z);
+	bool ok = true;
+	bool more = true;
+	bool eof = false;
+	size_t left = 0;
+	ZSTD_inBuffer src = { in.data(), 0, 0 };
+	while( ok && more )
+	{
+		if( src.pos == src.size && !eof )
+		{
+			size_t n = input(in.data(), in.size());
+			eof = (n == 0);
+			src.size = n;
+			src.pos = 0;
+		}
+		ZSTD_outBuffer dst = { out.data(), out.size(), 0 };
+		left = ZSTD_decompressStream(z, &dst, &src);
+		if( ZSTD_isError(left) )
+		{
+			ok = false;
+			break;
+		}
+		more = emit(out.data(), dst.pos);
+		// At the end once nothing more comes out
+		if( eof && dst.pos == 0 )
+		{
+			break;
+		}
+	}
+	ZSTD_freeDStream(z);
+	return ok && more && left == 0 && !broken;
+} // END inflateZstd
+#endif
+
+
+#endif // DECOMPRESSOR_HPP
@@ -0,0 +1,513 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	directReader.hpp
+ *
+ *	Implements the DirectReader class, which reads a byte range
+ *	of a large log file past the page cache, so that hashing a
+ *	cold archive does not evict the data of other services:
+ *		a)	The file is opened with O_DIRECT and read in large
+ *			aligned chunks, BUFFERS of them in flight at once.
+ *		b)	The reads are queued through io_uring (with the raw
+ *			system calls, no liburing needed). Where io_uring is
+ *			not available, a few threads issue plain preads.
+ *		c)	If the file system refuses O_DIRECT, the file is read
+ *			normally and the pages read are dropped from the page
+ *			cache with posix_fadvise once they are consumed.
+ *
+ *	The chunks are handed out in order as a stream of bytes
+ *	through read(), LineReader cutting them into lines (lines
+ *	spanning two chunks are joined by its streaming buffer).
+ */
+
+#ifndef DIRECT_READER_HPP
+#define DIRECT_READER_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "boundedQueue.hpp"
+
+
+// ------------------------------------ //
+// ----- DirectReader DECLARATION ----- //
+// ------------------------------------ //
+class DirectReader
+{
+
+public:
+
+	// --- Start reading the bytes [begin, end) of the file --- //
+	DirectReader(const std::string& file, uint64_t begin, uint64_t end);
+
+	// --- Waits for the reads in flight and closes the file --- //
+	~DirectReader();
+
+	// --- Whether the file could be opened --- //
+	bool is_open() const { return fd >= 0; }
+
+	// --- Read up to len bytes, 0 at the end --- //
+	size_t read(char* out, size_t len);
+
+	// --- Whether a read failed --- //
+	bool failed() const { return broken; }
+
+	// --- How the file is read: "io_uring" or "pread", direct or not --- //
+	const char* backend() const { return ring_fd >= 0 ? "io_uring" : "pread"; }
+	bool direct() const { return o_direct; }
+
+	// The chunks in flight and their size
+	static const size_t BUFFERS = 8;
+	static const size_t BUFFER_SIZE = 4 << 20;
+
+	// O_DIRECT offsets, sizes and buffers are aligned to this
+	static const size_t ALIGN = 4096;
+
+private:
+	DirectReader(const DirectReader&);
+	DirectReader& operator=(const DirectReader&);
+
+	// --- A chunk buffer and the state of its read --- //
+	struct Slot
+	{
+		char* data;
+		uint64_t offset;
+		struct iovec iov;
+		bool busy;
+		bool done;
+		ssize_t result;
+
+		Slot() : data(0), offset(0), busy(false), done(false), result(0) {}
+	};
+
+	// --- Queue the read of the next chunk into a slot --- //
+	void submit(size_t s);
+
+	// --- Wait until the read of a slot is done --- //
+	void complete(size_t s);
+
+	// --- The io_uring backend --- //
+	bool setupRing();
+	void closeRing();
+	bool ringSubmit(size_t s);
+	void ringReap(bool wait);
+
+	// --- The pread backend --- //
+	void preadWorker();
+
+	int fd;
+	bool o_direct;
+	uint64_t begin;
+	uint64_t end;
+	uint64_t next_offset;
+	std::atomic<bool> broken;
+
+	std::vector<Slot> slots;
+	size_t current;
+	size_t current_pos;
+
+	// io_uring: the ring and its mapped queues
+	int ring_fd;
+	void* sq_map;
+	size_t sq_map_size;
+	void* cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	// pread: the workers, the slots to read and the finished ones
+	std::vector<std::thread> workers;
+	BoundedQueue<size_t> requests;
+	std::mutex done_mtx;
+	std::condition_variable done_cv;
+
+	static const unsigned PREAD_THREADS = 4;
+
+}; // END DIRECTREADER DECLARATION
+
+
+
+// --------------------------------------- //
+// ----- DirectReader IMPLEMENTATION ----- //
+// --------------------------------------- //
+
+
+// --- Start reading the bytes [begin, end) of the file --- //
+// The reads start from the aligned offset below begin.
+inline DirectReader::DirectReader(const std::string& file, uint64_t range_begin, uint64_t range_end)
+	: fd(-1), o_direct(true), begin(range_begin), end(range_end), broken(false), slots(BUFFERS), current(0), current_pos(0),
+	  ring_fd(-1), sq_map(MAP_FAILED), sq_map_size(0), cq_map(MAP_FAILED), cq_map_size(0), sqes(0), sqes_size(0),
+	  requests(BUFFERS)
+{
+	fd = ::open(file.c_str(), O_RDONLY | O_DIRECT);
+	if( fd < 0 )
+	{
+		o_direct = false;
+		fd = ::open(file.c_str(), O_RDONLY);
+	}
+	if( fd < 0 )
+	{
+		return;
+	}
+	struct stat st;
+	if( fstat(fd, &st) == 0 )
+	{
+		end = std::min<uint64_t>(end, st.st_size);
+	}
+	if( !o_direct )
+	{
+		posix_fadvise(fd, begin, end - std::min(begin, end), POSIX_FADV_SEQUENTIAL);
+	}
+
+	for (size_t s=0; s<slots.size(); ++s)
+	{
+		void* p = 0;
+		if( posix_memalign(&p, ALIGN, BUFFER_SIZE) != 0 )
+		{
+			p = 0;
+		}
+		slots[s].data = static_cast<char*>(p);
+		if( p == 0 )
+		{
+			broken = true;
+		}
+	}
+	if( broken )
+	{
+		return;
+	}
+
+	// io_uring if possible, else threads with pread
+	if( !setupRing() )
+	{
+		closeRing();
+		for (unsigned t=0; t<PREAD_THREADS; ++t)
+		{
+			workers.push_back( std::thread(&DirectReader::preadWorker, this) );
+		}
+	}
+
+	// Fill the pipeline
+	next_offset = begin - begin % ALIGN;
+	for (size_t s=0; s<slots.size(); ++s)
+	{
+		submit(s);
+	}
+} // END DirectReader
+
+
+// --- Waits for the reads in flight and closes the file --- //
+inline DirectReader::~DirectReader()
+{
+	for (size_t s=0; s<slots.size(); ++s)
+	{
+		if( slots[s].busy )
+		{
+			complete(s);
+		}
+	}
+	requests.close();
+	for (size_t t=0; t<workers.size(); ++t)
+	{
+		workers[t].join();
+	}
+	closeRing();
+	for (size_t s=0; s<slots.size(); ++s)
+	{
+		free(slots[s].data);
+	}
+	if( fd >= 0 )
+	{
+		::close(fd);
+	}
+} // END ~DirectReader
+
+
+// --- Read up to len bytes --- //
+// The chunks are consumed in order, slot after slot. A consumed
+// slot is refilled with the chunk BUFFERS chunks further on.
+inline size_t DirectReader::read(char* out, size_t len)
+{
+	size_t got = 0;
+	while( got < len && fd >= 0 && !broken )
+	{
+		Slot& slot = slots[current];
+		if( !slot.busy )
+		{
+			// No more chunks
+			break;
+		}
+		complete(current);
+		if( slot.result < 0 )
+		{
+			broken = true;
+			break;
+		}
+
+		// The valid bytes of the chunk: from begin (in the first
+		// chunk) up to end or up to where the file ended
+		uint64_t first = std::max(begin, slot.offset);
+		uint64_t last = std::min(end, slot.offset + slot.result);
+		if( slot.result < ssize_t(BUFFER_SIZE) && slot.offset + slot.result < end )
+		{
+			// A short read before the end
+			broken = true;
+			break;
+		}
+		size_t avail = (last > first) ? last - first : 0;
+		size_t skip = first - slot.offset;
+		size_t n = std::min(len - got, avail - std::min<size_t>(current_pos, avail));
+		memcpy(out + got, slot.data + skip + current_pos, n);
+		got += n;
+		current_pos += n;
+		if( current_pos >= avail )
+		{
+			// Done with the chunk, drop it from the page cache
+			// if it went through it
+			if( !o_direct )
+			{
+				posix_fadvise(fd, slot.offset, BUFFER_SIZE, POSIX_FADV_DONTNEED);
+			}
+			slot.busy = false;
+			submit(current);
+			current = (current + 1) % slots.size();
+			current_pos = 0;
+		}
+	}
+	return got;
+} // END read
+
+
+// --- Queue the read of the next chunk into a slot --- //
+inline void DirectReader::submit(size_t s)
+{
+	if( next_offset >= end )
+	{
+		return;
+	}
+	Slot& slot = slots[s];
+	slot.offset = next_offset;
+	slot.iov.iov_base = slot.data;
+	slot.iov.iov_len = BUFFER_SIZE;
+	slot.busy = true;
+	slot.done = false;
+	next_offset += BUFFER_SIZE;
+	if( ring_fd >= 0 )
+	{
+		if( !ringSubmit(s) )
+		{
+			slot.result = -EIO;
+			slot.done = true;
+		}
+	}
+	else
+	{
+		requests.push(s);
+	}
+} // END submit
+
+
+// --- Wait until the read of a slot is done --- //
+inline void DirectReader::complete(size_t s)
+{
+	if( ring_fd >= 0 )
+	{
+		while( !slots[s].done )
+		{
+			ringReap(true);
+		}
+		return;
+	}
+	std::unique_lock<std::mutex> lock(done_mtx);
+	done_cv.wait(lock, [&]{ return slots[s].done; });
+} // END complete
+
+
+// --- The pread backend --- //
+inline void DirectReader::preadWorker()
+{
+	size_t s;
+	while( requests.pop(s) )
+	{
+		Slot& slot = slots[s];
+		ssize_t total = 0;
+		while( total < ssize_t(BUFFER_SIZE) )
+		{
+			ssize_t n = pread(fd, slot.data + total, BUFFER_SIZE - total, slot.offset + total);
+			if( n < 0 && errno == EINTR )	{	continue;	}
+			if( n < 0 )	{	total = -errno;	break;	}
+			if( n == 0 )	{	break;	}
+			total += n;
+		}
+		std::unique_lock<std::mutex> lock(done_mtx);
+		slot.result = total;
+		slot.done = true;
+		done_cv.notify_all();
+	}
+} // END preadWorker
+
+
+// --- Set up an io_uring, returns false if not possible --- //
+inline bool DirectReader::setupRing()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(__NR_io_uring_setup, BUFFERS, &p);
+	if( ring_fd < 0 )
+	{
+		return false;
+	}
+
+	sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if( p.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+	}
+	sq_map = mmap(0, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if( sq_map == MAP_FAILED )
+	{
+		return false;
+	}
+	if( p.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		cq_map = sq_map;
+	}
+	else
+	{
+		cq_map = mmap(0, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if( cq_map == MAP_FAILED )
+		{
+			return false;
+		}
+	}
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	void* s = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if( s == MAP_FAILED )
+	{
+		return false;
+	}
+	sqes = static_cast<struct io_uring_sqe*>(s);
+
+	char* sq = static_cast<char*>(sq_map);
+	char* cq = static_cast<char*>(cq_map);
+	sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+	return true;
+} // END setupRing
+
+
+// --- Unmap and close the io_uring --- //
+inline void DirectReader::closeRing()
+{
+	if( sqes != 0 )
+	{
+		munmap(sqes, sqes_size);
+		sqes = 0;
+	}
+	if( cq_map != MAP_FAILED && cq_map != sq_map )
+	{
+		munmap(cq_map, cq_map_size);
+	}
+	if( sq_map != MAP_FAILED )
+	{
+		munmap(sq_map, sq_map_size);
+	}
+	sq_map = cq_map = MAP_FAILED;
+	if( ring_fd >= 0 )
+	{
+		::close(ring_fd);
+		ring_fd = -1;
+	}
+} // END closeRing
+
+
+// --- Queue a readv of the slot into the submission queue --- //
+inline bool DirectReader::ringSubmit(size_t s)
+{
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	struct io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = slots[s].offset;
+	sqe->addr = reinterpret_cast<uint64_t>(&slots[s].iov);
+	sqe->len = 1;
+	sqe->user_data = s;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	int ret;
+	do
+	{
+		ret = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, 0, 0);
+	} while( ret < 0 && errno == EINTR );
+	return ret == 1;
+} // END ringSubmit
+
+
+// --- Collect the completed reads, waiting for one if asked --- //
+inline void DirectReader::ringReap(bool wait)
+{
+	unsigned head = *cq_head;
+	if( wait && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) )
+	{
+		int ret = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0);
+		if( ret < 0 && errno != EINTR )
+		{
+			// Should not happen, give up on the reads in flight
+			for (size_t s=0; s<slots.size(); ++s)
+			{
+				if( slots[s].busy && !slots[s].done )
+				{
+					slots[s].result = -errno;
+					slots[s].done = true;
+				}
+			}
+			return;
+		}
+	}
+	while( head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) )
+	{
+		struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+		Slot& slot = slots[cqe->user_data];
+		slot.result = cqe->res;
+		slot.done = true;
+		++head;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+} // END ringReap
+
+
+#endif // DIRECT_READER_HPP
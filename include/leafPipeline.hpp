@@ -0,0 +1,255 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	leafPipeline.hpp
+ *
+ *	Implements the class template LeafPipeline, which hashes
+ *	the lines of a file into leaf digests on several threads
+ *	and hands the leaves out in the order of the lines. The
+ *	pipeline has three stages:
+ *		a)	A reader thread cuts the file into batches of lines.
+ *		b)	A pool of workers hashes the batches into leaves.
+ *		c)	The calling thread (the merger) receives the leaves
+ *			batch by batch in the original order.
+ *
+ *	A fixed number of batch objects circulate between the
+ *	stages and are recycled, thus the memory use stays flat
+ *	whatever the size of the file.
+ *
+ *	LeafPipeline is templated on the hash policy (see
+ *	myHashInterface.hpp).
+ */
+
+#ifndef LEAF_PIPELINE_HPP
+#define LEAF_PIPELINE_HPP
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "lineReader.hpp"
+#include "boundedQueue.hpp"
+#include "merkleStats.hpp"
+
+
+// ------------------------------------ //
+// ----- LeafPipeline DECLARATION ----- //
+// ------------------------------------ //
+template <class P>
+class LeafPipeline
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	// --- A batch of lines and their leaves --- //
+	struct Batch
+	{
+		size_t seq;
+		std::vector<const char*> line;
+		std::vector<size_t> len;
+		std::vector<digest_t> leaves;
+		// Copies of the lines, if the reader is not memory-mapped
+		std::string storage;
+	};
+
+	LeafPipeline(unsigned workers, size_t batch_lines = 4096, size_t batch_bytes = 1 << 20);
+
+	// --- Hash the lines of file and call f(leaf) for every leaf in order --- //
+	// Only the bytes [begin, end) of the file are read (see LineReader).
+	// Returns false if the file could not be opened.
+	template <class F>
+	bool run(const std::string& file, F f, uint64_t begin = 0, uint64_t end = UINT64_MAX);
+
+	// --- Whether the last run could not read the file to its end --- //
+	bool failed() const { return input_failed; }
+
+	// --- Read the file past the page cache (see LineReader) --- //
+	void setDirectInput(bool on) { direct = on; }
+
+private:
+	// --- The reader and worker stages --- //
+	void reader(LineReader& input);
+	void worker();
+
+	unsigned n_workers;
+	size_t batch_lines;
+	size_t batch_bytes;
+
+	// The batch objects and the queues passing them around
+	std::vector<Batch> batches;
+	BoundedQueue<Batch*> free_q;
+	BoundedQueue<Batch*> work_q;
+
+	// The hashed batches, indexed by seq % batches.size()
+	std::vector<Batch*> done;
+	size_t total;
+	bool total_known;
+	bool input_failed;
+	bool direct;
+	std::mutex done_mtx;
+	std::condition_variable done_cv;
+
+}; // END LEAFPIPELINE DECLARATION
+
+
+
+// --------------------------------------- //
+// ----- LeafPipeline IMPLEMENTATION ----- //
+// --------------------------------------- //
+
+
+// --- Constructor --- //
+template <class P>
+LeafPipeline<P>::LeafPipeline(unsigned workers, size_t lines, size_t bytes)
+	: n_workers(workers < 1 ? 1 : workers), batch_lines(lines), batch_bytes(bytes),
+	  batches(2*n_workers + 2), free_q(batches.size()), work_q(batches.size()),
+	  done(batches.size(), 0), total(0), total_known(false), input_failed(false), direct(false)
+{
+} // END LeafPipeline
+
+
+// --- Hash the lines of file and call f(leaf) for every leaf in order --- //
+template <class P>
+template <class F>
+bool LeafPipeline<P>::run(const std::string& file, F f, uint64_t begin, uint64_t end)
+{
+	LineReader input(file, begin, end, direct);
+	if(!input.is_open())
+	{
+		return false;
+	}
+
+	// All batches start out free
+	for (size_t i=0; i<batches.size(); ++i)
+	{
+		free_q.push(&batches[i]);
+	}
+
+	// Start the reader and the workers
+	std::thread read_thread(&LeafPipeline<P>::reader, this, std::ref(input));
+	std::vector<std::thread> work_threads;
+	for (unsigned i=0; i<n_workers; ++i)
+	{
+		work_threads.push_back( std::thread(&LeafPipeline<P>::worker, this) );
+	}
+
+	// Merge the batches in order and recycle them
+	for (size_t seq=0; ; ++seq)
+	{
+		Batch* b;
+		{
+			std::unique_lock<std::mutex> lock(done_mtx);
+			size_t slot = seq % done.size();
+			done_cv.wait(lock, [&]{ return done[slot] != 0 || (total_known && seq == total); });
+			if(done[slot] == 0)
+			{
+				break;
+			}
+			b = done[slot];
+			done[slot] = 0;
+		}
+		{
+			MERKLE_STATS_TIMER(merge_ns);
+			for (size_t i=0; i<b->leaves.size(); ++i)
+			{
+				f(b->leaves[i]);
+			}
+		}
+		free_q.push(b);
+	}
+
+	read_thread.join();
+	for (unsigned i=0; i<n_workers; ++i)
+	{
+		work_threads[i].join();
+	}
+	input_failed = input.failed();
+	return true;
+} // END run
+
+
+// --- The reader stage --- //
+template <class P>
+void LeafPipeline<P>::reader(LineReader& input)
+{
+	bool copy = !input.mapped();
+	size_t seq = 0;
+	const char* line;
+	size_t len;
+	bool more = input.next(line, len);
+	while(more)
+	{
+		Batch* b = 0;
+		free_q.pop(b);
+		b->seq = seq++;
+		b->line.clear();
+		b->len.clear();
+		b->storage.clear();
+
+		// Fill the batch up to the line and byte limits
+		{
+			MERKLE_STATS_TIMER(read_ns);
+			size_t bytes = 0;
+			while(more && b->line.size() < batch_lines && bytes < batch_bytes)
+			{
+				if(copy)
+				{
+					// Remember the offset, the pointer is fixed
+					// once the storage does not grow anymore
+					b->line.push_back( reinterpret_cast<const char*>(b->storage.size()) );
+					b->storage.append(line, len);
+				}
+				else
+				{
+					b->line.push_back(line);
+				}
+				b->len.push_back(len);
+				bytes += len;
+				more = input.next(line, len);
+			}
+			if(copy)
+			{
+				for (size_t i=0; i<b->line.size(); ++i)
+				{
+					b->line[i] = b->storage.data() + reinterpret_cast<size_t>(b->line[i]);
+				}
+			}
+			MERKLE_STATS_ADD(bytes_read, bytes + b->line.size());
+		}
+		work_q.push(b);
+	}
+	work_q.close();
+
+	// Tell the merger how many batches there are
+	std::unique_lock<std::mutex> lock(done_mtx);
+	total = seq;
+	total_known = true;
+	done_cv.notify_all();
+} // END reader
+
+
+// --- The worker stage --- //
+template <class P>
+void LeafPipeline<P>::worker()
+{
+	Batch* b;
+	while(work_q.pop(b))
+	{
+		b->leaves.resize(b->line.size());
+		{
+			MERKLE_STATS_TIMER(leaf_ns);
+			P::leaves(b->line.data(), b->len.data(), b->line.size(), b->leaves.data());
+		}
+		MERKLE_STATS_ADD(lines, b->line.size());
+		MERKLE_STATS_ADD(leaf_hashes, b->line.size());
+		std::unique_lock<std::mutex> lock(done_mtx);
+		done[b->seq % done.size()] = b;
+		done_cv.notify_all();
+	}
+} // END worker
+
+
+#endif // LEAF_PIPELINE_HPP
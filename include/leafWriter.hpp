@@ -0,0 +1,237 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	leafWriter.hpp
+ *
+ *	Implements the class template LeafWriter, which streams
+ *	the leaves of a Merkle tree into a file as they are
+ *	hashed, so that saving the leaves takes constant memory
+ *	whatever the size of the log:
+ *		a)	Hex format: one leaf per line, as P::toString.
+ *		b)	Binary format: the P::DIGEST_SIZE bytes of each
+ *			leaf back to back (fixed size digests only).
+ *
+ *	The leaves are collected into a large buffer, which is
+ *	written out with a single write call whenever it fills.
+ */
+
+#ifndef LEAF_WRITER_HPP
+#define LEAF_WRITER_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cctype>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "myHashInterface.hpp"
+
+
+// ---------------------------------- //
+// ----- LeafWriter DECLARATION ----- //
+// ---------------------------------- //
+template <class P>
+class LeafWriter
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	LeafWriter() : fd(-1), binary(false), ok(false), count(0) {}
+	~LeafWriter() { close(); }
+
+	// --- Open the leaves file, returns false on error --- //
+	// With append the leaves are added to the end of the file,
+	// which must then be empty or of the same format.
+	bool open(const std::string& leaves_file, bool binary_format, bool append);
+	bool is_open() const { return fd >= 0; }
+
+	// --- Add the next leaf --- //
+	void add(const digest_t& leaf);
+
+	// --- Write out the buffer and close the file, returns false on error --- //
+	bool close();
+
+	// --- Number of leaves written since open --- //
+	uint64_t written() const { return count; }
+
+private:
+	LeafWriter(const LeafWriter&);
+	LeafWriter& operator=(const LeafWriter&);
+
+	// --- Write out the buffer --- //
+	void flush();
+
+	// --- Whether the leaves already in the file are of the format --- //
+	bool sameFormat(bool binary_format) const;
+
+	int fd;
+	bool binary;
+	bool ok;
+	uint64_t count;
+	std::vector<char> buf;
+	size_t used;
+
+	static const size_t BUFFER_SIZE = 1 << 20;
+
+}; // END LEAFWRITER DECLARATION
+
+
+
+// ------------------------------------- //
+// ----- LeafWriter IMPLEMENTATION ----- //
+// ------------------------------------- //
+
+
+// --- Open the leaves file --- //
+template <class P>
+bool LeafWriter<P>::open(const std::string& leaves_file, bool binary_format, bool append)
+{
+	close();
+	if( binary_format && P::DIGEST_SIZE == 0 )
+	{
+		return false;
+	}
+	fd = ::open(leaves_file.c_str(), (append ? O_RDWR | O_APPEND : O_WRONLY | O_TRUNC) | O_CREAT, 0644);
+	if( fd < 0 )
+	{
+		return false;
+	}
+	if( append && !sameFormat(binary_format) )
+	{
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	binary = binary_format;
+	ok = true;
+	count = 0;
+	buf.resize(BUFFER_SIZE);
+	used = 0;
+	return true;
+} // END open
+
+
+// --- Add the next leaf --- //
+// A hex leaf of a fixed size digest is encoded straight into
+// the buffer, other digests go through P::toString.
+template <class P>
+void LeafWriter<P>::add(const digest_t& leaf)
+{
+	size_t need = binary ? P::DIGEST_SIZE : 2*P::DIGEST_SIZE + 1;
+	if( P::DIGEST_SIZE == 0 )
+	{
+		std::string text = P::toString(leaf);
+		if( used + text.size() + 1 > buf.size() )
+		{
+			flush();
+		}
+		if( text.size() + 1 > buf.size() )
+		{
+			buf.resize(text.size() + 1);
+		}
+		text.copy(&buf[used], text.size());
+		used += text.size();
+		buf[used++] = '\n';
+		++count;
+		return;
+	}
+
+	if( used + need > buf.size() )
+	{
+		flush();
+	}
+	uint8_t bytes[P::DIGEST_SIZE ? P::DIGEST_SIZE : 1];
+	P::toBytes(leaf, bytes);
+	if( binary )
+	{
+		memcpy(&buf[used], bytes, P::DIGEST_SIZE);
+	}
+	else
+	{
+		toHex(bytes, P::DIGEST_SIZE, &buf[used]);
+		buf[used + need - 1] = '\n';
+	}
+	used += need;
+	++count;
+} // END add
+
+
+// --- Write out the buffer --- //
+template <class P>
+void LeafWriter<P>::flush()
+{
+	const char* p = buf.data();
+	size_t len = used;
+	while( ok && len > 0 )
+	{
+		ssize_t n = ::write(fd, p, len);
+		if( n < 0 && errno == EINTR )	{	continue;	}
+		if( n <= 0 )	{	ok = false;	break;	}
+		p += n;
+		len -= n;
+	}
+	used = 0;
+} // END flush
+
+
+// --- Whether the leaves already in the file are of the format --- //
+// Hex leaves of fixed size digests are lines of 2*P::DIGEST_SIZE hex
+// digits, binary ones P::DIGEST_SIZE bytes. Leaves of other digests
+// are hex lines of any length, which can not be told apart.
+template <class P>
+bool LeafWriter<P>::sameFormat(bool binary_format) const
+{
+	struct stat st;
+	if( fstat(fd, &st) != 0 )
+	{
+		return false;
+	}
+	const uint64_t size = st.st_size;
+	if( size == 0 || P::DIGEST_SIZE == 0 )
+	{
+		return true;
+	}
+	if( binary_format )
+	{
+		return size % P::DIGEST_SIZE == 0 && !sameFormat(false);
+	}
+	const size_t line = 2*P::DIGEST_SIZE + 1;
+	char first[2*64 + 1];
+	if( size % line != 0 || pread(fd, first, line, 0) != ssize_t(line) || first[line - 1] != '\n' )
+	{
+		return false;
+	}
+	for (size_t i=0; i<line - 1; ++i)
+	{
+		if( !isxdigit(static_cast<unsigned char>(first[i])) )
+		{
+			return false;
+		}
+	}
+	return true;
+} // END sameFormat
+
+
+// --- Write out the buffer and close the file --- //
+template <class P>
+bool LeafWriter<P>::close()
+{
+	if( fd < 0 )
+	{
+		return ok;
+	}
+	flush();
+	ok = (::close(fd) == 0) && ok;
+	fd = -1;
+	std::vector<char>().swap(buf);
+	return ok;
+} // END close
+
+
+#endif // LEAF_WRITER_HPP
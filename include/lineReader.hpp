@@ -0,0 +1,360 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	lineReader.hpp
+ *
+ *	Implements the LineReader class, which hands out the
+ *	lines of a text file as (pointer, length) spans without
+ *	copying them into std::strings.
+ *
+ *	Regular files are memory-mapped with a sequential access
+ *	hint and the lines are cut straight out of the mapping.
+ *	Line boundaries are found with memchr, which the C library
+ *	implements with vector instructions. Pipes, character
+ *	devices and stdin (file name "-") can not be mapped, thus
+ *	for them the reader falls back to streaming the input
+ *	through a buffer with read().
+ *
+ *	The lines are the same as std::getline would give: the
+ *	'\n' characters are dropped and a last line without a
+ *	'\n' is still a line, but an empty one is not.
+ *
+ *	A byte range of a regular file can be read by giving
+ *	its first byte and the byte after it. This is used to
+ *	continue hashing a log file from where the last run
+ *	stopped.
+ *
+ *	Compressed input (gzip, and zstd if compiled in) is
+ *	recognised by its first bytes when the whole file is
+ *	read, and streamed through a Decompressor, which works
+ *	on its own thread (see decompressor.hpp). The lines are
+ *	those of the decompressed text.
+ *
+ *	With direct input a regular file is not mapped, but read
+ *	past the page cache by a DirectReader (see directReader.hpp)
+ *	and streamed like a pipe.
+ */
+
+#ifndef LINE_READER_HPP
+#define LINE_READER_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "decompressor.hpp"
+#include "directReader.hpp"
+
+// ---------------------------------- //
+// ----- LineReader DECLARATION ----- //
+// ---------------------------------- //
+class LineReader
+{
+
+public:
+
+	// --- Opening and closing the file --- //
+	// Only the bytes [begin, end) are read. The range is
+	// ignored for stdin, which can not seek. With direct
+	// a regular file is read past the page cache.
+	LineReader(const std::string& file, uint64_t begin = 0, uint64_t end = UINT64_MAX, bool direct = false);
+	~LineReader();
+
+	// --- Whether the file could be opened --- //
+	bool is_open() const { return fd >= 0; }
+
+	// --- Whether the file is read through a memory mapping --- //
+	bool mapped() const { return map != 0; }
+
+	// --- Whether the file is decompressed while reading --- //
+	bool compressed() const { return decompressor.get() != 0; }
+
+	// --- Whether the input could not be read to its end --- //
+	// E.g. a broken or cut off compressed file.
+	bool failed() const { return read_error || (decompressor && decompressor->failed()) || (direct_reader && direct_reader->failed()); }
+
+	// --- Get the next line, returns false at the end of the file --- //
+	// The span stays valid until the next call.
+	bool next(const char*& data, size_t& len);
+
+private:
+	// Not copyable, as it owns the descriptor and the mapping
+	LineReader(const LineReader&);
+	LineReader& operator=(const LineReader&);
+
+	// --- Refill the streaming buffer, returns false at the end of input --- //
+	bool fill();
+
+	int fd;
+	bool own_fd;
+
+	// The memory-mapped file
+	const char* map;
+	size_t map_size;
+
+	// The streaming buffer, [begin,end) holds unread data
+	std::vector<char> buf;
+	size_t begin;
+	size_t end;
+	bool eof;
+
+	// Bytes left to read from the file
+	uint64_t remaining;
+
+	// The decompressor of compressed input, the reader of direct
+	// input and whether a read failed
+	std::unique_ptr<Decompressor> decompressor;
+	std::unique_ptr<DirectReader> direct_reader;
+	bool read_error;
+
+	// The position of the next line (both modes)
+	size_t pos;
+
+	// Size of the streaming reads
+	static const size_t READ_SIZE = 1 << 20;
+
+}; // END LINEREADER DECLARATION
+
+
+
+// ------------------------------------- //
+// ----- LineReader IMPLEMENTATION ----- //
+// ------------------------------------- //
+
+
+// --- Opening the file --- //
+inline LineReader::LineReader(const std::string& file, uint64_t range_begin, uint64_t range_end, bool direct)
+	: fd(-1), own_fd(false), map(0), map_size(0), begin(0), end(0), eof(false), remaining(UINT64_MAX), read_error(false), pos(0)
+{
+	if(file == "-")
+	{
+		fd = STDIN_FILENO;
+	}
+	else
+	{
+		fd = ::open(file.c_str(), O_RDONLY);
+		own_fd = true;
+	}
+	if(fd < 0)
+	{
+		return;
+	}
+
+	// Map regular files. If it is not possible, then
+	// just leave map as 0 and stream the file.
+	struct stat st;
+	bool regular = ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) );
+	bool whole = (range_begin == 0 && range_end == UINT64_MAX);
+	if( regular )
+	{
+		range_end = std::min<uint64_t>(range_end, st.st_size);
+	}
+
+	// Look for a compressed whole file. The first bytes 
+	// of a stream are kept in the buffer if it is plain.
+	if( whole )
+	{
+		char magic[Decompressor::MAGIC_SIZE];
+		ssize_t n = 0;
+		if( regular )
+		{
+			n = pread(fd, magic, sizeof(magic), 0);
+		}
+		else
+		{
+			ssize_t got;
+			while( n < ssize_t(sizeof(magic)) && ((got = ::read(fd, magic + n, sizeof(magic) - n)) > 0 || (got < 0 && errno == EINTR)) )
+			{
+				n += std::max<ssize_t>(got, 0);
+			}
+		}
+		n = std::max<ssize_t>(n, 0);
+		Decompressor::format_t format = Decompressor::detect(magic, n);
+		if( format != Decompressor::PLAIN )
+		{
+			if( regular )
+			{
+				n = 0;
+				lseek(fd, 0, SEEK_SET);
+			}
+			decompressor.reset( new Decompressor(fd, format, magic, n) );
+			buf.resize(2*READ_SIZE);
+			return;
+		}
+		if( !regular )
+		{
+			buf.resize(2*READ_SIZE);
+			memcpy(buf.data(), magic, n);
+			end = n;
+		}
+	}
+	if( regular && direct )
+	{
+		direct_reader.reset( new DirectReader(file, range_begin, range_end) );
+		buf.resize(2*READ_SIZE);
+		return;
+	}
+	if( regular && range_end > range_begin )
+	{
+		// The mapping starts at the page of range_begin, so
+		// that resuming a long file maps only the new part
+		uint64_t page = sysconf(_SC_PAGESIZE);
+		uint64_t map_begin = range_begin - range_begin % page;
+		void* p = mmap(0, range_end - map_begin, PROT_READ, MAP_PRIVATE, fd, map_begin);
+		if(p != MAP_FAILED)
+		{
+			map = static_cast<const char*>(p);
+			map_size = range_end - map_begin;
+			pos = range_begin - map_begin;
+			madvise(p, map_size, MADV_SEQUENTIAL);
+			madvise(p, map_size, MADV_WILLNEED);
+		}
+	}
+	if(!map)
+	{
+		buf.resize(std::max<size_t>(buf.size(), 2*READ_SIZE));
+		if( regular )
+		{
+			remaining = (range_end > range_begin) ? range_end - range_begin : 0;
+			lseek(fd, range_begin, SEEK_SET);
+		}
+	}
+} // END LineReader
+
+
+// --- Closing the file --- //
+inline LineReader::~LineReader()
+{
+	if(map)
+	{
+		munmap(const_cast<char*>(map), map_size);
+	}
+	if(own_fd && fd >= 0)
+	{
+		::close(fd);
+	}
+} // END ~LineReader
+
+
+// --- Get the next line --- //
+inline bool LineReader::next(const char*& data, size_t& len)
+{
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	// Memory-mapped: cut the line out of the mapping
+	if(map)
+	{
+		if(pos >= map_size)
+		{
+			return false;
+		}
+		const char* start = map + pos;
+		const char* nl = static_cast<const char*>( memchr(start, '\n', map_size - pos) );
+		data = start;
+		if(nl)
+		{
+			len = nl - start;
+			pos += len + 1;
+		}
+		else
+		{
+			len = map_size - pos;
+			pos = map_size;
+		}
+		return true;
+	}
+
+	// Streaming: search the buffer and refill it
+	// until a full line (or the end) is found
+	pos = begin;
+	while(true)
+	{
+		const char* start = buf.data() + begin;
+		const char* nl = static_cast<const char*>( memchr(buf.data() + pos, '\n', end - pos) );
+		if(nl)
+		{
+			data = start;
+			len = nl - start;
+			begin += len + 1;
+			return true;
+		}
+		pos = end;
+		if( !fill() )
+		{
+			// Last line without a newline
+			if(end > begin)
+			{
+				data = buf.data() + begin;
+				len = end - begin;
+				begin = end;
+				return true;
+			}
+			return false;
+		}
+	}
+} // END next
+
+
+// --- Refill the streaming buffer --- //
+inline bool LineReader::fill()
+{
+	if(eof)
+	{
+		return false;
+	}
+
+	// Move the unread part to the front and grow the
+	// buffer if a single line does not fit into it
+	if(begin > 0)
+	{
+		memmove(buf.data(), buf.data() + begin, end - begin);
+		end -= begin;
+		pos -= begin;
+		begin = 0;
+	}
+	if(buf.size() - end < READ_SIZE)
+	{
+		buf.resize(buf.size() + READ_SIZE);
+	}
+
+	ssize_t n;
+	if( decompressor )
+	{
+		n = decompressor->read(buf.data() + end, buf.size() - end);
+	}
+	else if( direct_reader )
+	{
+		n = direct_reader->read(buf.data() + end, buf.size() - end);
+	}
+	else
+	{
+		do
+		{
+			n = ::read(fd, buf.data() + end, std::min<uint64_t>(buf.size() - end, remaining));
+		} while(n < 0 && errno == EINTR);
+	}
+
+	if(n <= 0)
+	{
+		read_error = (n < 0);
+		eof = true;
+		return false;
+	}
+	end += n;
+	remaining -= n;
+	return true;
+} // END fill
+
+
+#endif // LINE_READER_HPP
@@ -0,0 +1,487 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleBatch.hpp
+ *
+ *	Implements the class template MerkleBatch, which calculates
+ *	the Merkle roots of many log files at once on a WorkPool
+ *	(see workPool.hpp). The files are cut into tasks of about
+ *	the same size:
+ *		a)	Small files are batched, a task hashing whole files
+ *			until it has about RANGE_BYTES of them.
+ *		b)	Large plain files are split. First the lines of each
+ *			range of RANGE_BYTES are counted in parallel, then the file
+ *			is cut into pieces of 2^H lines, which are hashed in
+ *			parallel into forests of their own. A piece starts at
+ *			a multiple of 2^H leaves, thus the forests of the
+ *			pieces are appended into the forest of the file in
+ *			order (see merkleForest.hpp), giving the same root
+ *			as hashing the file in one go. Compressed files 
+ *			are always hashed whole.
+ *
+ *	getRoot builds the tree of a single large file in parallel
+ *	in the same way, with ranges small enough to count the lines
+ *	on all the threads too. Thus not only the leaves but also the
+ *	internal nodes are hashed on all the cores.
+ *
+ *	With direct input both the counting and the hashing read
+ *	past the page cache (see directReader.hpp).
+ *
+ *	The second-level tree over the roots of the files is built
+ *	by MerkleHasher::getTreeChains.
+ */
+
+#ifndef MERKLE_BATCH_HPP
+#define MERKLE_BATCH_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "myHashInterface.hpp"
+#include "merkleForest.hpp"
+#include "merkleHasher.hpp"
+#include "workPool.hpp"
+#include "directReader.hpp"
+
+
+// ----------------------------------- //
+// ----- MerkleBatch DECLARATION ----- //
+// ----------------------------------- //
+template <class P>
+class MerkleBatch
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	// --- The result for one file --- //
+	// A file that can not be read (to its end) is not ok, an empty
+	// file has 0 lines and no root.
+	struct file_root_t
+	{
+		std::string file;
+		bool ok;
+		uint64_t lines;
+		digest_t root;
+	};
+
+	MerkleBatch(unsigned n) : threads((n < 1) ? 1 : n), direct(false) {}
+
+	// --- Read the log files past the page cache --- //
+	void setDirectInput(bool on) { direct = on; }
+
+	// --- Calculate the roots of the files, in the order of the files --- //
+	std::vector<file_root_t> getRoots(const std::vector<std::string>& files);
+
+	// --- Calculate the root of one file, splitting it over the threads --- //
+	// Files that can not be split (compressed, small or unreadable) are
+	// hashed by a MerkleHasher with a LeafPipeline of all the threads.
+	file_root_t getRoot(const std::string& file);
+
+	// The size of the line counting ranges and of the small file batches
+	static const uint64_t RANGE_BYTES = uint64_t(64) << 20;
+
+	// The smallest line counting range of getRoot
+	static const uint64_t MIN_RANGE_BYTES = uint64_t(4) << 20;
+
+	// The smallest piece of a split file is 2^MIN_PIECE_HEIGHT lines
+	static const unsigned MIN_PIECE_HEIGHT = 16;
+
+private:
+	unsigned threads;
+	bool direct;
+
+	// --- A file which is split into pieces --- //
+	struct SplitFile
+	{
+		size_t index;
+		std::string file;
+		int fd;
+		uint64_t size;
+		uint64_t range;
+		std::vector<uint64_t> newlines;
+		std::atomic<size_t> counting;
+		unsigned height;
+		std::vector< MerkleForest<P> > pieces;
+
+		// Whether reading any range or piece failed
+		std::atomic<bool> failed;
+
+		SplitFile() : fd(-1), range(0), counting(0), height(0), failed(false) {}
+		~SplitFile() { if( fd >= 0 ) { ::close(fd); } }
+	};
+
+	// --- Count the lines of the ranges, then split the file --- //
+	void count(WorkPool& pool, SplitFile& f);
+
+	// --- Cut a counted file into pieces and submit them --- //
+	void split(WorkPool& pool, SplitFile& f);
+
+	// --- Append the forests of the pieces into the root of the file --- //
+	void join(const SplitFile& f, file_root_t& r);
+
+	// --- The offset of the first byte of line L (0-based) --- //
+	// The methods below mark the file failed if it can not be read.
+	uint64_t lineOffset(SplitFile& f, uint64_t L);
+
+	// --- Count the '\n' in the bytes [begin, end) --- //
+	uint64_t countNewlines(SplitFile& f, uint64_t begin, uint64_t end);
+
+	// --- The offset of the n-th '\n' (1-based) in the bytes [begin, end) --- //
+	uint64_t findNewline(SplitFile& f, uint64_t begin, uint64_t end, uint64_t n);
+
+	// --- Pass the bytes [begin, end) to scan(data, len, offset) in pieces --- //
+	// Stops once scan returns false. Returns false if a read failed or
+	// the file ended before end.
+	template <class S>
+	bool scanRange(const SplitFile& f, uint64_t begin, uint64_t end, S scan);
+
+	static const size_t READ_BUFFER = 1 << 20;
+
+}; // END MERKLEBATCH DECLARATION
+
+
+
+// -------------------------------------- //
+// ----- MerkleBatch IMPLEMENTATION ----- //
+// -------------------------------------- //
+
+
+// --- Calculate the roots of the files --- //
+template <class P>
+std::vector<typename MerkleBatch<P>::file_root_t> MerkleBatch<P>::getRoots(const std::vector<std::string>& files)
+{
+	std::vector<file_root_t> out(files.size());
+	std::vector< std::unique_ptr<SplitFile> > split_files;
+	{
+		WorkPool pool(threads);
+
+		// A batch of small files
+		std::vector<size_t> batch;
+		uint64_t batch_bytes = 0;
+		auto submitBatch = [&]()
+			{
+				if( batch.empty() )
+				{
+					return;
+				}
+				pool.submit([this, batch, &files, &out]()
+					{
+						MerkleHasher<P> hasher;
+						hasher.setDirectInput(direct);
+						for (size_t i=0; i<batch.size(); ++i)
+						{
+							file_root_t& r = out[batch[i]];
+							MerkleForest<P> forest;
+							r.lines = hasher.getForest(files[batch[i]], 0, UINT64_MAX, forest);
+							r.ok = !hasher.inputFailed();
+							forest.fold(r.root);
+						}
+					});
+				batch.clear();
+				batch_bytes = 0;
+			};
+
+		for (size_t i=0; i<files.size(); ++i)
+		{
+			out[i].file = files[i];
+			out[i].lines = 0;
+			int fd = ::open(files[i].c_str(), O_RDONLY);
+			out[i].ok = (fd >= 0);
+			if( fd < 0 )
+			{
+				continue;
+			}
+
+			// Plain files of at least two ranges are split
+			uint64_t size = regularFileSize(files[i]);
+			if( size < 2*RANGE_BYTES || Decompressor::detectFile(files[i]) != Decompressor::PLAIN )
+			{
+				::close(fd);
+				batch.push_back(i);
+				batch_bytes += size;
+				if( batch_bytes >= RANGE_BYTES )
+				{
+					submitBatch();
+				}
+				continue;
+			}
+
+			split_files.push_back( std::unique_ptr<SplitFile>(new SplitFile()) );
+			SplitFile& f = *split_files.back();
+			f.index = i;
+			f.file = files[i];
+			f.fd = fd;
+			f.size = size;
+			f.range = RANGE_BYTES;
+			count(pool, f);
+		}
+		submitBatch();
+		pool.wait();
+	}
+
+	// Join the pieces of the split files
+	for (size_t s=0; s<split_files.size(); ++s)
+	{
+		join(*split_files[s], out[split_files[s]->index]);
+	}
+	return out;
+} // END getRoots
+
+
+// --- Calculate the root of one file, splitting it over the threads --- //
+// The ranges are cut so that each thread counts a few of them.
+template <class P>
+typename MerkleBatch<P>::file_root_t MerkleBatch<P>::getRoot(const std::string& file)
+{
+	file_root_t r;
+	r.file = file;
+	r.lines = 0;
+	int fd = ::open(file.c_str(), O_RDONLY);
+	uint64_t size = regularFileSize(file);
+	if( fd < 0 || threads == 1 || size < 2*MIN_RANGE_BYTES || Decompressor::detectFile(file) != Decompressor::PLAIN )
+	{
+		if( fd >= 0 )
+		{
+			::close(fd);
+		}
+		MerkleHasher<P> hasher;
+		hasher.setThreads(threads);
+		hasher.setDirectInput(direct);
+		MerkleForest<P> forest;
+		r.lines = hasher.getForest(file, 0, UINT64_MAX, forest);
+		r.ok = !hasher.inputFailed();
+		forest.fold(r.root);
+		return r;
+	}
+
+	r.ok = true;
+	SplitFile f;
+	f.index = 0;
+	f.file = file;
+	f.fd = fd;
+	f.size = size;
+	f.range = (size + 4*threads - 1) / (4*threads);
+	f.range = (f.range < MIN_RANGE_BYTES) ? MIN_RANGE_BYTES : f.range;
+	{
+		WorkPool pool(threads);
+		count(pool, f);
+		pool.wait();
+	}
+	join(f, r);
+	return r;
+} // END getRoot
+
+
+// --- Count the lines of the ranges, then split the file --- //
+// The ranges are counted in parallel, the last range
+// to finish splits the file.
+template <class P>
+void MerkleBatch<P>::count(WorkPool& pool, SplitFile& f)
+{
+	size_t ranges = (f.size + f.range - 1) / f.range;
+	f.newlines.resize(ranges);
+	f.counting = ranges;
+	for (size_t r=0; r<ranges; ++r)
+	{
+		pool.submit([this, r, &f, &pool]()
+			{
+				uint64_t begin = r * f.range;
+				f.newlines[r] = countNewlines(f, begin, std::min(begin + f.range, f.size));
+				if( --f.counting == 0 )
+				{
+					split(pool, f);
+				}
+			});
+	}
+} // END count
+
+
+// --- Cut a counted file into pieces and submit them --- //
+// The pieces are of 2^H lines, about four per thread.
+template <class P>
+void MerkleBatch<P>::split(WorkPool& pool, SplitFile& f)
+{
+	uint64_t lines = 0;
+	for (size_t r=0; r<f.newlines.size(); ++r)
+	{
+		lines += f.newlines[r];
+	}
+	// A last line without '\n' is a line too
+	char last = '\n';
+	if( pread(f.fd, &last, 1, f.size - 1) != 1 )
+	{
+		f.failed = true;
+	}
+	if( last != '\n' )
+	{
+		++lines;
+	}
+
+	uint64_t target = lines / (4 * uint64_t(threads));
+	f.height = MIN_PIECE_HEIGHT;
+	while( f.height < 62 && (uint64_t(2) << f.height) <= target )
+	{
+		++f.height;
+	}
+	uint64_t piece = uint64_t(1) << f.height;
+	size_t count = (lines + piece - 1) / piece;
+	f.pieces.resize(count);
+	for (size_t k=0; k<count; ++k)
+	{
+		pool.submit([this, k, lines, piece, &f]()
+			{
+				uint64_t begin = lineOffset(f, k * piece);
+				uint64_t end = ((k + 1) * piece >= lines) ? f.size : lineOffset(f, (k + 1) * piece);
+				MerkleHasher<P> hasher;
+				hasher.setDirectInput(direct);
+				uint64_t got = hasher.getForest(f.file, begin, end, f.pieces[k]);
+
+				// A piece that was not read whole would give a wrong root
+				uint64_t expected = std::min(piece, lines - k * piece);
+				if( hasher.inputFailed() || got != expected )
+				{
+					f.failed = true;
+				}
+			});
+	}
+} // END split
+
+
+// --- Append the forests of the pieces into the root of the file --- //
+template <class P>
+void MerkleBatch<P>::join(const SplitFile& f, file_root_t& r)
+{
+	MerkleForest<P> forest;
+	for (size_t k=0; k<f.pieces.size(); ++k)
+	{
+		forest.append(f.pieces[k]);
+	}
+	r.lines = forest.leaves();
+	r.ok = r.ok && !f.failed;
+	forest.fold(r.root);
+} // END join
+
+
+// --- The offset of the first byte of line L (0-based) --- //
+// Line L starts after the L-th '\n', which is looked up in
+// the range holding it.
+template <class P>
+uint64_t MerkleBatch<P>::lineOffset(SplitFile& f, uint64_t L)
+{
+	if( L == 0 )
+	{
+		return 0;
+	}
+	uint64_t before = 0;
+	for (size_t r=0; r<f.newlines.size(); ++r)
+	{
+		if( before + f.newlines[r] >= L )
+		{
+			uint64_t begin = r * f.range;
+			return findNewline(f, begin, std::min(begin + f.range, f.size), L - before) + 1;
+		}
+		before += f.newlines[r];
+	}
+	return f.size;
+} // END lineOffset
+
+
+// --- Count the '\n' in the bytes [begin, end) --- //
+template <class P>
+uint64_t MerkleBatch<P>::countNewlines(SplitFile& f, uint64_t begin, uint64_t end)
+{
+	uint64_t count = 0;
+	bool ok = scanRange(f, begin, end, [&](const char* data, size_t len, uint64_t)
+		{
+			count += std::count(data, data + len, '\n');
+			return true;
+		});
+	if( !ok )
+	{
+		f.failed = true;
+	}
+	return count;
+} // END countNewlines
+
+
+// --- The offset of the n-th '\n' (1-based) in the bytes [begin, end) --- //
+template <class P>
+uint64_t MerkleBatch<P>::findNewline(SplitFile& f, uint64_t begin, uint64_t end, uint64_t n)
+{
+	uint64_t found = end;
+	bool ok = scanRange(f, begin, end, [&](const char* data, size_t len, uint64_t offset)
+		{
+			const char* p = data;
+			const char* stop = data + len;
+			while( (p = static_cast<const char*>(memchr(p, '\n', stop - p))) != 0 )
+			{
+				if( --n == 0 )
+				{
+					found = offset + (p - data);
+					return false;
+				}
+				++p;
+			}
+			return true;
+		});
+	if( !ok || found == end )
+	{
+		f.failed = true;
+	}
+	return found;
+} // END findNewline
+
+
+// --- Pass the bytes [begin, end) to scan(data, len, offset) in pieces --- //
+// Either through a DirectReader or with preads through the page cache.
+template <class P>
+template <class S>
+bool MerkleBatch<P>::scanRange(const SplitFile& f, uint64_t begin, uint64_t end, S scan)
+{
+	std::vector<char> buf(READ_BUFFER);
+	if( direct )
+	{
+		DirectReader input(f.file, begin, end);
+		size_t n;
+		while( (n = input.read(buf.data(), buf.size())) > 0 )
+		{
+			if( !scan(buf.data(), n, begin) )
+			{
+				return !input.failed();
+			}
+			begin += n;
+		}
+		return !input.failed() && begin >= end;
+	}
+	while( begin < end )
+	{
+		ssize_t n = pread(f.fd, buf.data(), std::min<uint64_t>(buf.size(), end - begin), begin);
+		if( n < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		if( n <= 0 )
+		{
+			return false;
+		}
+		if( !scan(buf.data(), n, begin) )
+		{
+			return true;
+		}
+		begin += n;
+	}
+	return true;
+} // END scanRange
+
+
+#endif // MERKLE_BATCH_HPP
@@ -0,0 +1,176 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleForest.hpp
+ *
+ *	Implements the class template MerkleForest, the forest of
+ *	complete trees from which MerkleHasher builds its roots
+ *	and hash chains. The forest of n leaves has a complete
+ *	tree of height h exactly when bit h of n is set, thus it
+ *	is kept as a binary counter:
+ *		a)	A fixed array of 64 slots, slot h holding the
+ *			root of the tree of height h.
+ *		b)	An occupancy mask, which is the number of leaves.
+ *
+ *	Adding a tree of height h is adding 2^h to the counter:
+ *	the run of set bits from h on (counted with ctz) are the
+ *	trees to merge with, after which the mask is just added
+ *	to. The forest lives on the stack and never allocates
+ *	(for fixed size digests).
+ *
+ *	The root folds the trees from right to left, i.e. from
+ *	the lowest set bit up.
+ *
+ *	A forest built separately over a piece of the leaves can
+ *	be appended to the forest of the leaves before it, as
+ *	long as the piece starts at a multiple of the size of its
+ *	largest tree. Thus pieces of 2^H leaves can be hashed in
+ *	parallel and joined into the forest of the whole.
+ */
+
+#ifndef MERKLE_FOREST_HPP
+#define MERKLE_FOREST_HPP
+
+#include <cstdint>
+
+#include "myHashInterface.hpp"
+#include "merkleStats.hpp"
+
+
+// ------------------------------------ //
+// ----- MerkleForest DECLARATION ----- //
+// ------------------------------------ //
+template <class P>
+class MerkleForest
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	// The highest tree that fits in is of height 63
+	static const unsigned MAX_HEIGHT = 64;
+
+	MerkleForest() : mask(0) {}
+
+	// --- The occupancy, which is also the number of leaves --- //
+	uint64_t leaves() const { return mask; }
+	bool empty() const { return mask == 0; }
+	unsigned trees() const { return __builtin_popcountll(mask); }
+
+	// --- The tree of height h --- //
+	bool filled(unsigned h) const { return (mask >> h) & 1; }
+	const digest_t& root(unsigned h) const { return slot[h]; }
+
+	// --- Empty the forest --- //
+	void clear() { mask = 0; }
+
+	// --- Put the root of a tree of height h into an empty slot --- //
+	// Used for loading a saved forest.
+	void set(unsigned h, const digest_t& node) { slot[h] = node; mask |= uint64_t(1) << h; }
+
+	// --- Add a complete tree of the given height --- //
+	// The trees below the height must be empty, as they are when
+	// the trees come in the order of the leaves. Every merged node
+	// is passed to observe(height, node).
+	template <class O>
+	void insert(const digest_t& node, unsigned height, O& observe);
+	void insert(const digest_t& node, unsigned height);
+
+	// --- Add the trees of a forest built over the next leaves --- //
+	// The number of leaves must be a multiple of the size of the 
+	// largest tree of other.
+	void append(const MerkleForest& other);
+
+	// --- Fold the trees below the given height into root --- //
+	// Returns false if there are none.
+	bool fold(digest_t& root, unsigned below = MAX_HEIGHT) const;
+
+private:
+	digest_t slot[MAX_HEIGHT];
+	uint64_t mask;
+
+	// --- An observer that ignores the merged nodes --- //
+	struct NoObserver
+	{
+		void operator()(unsigned, const digest_t&) {}
+	};
+
+}; // END MERKLEFOREST DECLARATION
+
+
+
+// --------------------------------------- //
+// ----- MerkleForest IMPLEMENTATION ----- //
+// --------------------------------------- //
+
+
+// --- Add a complete tree of the given height --- //
+template <class P>
+template <class O>
+void MerkleForest<P>::insert(const digest_t& node, unsigned height, O& observe)
+{
+	// The number of trees to merge with is the
+	// run of set bits starting at the height
+	unsigned carries = __builtin_ctzll( ~(mask >> height) );
+	MERKLE_STATS_ADD(node_hashes, carries);
+
+	digest_t cur = node;
+	digest_t next;
+	unsigned h = height;
+	for (unsigned c=0; c<carries; ++c, ++h)
+	{
+		P::node(slot[h], cur, next);
+		cur = next;
+		observe(h + 1, cur);
+	}
+	slot[h] = cur;
+	mask += uint64_t(1) << height;
+} // END insert
+
+
+template <class P>
+void MerkleForest<P>::insert(const digest_t& node, unsigned height)
+{
+	NoObserver none;
+	insert(node, height, none);
+} // END insert
+
+
+// --- Add the trees of a forest built over the next leaves --- //
+// The trees go in from the largest, which keeps the
+// smaller slots empty for each insert.
+template <class P>
+void MerkleForest<P>::append(const MerkleForest& other)
+{
+	for (uint64_t bits = other.mask; bits; bits &= ~(uint64_t(1) << (63 - __builtin_clzll(bits))))
+	{
+		unsigned h = 63 - __builtin_clzll(bits);
+		insert(other.slot[h], h);
+	}
+} // END append
+
+
+// --- Fold the trees below the given height into root --- //
+template <class P>
+bool MerkleForest<P>::fold(digest_t& root, unsigned below) const
+{
+	uint64_t bits = (below >= MAX_HEIGHT) ? mask : mask & ((uint64_t(1) << below) - 1);
+	if( bits == 0 )
+	{
+		return false;
+	}
+	MERKLE_STATS_ADD(node_hashes, __builtin_popcountll(bits) - 1);
+	root = slot[__builtin_ctzll(bits)];
+	bits &= bits - 1;
+
+	digest_t next;
+	for ( ; bits; bits &= bits - 1)
+	{
+		P::node(slot[__builtin_ctzll(bits)], root, next);
+		root = next;
+	}
+	return true;
+} // END fold
+
+
+#endif // MERKLE_FOREST_HPP
@@ -11,10 +11,39 @@
  *			from a Merkle tree whose leaves 
  *			correspond to hashes of some text  
  *			file lines. 
+ *		c)	Extracting many hash chains together 
+ *			with the root in a single pass over 
+ *			the text file.
+ *		d)	Writing a persistent index of the tree,
+ *			from which hash chains can be extracted 
+ *			later without the log file (see 
+ *			merkleIndex.hpp), optionally with a
+ *			lookup table of the leaves for finding
+ *			lines by content (merkleLookup.hpp).
+ *		e)	Continuing the root calculation of a
+ *			growing log file from a saved state
+ *			(see merkleState.hpp).
+ *		f)	Following a growing log file and cutting 
+ *			it into blocks, each with its own tree.
+ *		g)	Verifying many hash chains against a 
+ *			signed root on several threads.
+ *		h)	Building a tree over given digests (e.g.
+ *			the roots of several log files) with the
+ *			hash chains of all of them.
+ *		i)	Verifying that a signed root is a prefix
+ *			of a later one (consistency proofs, see
+ *			merkleIndex.hpp).
+ *		j)	Verifying multi-proofs of many lines at
+ *			once (see merkleMultiProof.hpp).
  *
- *	MerkleHasher is templated on:
- *		a) The hash function used 
- *		b) The 'hash merging' function used
+ *	MerkleHasher is templated on a hash policy (see 
+ *	myHashInterface.hpp), which defines:
+ *		a) The digest type of the tree nodes
+ *		b) The hashing of leaves and of internal nodes 
+ *		c) The text form of digests used in the output
+ *
+ *	The tree is built on the policy's digest type and 
+ *	digests are only turned into text at the output.
  *
  *	The algorithms used in the class are based on [1].
  *	For further details refer to the documentation in ../doc/doc.
@@ -33,39 +62,220 @@
 #include <string>
 #include <algorithm>
 #include <utility>
-#include <fstream>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <csignal>
+
+#include <sys/stat.h>
 
 #include "myHashInterface.hpp"
+#include "lineReader.hpp"
+#include "leafPipeline.hpp"
+#include "merkleIndex.hpp"
+#include "merkleLookup.hpp"
+#include "merkleMultiProof.hpp"
+#include "merkleForest.hpp"
+#include "merkleState.hpp"
+#include "merkleProofs.hpp"
+#include "leafWriter.hpp"
+#include "merkleStats.hpp"
 
 // ------------------------------------ //
 // ----- MerkleHasher DECLARATION ----- //
 // ------------------------------------ // 
-template <std::string (*H)(const std::string), std::string (*M)(const std::string, const std::string )>
+template <class P>
 class MerkleHasher
 {
 
 public:
 
+	// --- The digest type of the tree nodes --- //
+	typedef typename P::digest_t digest_t;
+
+	MerkleHasher() : threads(1), leaves_out(0), input_failed(false), direct(false) {}
+
+	// --- Number of threads used for hashing the leaves --- //
+	// With more than one thread the leaves are hashed in a
+	// LeafPipeline, the result is always the same.
+	void setThreads(unsigned n){	threads = (n < 1) ? 1 : n;	}
+
+	// --- Read the log files past the page cache --- //
+	// With O_DIRECT reads kept in flight (see directReader.hpp),
+	// for archives much larger than the memory.
+	void setDirectInput(bool on){	direct = on;	}
+
 	// --- Wrappers for hashing one or two inputs --- //
-	std::string hash(const std::string s){	return H(s);	}
-	std::string hash(const std::string s1, const std::string s2){	return H( M(s1,s2) );	}
+	digest_t hash(const char* data, size_t len){	MERKLE_STATS_ADD(leaf_hashes, 1); digest_t d; P::leaf(data, len, d); return d;	}
+	digest_t hash(const std::string& s){	return hash(s.data(), s.size());	}
+	digest_t hash(const digest_t& d1, const digest_t& d2){	MERKLE_STATS_ADD(node_hashes, 1); digest_t d; P::node(d1, d2, d); return d;	}
 
-	// --- Getter for the leaves vector --- //
-	std::vector<std::string> getLeaves() { return leaves; }
+	// --- Getter for the leaves (as text) --- //
+	std::vector<std::string> getLeaves();
+
+	// --- Stream the saved leaves into a LeafWriter --- //
+	// With an open writer the leaves of the methods below (saveLeaves)
+	// go into the writer as they are hashed instead of being kept for 
+	// getLeaves. 0 returns to keeping them.
+	void setLeavesOutput(LeafWriter<P>* out){	leaves_out = out;	}
+
+	// --- Whether the last pass could not read the file to its end --- //
+	// E.g. a broken compressed file, whose root would be wrong.
+	bool inputFailed() const {	return input_failed;	}
 
 	// --- Method for getting the root and leafs of a Merkle tree --- //
 	std::string getRoot( const std::string file, bool saveLeaves);
 
+	// --- Method for adding the lines in the bytes [begin, end) into a forest --- //
+	// The lines are taken to follow the leaves already in the forest.
+	// Returns the number of lines added.
+	uint64_t getForest( const std::string file, uint64_t begin, uint64_t end, MerkleForest<P>& forest);
+
+	// --- Method for the tree over the given leaves and the hash chains of all of them --- //
+	// The leaves are taken as they are, without hashing them again.
+	std::vector<hash_chain_t> getTreeChains( const std::vector<digest_t>& tree_leaves, std::string& root);
+
 	// --- Method for extracting hash chains from a Merkle tree --- //
 	hash_chain_t getHashChain( const std::string file, std::string target_line, bool saveLeaves); 
 
+	// --- Method for extracting many hash chains and the root in one pass --- //
+	std::vector<hash_chain_t> getHashChains( const std::string file, const std::vector<std::string>& target_lines, std::string& root, bool saveLeaves);
+
+	// --- Method for extracting the hash chains of ranges of leaves (0-based) --- //
+	// A range holds its first and last leaf. The chains of the leaves in the
+	// file come range by range, leaf_count tells how many leaves there are.
+	typedef std::pair<uint64_t, uint64_t> leaf_range_t;
+	std::vector<hash_chain_t> getHashChainsAt( const std::string file, const std::vector<leaf_range_t>& leaf_ranges, 
+		std::string& root, uint64_t& leaf_count, bool saveLeaves);
+
+	// --- Method for continuing the root calculation from a saved state --- //
+	// Hashes the complete lines appended after state.offset and updates 
+	// the state. Returns "" if there are no lines at all.
+	std::string resumeRoot( const std::string file, MerkleState<P>& state, bool saveLeaves);
+
+	// --- Method for signing a growing file block by block --- //
+	// Follows the file from the byte offset of line first_line on as it 
+	// grows and cuts its complete lines into blocks of block_lines lines 
+	// or of the lines that arrived within block_seconds of the first line 
+	// of the block (0 for no limit). Every block gets its own tree and 
+	// on_block(first_line, last_line, end_offset, root) is called for it. 
+	// Once *stop is set, the last partial block is closed and true 
+	// returned. Returns false if the file is truncated or replaced, or
+	// if it can not be read (inputFailed()).
+	template <class F>
+	bool followBlocks( const std::string file, uint64_t offset, uint64_t first_line, uint64_t block_lines, 
+		double block_seconds, volatile sig_atomic_t* stop, F on_block);
+
+	// --- Method for getting the root and writing the index of the tree --- //
+	// Unless lookup_file is "", the lookup table of the leaves is written
+	// into it as well. Returns "" if the log is empty or could not be read
+	// to its end, or the index or the lookup table could not be written;
+	// the files are then removed.
+	std::string buildIndex( const std::string file, const std::string index_file, const std::string lookup_file, bool saveLeaves);
+
 	// --- Method for verifying if a hash chain is self-consistent --- //
-	// Currently not used
 	bool selfConsistentHashChain(hash_chain_t& chain);
+
+	// --- The outcome of verifying a hash chain --- //
+	enum chain_status_t { CHAIN_OK, CHAIN_MALFORMED, CHAIN_WRONG_LINE, CHAIN_BROKEN, CHAIN_WRONG_ROOT };
+	static const char* chainStatusName(int status);
+
+	// --- Method for verifying many hash chains against a signed root --- //
+	// Every chain is hashed up from its leaf and must agree with its own 
+	// steps and end in the root. If lines[k] is given, the leaf of chain k 
+	// must also be the hash of *lines[k]. The chains are verified on all 
+	// threads, in batches hashed together. Returns a chain_status_t per chain.
+	std::vector<int> verifyHashChains( const std::vector<hash_chain_t>& chains, 
+		const std::vector<const std::string*>& lines, const std::string& root);
+
+	// --- Method for verifying the proofs of a container against a signed root --- //
+	// As verifyHashChains, lines[k] belonging to the k-th proof.
+	std::vector<int> verifyProofs( const MerkleProofs<P>& proofs, 
+		const std::vector<const std::string*>& lines, const std::string& root);
+
+	// --- Method for verifying a consistency proof between two tree sizes --- //
+	// Whether the tree of old_size leaves with old_root is a prefix of the
+	// tree of new_size leaves with new_root, by a proof of MerkleIndex::
+	// consistencyProof. Takes ~2*log2(new_size) hashes.
+	bool verifyConsistency( uint64_t old_size, uint64_t new_size, const std::vector<digest_t>& proof,
+		const digest_t& old_root, const digest_t& new_root);
+
+	// --- Method for verifying a multi-proof of many leaves at once --- //
+	// Whether the leaves at indices (0-based, increasing) of a tree of n
+	// leaves hash up to root with the nodes of a proof of MerkleIndex::
+	// multiProof, all of which must be used.
+	bool verifyMultiProof( uint64_t n, const std::vector<uint64_t>& indices, const std::vector<digest_t>& leaves,
+		const std::vector<digest_t>& proof, const digest_t& root);
 	
 
 private:
-	std::vector<std::string> leaves;
+	std::vector<digest_t> leaves;
+	unsigned threads;
+	LeafWriter<P>* leaves_out;
+	bool input_failed;
+	bool direct;
+
+	// --- Save a leaf into the writer or the leaves vector --- //
+	void saveLeaf(const digest_t& leaf)
+	{
+		if(leaves_out && leaves_out->is_open())	{	leaves_out->add(leaf);	}
+		else	{	leaves.push_back(leaf);	}
+	}
+
+	// --- Call f(leaf) for the leaves of the file in order --- //
+	// Only the lines in the bytes [begin, end) are hashed.
+	template <class F>
+	void forEachLeaf( const std::string& file, F f, uint64_t begin = 0, uint64_t end = UINT64_MAX);
+
+	// --- Add the leaves of the file into a forest of complete trees --- //
+	// Every node of the tree is passed to observe(level, node) once it
+	// is complete. Within a level the nodes come in order, the leaves
+	// (level 0) as soon as they are hashed. Returns the number of leaves.
+	template <class O>
+	uint64_t extendForest( const std::string& file, uint64_t begin, uint64_t end, 
+		MerkleForest<P>& forest, bool saveLeaves, O& observe);
+
+	// --- An observer of extendForest that ignores the nodes --- //
+	struct NoObserver
+	{
+		void operator()(uint, const digest_t&) {}
+	};
+
+	// --- Collects the siblings of chosen leaves as the tree is built --- //
+	class ChainCollector;
+
+	// --- Extract the chains of leaves chosen by index, by content and by range --- //
+	// The chains of the indices come first, then those of the contents and
+	// then those of the leaves in the spans (sorted and disjoint), in order.
+	// The tree is built by build(forest, collector), which must pass every
+	// node to the collector as extendForest does.
+	template <class B>
+	std::vector<hash_chain_t> collectChains( B build, const std::vector<uint64_t>& at, 
+		const std::vector<digest_t>& with, const std::vector<leaf_range_t>& spans, std::string& root);
+
+	// --- Verify the chains of a source C in batches on all threads --- //
+	// C gives for chain k: leaf(k, d) (false if malformed), depth(k), 
+	// step(k, s, pos, sibling) (false if malformed) and check(k, s, node, tmp),
+	// whether node is what the chain itself has after step s.
+	template <class C>
+	std::vector<int> verifyBatched( const C& chains, const std::vector<const std::string*>& lines, const std::string& root);
+
+	// --- The sources of verifyBatched --- //
+	struct TextChains;
+	struct BinaryProofs;
+
+	// The number of leaves hashed at once, and the height of
+	// the subtrees that getRoot reduces level by level before 
+	// putting them into the forest.
+	static const size_t LEAF_BATCH = 64;
+	static const uint GROUP_HEIGHT = 6;
+
+	// How often a followed file is checked for new lines
+	static const unsigned FOLLOW_POLL_MS = 100;
+
+	// --- Hash chain with digests instead of text --- //
+	typedef std::vector< std::pair<int, digest_t> > digest_chain_t;
 
 }; // END MERKLEHASHER DECLARATION
 
@@ -76,241 +286,765 @@ private:
 // --------------------------------------- // 
 
 
+// --- Call f(leaf) for the leaves of the file in order --- //
+template <class P>
+template <class F>
+void MerkleHasher<P>::forEachLeaf( const std::string& file, F f, uint64_t begin, uint64_t end)
+{
+	// Hash the leaves on several threads
+	input_failed = false;
+	if( threads > 1 )
+	{
+		LeafPipeline<P> pipeline(threads);
+		pipeline.setDirectInput(direct);
+		pipeline.run(file, f, begin, end);
+		input_failed = pipeline.failed();
+		return;
+	}
+
+	// Open the file 
+	LineReader input_file(file, begin, end, direct);
+	if(!input_file.is_open())
+	{
+		return;
+	}
+
+	// The lines are hashed in batches. Lines of a memory-mapped 
+	// file stay valid, the others are copied into storage.
+	bool copy = !input_file.mapped();
+	std::string storage;
+	const char* line[LEAF_BATCH];
+	size_t len[LEAF_BATCH];
+	digest_t leaf[LEAF_BATCH];
+	bool more = true;
+	while( more )
+	{
+		size_t n = 0;
+		size_t bytes = 0;
+		{
+			MERKLE_STATS_TIMER(read_ns);
+			storage.clear();
+			while( n < LEAF_BATCH && (more = input_file.next(line[n], len[n])) )
+			{
+				if(copy)
+				{
+					// Remember the offset, the pointer is fixed
+					// once the storage does not grow anymore
+					const char* data = line[n];
+					line[n] = reinterpret_cast<const char*>(storage.size());
+					storage.append(data, len[n]);
+				}
+				bytes += len[n] + 1;
+				++n;
+			}
+			if(copy)
+			{
+				for (size_t i=0; i<n; ++i)
+				{
+					line[i] = storage.data() + reinterpret_cast<size_t>(line[i]);
+				}
+			}
+		}
+		if( n == 0 )
+		{
+			break;
+		}
+		MERKLE_STATS_ADD(bytes_read, bytes);
+		MERKLE_STATS_ADD(lines, n);
+		MERKLE_STATS_ADD(leaf_hashes, n);
+		{
+			MERKLE_STATS_TIMER(leaf_ns);
+			P::leaves(line, len, n, leaf);
+		}
+		MERKLE_STATS_TIMER(merge_ns);
+		for (size_t i=0; i<n; ++i)
+		{
+			f(leaf[i]);
+		}
+	}
+	input_failed = input_file.failed();
+} // END forEachLeaf
+
+
+// --- Getter for the leaves (as text) --- //
+template <class P>
+std::vector<std::string> MerkleHasher<P>::getLeaves()
+{
+	std::vector<std::string> out;
+	out.reserve(leaves.size());
+	for (size_t i=0; i<leaves.size(); ++i)
+	{
+		out.push_back( P::toString(leaves[i]) );
+	}
+	return out;
+} // END getLeaves
+
+
 // --- Method for getting the root and leafs of a Merkle tree --- //
-template <std::string (*H)(const std::string), std::string (*M)(const std::string, const std::string )>
-std::string MerkleHasher<H,M>::getRoot( const std::string file, bool saveLeaves)
+template <class P>
+std::string MerkleHasher<P>::getRoot( const std::string file, bool saveLeaves)
 {
 	// Always clear the leaves vector
 	leaves.clear();
 
-	// Initialise the output
-	std::string root;
+	// The forest of complete trees
+	MerkleForest<P> forest;
+	NoObserver none;
+	extendForest(file, 0, UINT64_MAX, forest, saveLeaves, none);
+
+	// Return the root as text. An empty file
+	// has no root.
+	digest_t root;
+	return forest.fold(root) ? P::toString(root) : std::string();
+} // END getRoot
 
-	// Make a vector to hold the roots of the 
-	// forest consisting of complete trees.
-	std::vector<std::string> roots_;
 
-	// Open the file 
-	std::ifstream input_file(file);
-	if(input_file.is_open())
+// --- Method for adding the lines in the bytes [begin, end) into a forest --- //
+template <class P>
+uint64_t MerkleHasher<P>::getForest( const std::string file, uint64_t begin, uint64_t end, MerkleForest<P>& forest)
+{
+	NoObserver none;
+	return extendForest(file, begin, end, forest, false, none);
+} // END getForest
+
+
+// --- Method for the tree over the given leaves and the hash chains of all of them --- //
+template <class P>
+std::vector<hash_chain_t> MerkleHasher<P>::getTreeChains( const std::vector<digest_t>& tree_leaves, std::string& root)
+{
+	std::vector<uint64_t> at(tree_leaves.size());
+	for (size_t i=0; i<at.size(); ++i)
 	{
-		// Loop over the lines in the file 
-		std::string line; 
-		while( std::getline(input_file, line) )
+		at[i] = i;
+	}
+	return collectChains([&](MerkleForest<P>& forest, ChainCollector& collector)
+		{
+			for (size_t i=0; i<tree_leaves.size(); ++i)
+			{
+				collector(0, tree_leaves[i]);
+				forest.insert(tree_leaves[i], 0, collector);
+			}
+		}, at, std::vector<digest_t>(), std::vector<leaf_range_t>(), root);
+} // END getTreeChains
+
+
+// --- Method for continuing the root calculation from a saved state --- //
+template <class P>
+std::string MerkleHasher<P>::resumeRoot( const std::string file, MerkleState<P>& state, bool saveLeaves)
+{
+	// Always clear the leaves vector
+	leaves.clear();
+
+	// Only complete lines are taken, the last 
+	// line may still be being written
+	uint64_t end = MerkleState<P>::completeLinesEnd(file);
+	if( end > state.offset )
+	{
+		NoObserver none;
+		state.lines += extendForest(file, state.offset, end, state.forest, saveLeaves, none);
+		state.offset = end;
+	}
+	state.mark(file);
+
+	digest_t root;
+	return state.forest.fold(root) ? P::toString(root) : std::string();
+} // END resumeRoot
+
+
+// --- Add the leaves of the file into a forest of complete trees --- //
+template <class P>
+template <class O>
+uint64_t MerkleHasher<P>::extendForest( const std::string& file, uint64_t begin, uint64_t end, 
+	MerkleForest<P>& forest, bool saveLeaves, O& observe)
+{
+	uint64_t count = 0;
+
+	auto insert = [&](const digest_t& node, uint height)
 		{
-			// Get the hash of the line and 
-			// store the leaf if asked
-			std::string leaf = hash(line);
-			if(saveLeaves) { leaves.push_back(leaf); }	
+			forest.insert(node, height, observe);
+		};
 
-			// Loop over the complete-tree-forest roots
-			for (uint i=0; i<roots_.size(); ++i)
+	// The leaves are collected into groups of 2^GROUP_HEIGHT,
+	// which are reduced level by level, hashing all the sibling 
+	// pairs of a level in one batch. Only the group roots go
+	// into the forest. A group must start at a multiple of its
+	// size, thus if the forest already holds some leaves, then 
+	// the first leaves go into the forest one by one.
+	const size_t group_size = size_t(1) << GROUP_HEIGHT;
+	std::vector<digest_t> group;
+	group.reserve(group_size);
+	uint64_t position = forest.leaves();
+
+	// Loop over the leaves of the file 
+	forEachLeaf(file, [&](const digest_t& leaf)
+		{
+			// Store the leaf if asked
+			if(saveLeaves) { saveLeaf(leaf); }	
+
+			++count;
+			observe(0, leaf);
+			if( group.empty() && (position % group_size) != 0 )
 			{
-				// Push the agglomerated value into the
-				// first slot where there is an empty string.
-				// And set the leaf variable to be "" for later
-				// checking
-				if( roots_[i] == "" )
-				{
-					std::swap(roots_[i],leaf);
-					break;
-				}
-				// Until an empty string is found, hash 
-				// the roots toghether (merge trees) and 
-				// set the roots of the merged trees to be
-				// empty string
-				else
+				insert(leaf, 0);
+				++position;
+				return;
+			}
+			group.push_back(leaf);
+			if( group.size() == group_size )
+			{
+				for (size_t n=group_size/2, level=1; n>0; n/=2, ++level)
 				{
-					leaf = hash(roots_[i],leaf);
-					roots_[i] = "";
+					P::nodes(group.data(), n, group.data());
+					for (size_t j=0; j<n; ++j)
+					{
+						observe(level, group[j]);
+					}
 				}
+				MERKLE_STATS_ADD(node_hashes, group_size - 1);
+				insert(group[0], GROUP_HEIGHT);
+				group.clear();
+				position += group_size;
+			}
+		}, begin, end);
+
+	// The leaves of the last incomplete group 
+	// go into the forest one by one
+	for (size_t i=0; i<group.size(); ++i)
+	{
+		insert(group[i], 0);
+	}
+	return count;
+} // END extendForest
+
+
+// --- Method for extracting hash chains from a Merkle tree --- //
+template <class P>
+hash_chain_t MerkleHasher<P>::getHashChain( const std::string file, std::string target_line, bool saveLeaves)
+{
+	// A single query is just a batch of one
+	std::string root;
+	return getHashChains(file, std::vector<std::string>(1, target_line), root, saveLeaves)[0];
+} // END getHashChain
+
+
+// --- Collects the siblings of chosen leaves as the tree is built --- //
+//
+// Every tracked leaf i needs the sibling (i>>l)^1 of its own node i>>l
+// on each level l of its complete subtree. The collector is the observer
+// of extendForest, thus it sees every node of a level in order and only 
+// has to compare the node counter of the level with the next wanted 
+// index. A tracker wants one sibling at a time: a right sibling is still
+// to come, a left one is either the last node seen on its level or (if 
+// it is still inside a group being reduced) comes soon. Only the wanted 
+// nodes are ever copied.
+template <class P>
+class MerkleHasher<P>::ChainCollector
+{
+
+public:
+
+	ChainCollector(size_t trackers) 
+		: next_span(0), produced(64, 0), last(64), wanted(64), found(trackers, false), 
+		  leaf_index(trackers), leaf(trackers), sibs(trackers) {}
+
+	// --- Called for every node of the tree --- //
+	void operator()(uint level, const digest_t& node)
+	{
+		// Start the trackers of a leaf, chosen either by its
+		// index, by its content or by being in a span. The 
+		// trackers of the spans are added as their leaves come.
+		if( level == 0 )
+		{
+			uint64_t i = produced[0];
+			while( !at.empty() && at.begin()->first == i )
+			{
+				start(at.begin()->second, i, node);
+				at.erase(at.begin());
 			}
-			// If there were no empty strings on in the 
-			// roots_ vector, then push the agglomerated 
-			// value to the end of the vector
-			if(leaf != "" )
+			while( next_span < spans.size() && spans[next_span].second < i )
 			{
-				roots_.push_back(leaf);
-				leaf = "";
+				++next_span;
+			}
+			if( next_span < spans.size() && spans[next_span].first <= i )
+			{
+				found.push_back(false);
+				leaf_index.push_back(0);
+				leaf.push_back(digest_t());
+				sibs.push_back(std::vector<digest_t>());
+				start(found.size() - 1, i, node);
+			}
+			if( !with.empty() )
+			{
+				typename std::map<digest_t, size_t>::iterator t = with.find(node);
+				if( t != with.end() && !found[t->second] )
+				{
+					start(t->second, i, node);
+				}
 			}
-		} 
+		}
+
+		// Hand the node to the trackers waiting for it
+		uint64_t k = produced[level]++;
+		last[level] = node;
+		std::multimap<uint64_t, size_t>& w = wanted[level];
+		while( !w.empty() && w.begin()->first == k )
+		{
+			size_t t = w.begin()->second;
+			w.erase(w.begin());
+			sibs[t].push_back(node);
+			want(t, level+1);
+		}
 	}
-	input_file.close();
 
-	// Merge the complete-tree-forest from 
-	// right-to-left. Start by finding the first
-	// non-empty string in the roots_ vector
-	// and setting it as the initial value for root
-	std::vector<std::string>::iterator it = std::find_if(roots_.begin(), roots_.end(), [](std::string s){ return s != ""; } );
-	root = *it;
+	// The trackers to start at a leaf index (at), at
+	// the first leaf with the given digest (with) or at
+	// every leaf of the spans, sorted and disjoint
+	std::multimap<uint64_t, size_t> at;
+	std::map<digest_t, size_t> with;
+	std::vector<leaf_range_t> spans;
+	size_t next_span;
+
+	// The nodes seen on each level and the last of them
+	std::vector<uint64_t> produced;
+	std::vector<digest_t> last;
+
+	// The trackers waiting for a node, by level and index
+	std::vector< std::multimap<uint64_t, size_t> > wanted;
 
-	// Move the iterator by one
-	++it;
+	// For each tracker: whether its leaf was found, the
+	// index and digest of the leaf and the siblings of
+	// its node on the levels 0, 1, ...
+	std::vector<bool> found;
+	std::vector<uint64_t> leaf_index;
+	std::vector<digest_t> leaf;
+	std::vector< std::vector<digest_t> > sibs;
 
-	// Tansvers the roots_ vector and hash r with all non-empty strings
-	for ( ; it < roots_.end(); ++it)
+private:
+	void start(size_t t, uint64_t i, const digest_t& node)
 	{
-		if (*it != "")
+		found[t] = true;
+		leaf_index[t] = i;
+		leaf[t] = node;
+		want(t, 0);
+	}
+
+	// --- Register the sibling of tracker t on the given level --- //
+	void want(size_t t, uint level)
+	{
+		for ( ; level<64; ++level)
 		{
-			root = hash(*it,root);
+			uint64_t p = leaf_index[t] >> level;
+			uint64_t s = p ^ 1;
+			// The left sibling has just been seen
+			if( s < p && produced[level] == s + 1 )
+			{
+				sibs[t].push_back(last[level]);
+				continue;
+			}
+			wanted[level].insert( std::make_pair(s, t) );
+			return;
 		}
 	}
-	// Return the root
-	return root;
-} // END getRoot
 
+}; // END CHAINCOLLECTOR
 
-// --- Method for extracting hash chains from a Merkle tree --- //
-template <std::string (*H)(const std::string), std::string (*M)(const std::string, const std::string )>
-hash_chain_t MerkleHasher<H,M>::getHashChain( const std::string file, std::string target_line, bool saveLeaves)
+
+// --- Extract the chains of leaves chosen by index and by content --- //
+//
+// All the chains and the root are computed in a single pass over the
+// file, the cost being O(file + total chain length). Once the number 
+// of leaves is known, each chain is put together from the leaf and its
+// collected siblings, which lead to the root of its complete subtree,
+// and then from the forest roots: first the fold of the smaller trees
+// on the right, then the larger trees on the left. This gives the same
+// chains as MerkleIndex::getHashChain.
+template <class P>
+template <class B>
+std::vector<hash_chain_t> MerkleHasher<P>::collectChains( B build, const std::vector<uint64_t>& at, 
+	const std::vector<digest_t>& with, const std::vector<leaf_range_t>& spans, std::string& root)
 {
 	// Always clear the leaves vector
 	leaves.clear();
 
-	// Initialise the output
-	hash_chain_t chain;
-
 	// Initialise the root
-	std::string root;
+	root = "";
 
-	// Make a vector to hold the roots of the 
-	// forest consisting of complete trees.
-	std::vector<std::string> roots_;
+	// Set up the trackers, targets with equal 
+	// content share the same tracker
+	std::vector<size_t> query_tracker(at.size() + with.size());
+	size_t trackers = 0;
+	std::multimap<uint64_t, size_t> by_index;
+	std::map<digest_t, size_t> by_content;
+	for (size_t q=0; q<at.size(); ++q)
+	{
+		query_tracker[q] = trackers;
+		by_index.insert( std::make_pair(at[q], trackers++) );
+	}
+	for (size_t q=0; q<with.size(); ++q)
+	{
+		typename std::map<digest_t, size_t>::iterator t = by_content.find(with[q]);
+		if( t == by_content.end() )
+		{
+			t = by_content.insert( std::make_pair(with[q], trackers++) ).first;
+		}
+		query_tracker[at.size() + q] = t->second;
+	}
+	ChainCollector collector(trackers);
+	collector.at.swap(by_index);
+	collector.with.swap(by_content);
+	collector.spans = spans;
 
-	// Initialise the target
-	std::string target = hash(target_line);
+	// Build the tree
+	MerkleForest<P> forest;
+	build(forest, collector);
+	digest_t top;
+	if( forest.fold(top) )
+	{
+		root = P::toString(top);
+	}
 
-	// Open the file 
-	std::ifstream input_file(file);
-	if(input_file.is_open())
-	{
-		// Loop over the lines in the file 
-		std::string line; 
-		while( std::getline(input_file, line) )
-		{
-			// Get the hash of the line and 
-			// store the leaf if asked
-			std::string leaf = hash(line);
-			if(saveLeaves) { leaves.push_back(leaf); }
-			
-			// Loop over the complete-tree-forest roots
-			for (uint i=0; i<roots_.size(); ++i)
-			{				
-				// Push the agglomerated value into the
-				// first slot where there is an empty string.
-				// And set the leaf variable to be "" for later
-				// checking
-				if( roots_[i] == "" )
-				{
-					std::swap(roots_[i],leaf);
-					break;
-				}
-				// Until an empty string is found, hash 
-				// the roots toghether (merge trees) and 
-				// set the roots of the merged trees to be
-				// empty string
-				else
-				{	// Before conducting the hashing,
-					// check if any of the two values
-					// entering the hash function, is
-					// equvalent to the target. If yes,
-					// then store them into the hash_chain
-					// in correct order.
-					if ( roots_[i] != target && leaf != target )
-					{
-						leaf = hash(roots_[i],leaf);
-						roots_[i] = "";
-					}
-					else if( roots_[i] == target )
-					{
-						// First push the one which corresponds to the target. 
-						chain.push_back( std::make_pair(0,roots_[i]) ); 
-						chain.push_back( std::make_pair(1,leaf) );		
-						leaf = hash(roots_[i],leaf);
-						roots_[i] = "";
-						target = leaf;
-					}
-					else
-					{
-						// First push the one which corresponds to the target. 
-						chain.push_back( std::make_pair(1,leaf) );		 
-						chain.push_back( std::make_pair(0,roots_[i]) ); 
-						leaf = hash(roots_[i],leaf);
-						roots_[i] = "";
-						target = leaf;
-					}
-				}
+	// Put the chains together. Leaves which were 
+	// not found keep an empty chain.
+	size_t query_trackers = trackers;
+	trackers = collector.found.size();
+	std::vector<hash_chain_t> text_chains(trackers);
+	for (size_t t=0; t<trackers; ++t)
+	{
+		if( !collector.found[t] )
+		{
+			continue;
+		}
+		hash_chain_t& chain = text_chains[t];
+		const std::vector<digest_t>& sibs = collector.sibs[t];
+		uint64_t i = collector.leaf_index[t];
+
+		// Inside the complete subtree of the leaf
+		digest_t cur = collector.leaf[t];
+		uint level = 0;
+		for ( ; level<sibs.size(); ++level)
+		{
+			if( (i >> level) & 1 )
+			{
+				chain.push_back( std::make_pair(1, P::toString(cur)) );
+				chain.push_back( std::make_pair(0, P::toString(sibs[level])) );
+				cur = hash(sibs[level], cur);
 			}
-			// If there were no empty strings on in the 
-			// roots_ vector, then push the agglomerated 
-			// value to the end of the vector
-			if(leaf != "" )
+			else
 			{
-				roots_.push_back(leaf);
-				leaf = "";
+				chain.push_back( std::make_pair(0, P::toString(cur)) );
+				chain.push_back( std::make_pair(1, P::toString(sibs[level])) );
+				cur = hash(cur, sibs[level]);
 			}
 		}
+
+		// The smaller trees of the forest on the right
+		digest_t acc;
+		if( forest.fold(acc, level) )
+		{
+			chain.push_back( std::make_pair(0, P::toString(cur)) );
+			chain.push_back( std::make_pair(1, P::toString(acc)) );
+			cur = hash(cur, acc);
+		}
+
+		// The larger trees of the forest on the left
+		for (uint g=level+1; g<MerkleForest<P>::MAX_HEIGHT; ++g)
+		{
+			if( forest.filled(g) )
+			{
+				chain.push_back( std::make_pair(1, P::toString(cur)) );
+				chain.push_back( std::make_pair(0, P::toString(forest.root(g))) );
+				cur = hash(forest.root(g), cur);
+			}
+		}
+		chain.push_back( std::make_pair(-1, P::toString(cur)) );
 	}
-	input_file.close();
-	
 
-	// Merge the complete-tree-forest from 
-	// right-to-left. Start by finding the first
-	// non-empty string in the roots_ vector
-	// and setting it as the initial value for root
-	std::vector<std::string>::iterator it = std::find_if(roots_.begin(), roots_.end(), [](std::string s){ return s != ""; } );
-	root = *it;
+	// Hand out the chains in the order of the queries,
+	// then those of the spans in the order of the leaves
+	std::vector<hash_chain_t> out(query_tracker.size());
+	for (size_t q=0; q<query_tracker.size(); ++q)
+	{
+		out[q] = text_chains[query_tracker[q]];
+	}
+	for (size_t t=query_trackers; t<trackers; ++t)
+	{
+		out.push_back( std::move(text_chains[t]) );
+	}
+	return out;
+} // END collectChains
 
-	// Move the iterator by one
-	++it;
 
-	// Tansvers the roots_ vector and hash r with all non-empty strings
-	// During the hashing stage, use the same logic as during roots_ traversal
-	// above for adding values to the hash chain. In the end of this step the
-	// only missing value from the hash chain will be the final root.
-	for ( ; it < roots_.end(); ++it)
+// --- Method for extracting many hash chains and the root in one pass --- //
+// 
+// The lines are looked up by content on top of the extraction by index:
+// the first leaf equal to the hash of a target line is the one whose 
+// chain is returned. Use getHashChainsAt for logs with duplicate lines.
+template <class P>
+std::vector<hash_chain_t> MerkleHasher<P>::getHashChains( const std::string file, const std::vector<std::string>& target_lines, std::string& root, bool saveLeaves)
+{
+	std::vector<digest_t> targets(target_lines.size());
+	for (size_t q=0; q<target_lines.size(); ++q)
 	{
-		if (*it != "")
+		targets[q] = hash(target_lines[q]);
+	}
+	return collectChains([&](MerkleForest<P>& forest, ChainCollector& collector)
 		{
-			if ( root != target && *it != target)
+			extendForest(file, 0, UINT64_MAX, forest, saveLeaves, collector);
+		}, std::vector<uint64_t>(), targets, std::vector<leaf_range_t>(), root);
+} // END getHashChains
+
+
+// --- Method for extracting the hash chains of ranges of leaves --- //
+//
+// The ranges are not expanded beforehand, as the number of leaves is 
+// only known after the pass: the collector starts a tracker for each 
+// leaf of the merged ranges as the leaf is hashed. The chains of the
+// merged ranges are then handed out range by range.
+template <class P>
+std::vector<hash_chain_t> MerkleHasher<P>::getHashChainsAt( const std::string file, const std::vector<leaf_range_t>& leaf_ranges, 
+	std::string& root, uint64_t& leaf_count, bool saveLeaves)
+{
+	// Merge the ranges into sorted and disjoint spans
+	std::vector<leaf_range_t> spans(leaf_ranges);
+	std::sort(spans.begin(), spans.end());
+	size_t merged = 0;
+	for (size_t r=0; r<spans.size(); ++r)
+	{
+		if( merged > 0 && (spans[merged-1].second == UINT64_MAX || spans[r].first <= spans[merged-1].second + 1) )
+		{
+			spans[merged-1].second = std::max(spans[merged-1].second, spans[r].second);
+			continue;
+		}
+		spans[merged++] = spans[r];
+	}
+	spans.resize(merged);
+
+	leaf_count = 0;
+	std::vector<hash_chain_t> span_chains = collectChains([&](MerkleForest<P>& forest, ChainCollector& collector)
+		{
+			leaf_count = extendForest(file, 0, UINT64_MAX, forest, saveLeaves, collector);
+		}, std::vector<uint64_t>(), std::vector<digest_t>(), spans, root);
+
+	// Sorted and disjoint ranges are the spans
+	if( spans == leaf_ranges )
+	{
+		return span_chains;
+	}
+
+	// The chains of the spans follow each other, those of 
+	// leaf i in span s being at before[s] + i - spans[s].first
+	std::vector<uint64_t> before(spans.size(), 0);
+	for (size_t r=1; r<spans.size(); ++r)
+	{
+		before[r] = before[r-1] + (spans[r-1].second - spans[r-1].first + 1);
+	}
+	std::vector<hash_chain_t> chains;
+	for (size_t r=0; r<leaf_ranges.size(); ++r)
+	{
+		if( leaf_ranges[r].first >= leaf_count )
+		{
+			continue;
+		}
+		uint64_t last = std::min(leaf_ranges[r].second, leaf_count - 1);
+		size_t s = std::upper_bound(spans.begin(), spans.end(), leaf_range_t(leaf_ranges[r].first, UINT64_MAX)) - spans.begin() - 1;
+		for (uint64_t i=leaf_ranges[r].first; i<=last; ++i)
+		{
+			chains.push_back( span_chains[before[s] + (i - spans[s].first)] );
+		}
+	}
+	return chains;
+} // END getHashChainsAt
+
+
+// --- Method for signing a growing file block by block --- //
+template <class P>
+template <class F>
+bool MerkleHasher<P>::followBlocks( const std::string file, uint64_t offset, uint64_t first_line, uint64_t block_lines, 
+	double block_seconds, volatile sig_atomic_t* stop, F on_block)
+{
+	typedef std::chrono::steady_clock clock;
+	input_failed = false;
+
+	// The file being followed, a rotated log is another file
+	struct stat followed;
+	if( ::stat(file.c_str(), &followed) != 0 )
+	{
+		return false;
+	}
+
+	// The file position, the end of the lines hashed into
+	// blocks and the forest of the current block
+	uint64_t block_end = offset;
+	uint64_t block_first = first_line;
+	uint64_t block_count = 0;
+	clock::time_point block_start;
+	MerkleForest<P> forest;
+
+	// Add a leaf into the current block
+	auto add = [&](const digest_t& leaf)
+		{
+			if( block_count == 0 )
 			{
-				root = hash(*it,root);	
+				block_start = clock::now();
 			}
-			else if (*it == target)
+			forest.insert(leaf, 0);
+			++block_count;
+		};
+
+	// Close the current block, if it has any lines
+	auto close = [&]()
+		{
+			digest_t root;
+			if( forest.fold(root) )
 			{
-				// First push the one which corresponds to the target. 
-				chain.push_back( std::make_pair(0,*it) ); 
-				chain.push_back( std::make_pair(1,root) );
-				root = hash(*it,root);
-				target = root;
+				on_block(block_first, block_first + block_count - 1, block_end, P::toString(root));
 			}
-			else
+			forest.clear();
+			block_first += block_count;
+			block_count = 0;
+		};
+	auto expired = [&]()
+		{
+			return block_count > 0 && block_seconds > 0 && 
+				std::chrono::duration<double>(clock::now() - block_start).count() >= block_seconds;
+		};
+
+	while( true )
+	{
+		bool stopping = *stop;
+
+		// A file shorter than what has been read was truncated, 
+		// another file under the name was rotated in. The blocks 
+		// would not match it anymore.
+		struct stat now;
+		if( ::stat(file.c_str(), &now) != 0 || now.st_dev != followed.st_dev || now.st_ino != followed.st_ino
+			|| uint64_t(now.st_size) < offset )
+		{
+			close();
+			return false;
+		}
+
+		// Hash the complete lines added since the last look,
+		// closing the blocks as they fill up
+		uint64_t end = MerkleState<P>::completeLinesEnd(file);
+		if( end > offset )
+		{
+			// A log that can not be read ends the following,
+			// the lines read so far still make up a block
+			LineReader input_file(file, offset, end);
+			if( !input_file.is_open() )
+			{
+				input_failed = true;
+				close();
+				return false;
+			}
+			const char* line[LEAF_BATCH];
+			size_t len[LEAF_BATCH];
+			digest_t leaf[LEAF_BATCH];
+			bool more = true;
+			while( more )
+			{
+				// Lines of a memory-mapped file stay valid, thus
+				// they are hashed in batches not crossing blocks
+				size_t max = input_file.mapped() ? LEAF_BATCH : 1;
+				if( block_lines > 0 )
+				{
+					max = std::min<uint64_t>(max, block_lines - block_count);
+				}
+				size_t n = 0;
+				while( n < max && (more = input_file.next(line[n], len[n])) )
+				{
+					++n;
+				}
+				if( n > 0 )
+				{
+					P::leaves(line, len, n, leaf);
+					MERKLE_STATS_ADD(lines, n);
+					MERKLE_STATS_ADD(leaf_hashes, n);
+				}
+				for (size_t i=0; i<n; ++i)
+				{
+					add(leaf[i]);
+					block_end += len[i] + 1;
+				}
+				if( (block_lines > 0 && block_count == block_lines) || expired() )
+				{
+					close();
+				}
+			}
+			if( input_file.failed() )
 			{
-				// First push the one which corresponds to the target. 
-				chain.push_back( std::make_pair(1,root) ); 
-				chain.push_back( std::make_pair(0,*it) );
-				root = hash(*it,root);
-				target = root;
+				input_failed = true;
+				close();
+				return false;
 			}
-			
+
+			// Only the lines actually read are behind the offset
+			offset = block_end;
+		}
+
+		if( expired() )
+		{
+			close();
+		}
+		if( stopping )
+		{
+			close();
+			return true;
 		}
+		std::this_thread::sleep_for( std::chrono::milliseconds(FOLLOW_POLL_MS) );
+	}
+} // END followBlocks
+
+
+// --- Method for getting the root and writing the index of the tree --- //
+// The leaves are streamed into the index file and the upper levels
+// are built from it afterwards, thus the whole tree is never held
+// in memory.
+template <class P>
+std::string MerkleHasher<P>::buildIndex( const std::string file, const std::string index_file, const std::string lookup_file, bool saveLeaves)
+{
+	// Always clear the leaves vector
+	leaves.clear();
+
+	MerkleIndexWriter<P> writer;
+	if( !writer.open(index_file) )
+	{
+		return std::string();
 	}
-	// Now check if the target == root. If it does,
-	// add it to the chain. If not, then the initial 
-	// target was not amongs the leafs.
-	if ( target == root )
+	MerkleLookupWriter<P> lookup;
+	bool with_lookup = !lookup_file.empty();
+	if( with_lookup && !lookup.open(lookup_file) )
 	{
-		chain.push_back( std::make_pair(-1,root) );	
+		return std::string();
 	}
-	
-	// Return the hash chain
-	return chain;
-} // END getHashChain
+
+	// Loop over the leaves of the file 
+	forEachLeaf(file, [&](const digest_t& leaf)
+		{
+			// Store the leaf if asked
+			if(saveLeaves) { saveLeaf(leaf); }
+			writer.addLeaf(leaf);
+			if(with_lookup) { lookup.addLeaf(leaf); }
+		});
+
+	// A log that could not be read to its end gets no index,
+	// neither does one whose index could not be written
+	digest_t root;
+	merkle_log_id_t log = logFileId(file);
+	if( input_failed || !writer.finish(log, root) || (with_lookup && !lookup.finish(log, root)) )
+	{
+		unlink(index_file.c_str());
+		if(with_lookup) { unlink(lookup_file.c_str()); }
+		return std::string();
+	}
+	return P::toString(root);
+} // END buildIndex
 
 
 // --- Method for verifying if a hash chain is self-consistent --- //
-template <std::string (*H)(const std::string), std::string (*M)(const std::string, const std::string )>
-bool MerkleHasher<H,M>::selfConsistentHashChain(hash_chain_t& chain)
+template <class P>
+bool MerkleHasher<P>::selfConsistentHashChain(hash_chain_t& chain)
 {
 	// Chain of size 0 or 1 is always self-consisten
 	if( chain.size() < 2)
@@ -327,23 +1061,34 @@ bool MerkleHasher<H,M>::selfConsistentHashChain(hash_chain_t& chain)
 	// If any discrepancy is found, return false.
 	else
 	{
-		for(uint i=0; i < chain.size() - 2; i=i+2  )
+		// Turn the text chain into digests
+		digest_chain_t dchain(chain.size());
+		for(uint i=0; i < chain.size(); ++i)
 		{
-			std::string tmp_hash;
-			if(chain[i].first == 0)
+			dchain[i].first = chain[i].first;
+			if( !P::fromString(chain[i].second, dchain[i].second) )
 			{
-				tmp_hash = hash( chain[i].second, chain[i+1].second );
+				return false;
+			}
+		}
+
+		for(uint i=0; i < dchain.size() - 2; i=i+2  )
+		{
+			digest_t tmp_hash;
+			if(dchain[i].first == 0)
+			{
+				tmp_hash = hash( dchain[i].second, dchain[i+1].second );
 			}
 			else
 			{
-				tmp_hash = hash( chain[i+1].second, chain[i].second );
+				tmp_hash = hash( dchain[i+1].second, dchain[i].second );
 			}
 
-			if( tmp_hash != chain[i+2].second)
+			if( tmp_hash != dchain[i+2].second)
 			{
 				return false;
 			}
-			if(chain[i].first == chain[i+1].first)
+			if(dchain[i].first == dchain[i+1].first)
 			{
 				return false;
 			}
@@ -355,4 +1100,294 @@ bool MerkleHasher<H,M>::selfConsistentHashChain(hash_chain_t& chain)
 } // END selfConsistentHashChain
 
 
+// --- Method for verifying a consistency proof between two tree sizes --- //
+//
+// As in RFC 9162 (section 2.1.4.2): both roots are hashed up at once from
+// the node where the old tree ends, the proof nodes on its left going into
+// both and those on its right into the new root only. fn and sn are the 
+// positions of the last old and new leaf within the current level.
+template <class P>
+bool MerkleHasher<P>::verifyConsistency( uint64_t old_size, uint64_t new_size, const std::vector<digest_t>& proof,
+	const digest_t& old_root, const digest_t& new_root)
+{
+	if(old_size < 1 || old_size > new_size)
+	{
+		return false;
+	}
+	if(old_size == new_size)
+	{
+		return proof.empty() && old_root == new_root;
+	}
+
+	// If the old tree is a complete node, its root is the first node
+	std::vector<digest_t> path;
+	if( (old_size & (old_size - 1)) == 0 )
+	{
+		path.push_back(old_root);
+	}
+	path.insert(path.end(), proof.begin(), proof.end());
+	if(path.empty())
+	{
+		return false;
+	}
+
+	uint64_t fn = old_size - 1;
+	uint64_t sn = new_size - 1;
+	while(fn & 1)
+	{
+		fn >>= 1;
+		sn >>= 1;
+	}
+	digest_t fr = path[0];
+	digest_t sr = path[0];
+	for (size_t i=1; i<path.size(); ++i)
+	{
+		if(sn == 0)
+		{
+			return false;
+		}
+		if( (fn & 1) || fn == sn )
+		{
+			fr = hash(path[i], fr);
+			sr = hash(path[i], sr);
+			while( !(fn & 1) && fn != 0 )
+			{
+				fn >>= 1;
+				sn >>= 1;
+			}
+		}
+		else
+		{
+			sr = hash(sr, path[i]);
+		}
+		fn >>= 1;
+		sn >>= 1;
+	}
+	return sn == 0 && fr == old_root && sr == new_root;
+} // END verifyConsistency
+
+
+// --- Method for verifying a multi-proof of many leaves at once --- //
+// The root is hashed up level by level in a single walk, taking the
+// missing nodes from the proof in order.
+template <class P>
+bool MerkleHasher<P>::verifyMultiProof( uint64_t n, const std::vector<uint64_t>& indices, const std::vector<digest_t>& leaves,
+	const std::vector<digest_t>& proof, const digest_t& root)
+{
+	size_t used = 0;
+	digest_t r;
+	bool ok = walkMultiProof<P>(n, indices, leaves, [&](uint64_t, uint64_t, digest_t& out)
+		{
+			if(used == proof.size())
+			{
+				return false;
+			}
+			out = proof[used++];
+			return true;
+		}, r);
+	return ok && used == proof.size() && r == root;
+} // END verifyMultiProof
+
+
+// --- The outcome of verifying a hash chain (as text) --- //
+template <class P>
+const char* MerkleHasher<P>::chainStatusName(int status)
+{
+	switch(status)
+	{
+		case CHAIN_OK:			return "ok";
+		case CHAIN_MALFORMED:	return "malformed hash chain";
+		case CHAIN_WRONG_LINE:	return "the leaf is not the hash of the line";
+		case CHAIN_BROKEN:		return "a step of the hash chain does not hash up";
+		case CHAIN_WRONG_ROOT:	return "the hash chain does not end in the signed root";
+	}
+	return "unknown";
+} // END chainStatusName
+
+
+// --- The text hash chains as a source of verifyBatched --- //
+// Step s hashes the entries 2s and 2s+1, the result being entry 2s+2.
+template <class P>
+struct MerkleHasher<P>::TextChains
+{
+	const std::vector<hash_chain_t>& chains;
+
+	TextChains(const std::vector<hash_chain_t>& c) : chains(c) {}
+	size_t size() const { return chains.size(); }
+	bool leaf(size_t k, digest_t& d) const
+	{
+		const hash_chain_t& chain = chains[k];
+		return chain.size() % 2 == 1 && chain.back().first == -1 && P::fromString(chain[0].second, d);
+	}
+	size_t depth(size_t k) const { return chains[k].size()/2; }
+	bool step(size_t k, size_t s, int& pos, digest_t& sib) const
+	{
+		const hash_chain_t& chain = chains[k];
+		pos = chain[2*s].first;
+		return (pos == 0 || pos == 1) && chain[2*s+1].first == 1 - pos && P::fromString(chain[2*s+1].second, sib);
+	}
+	bool check(size_t k, size_t s, const digest_t& node, digest_t& tmp) const
+	{
+		return P::fromString(chains[k][2*s+2].second, tmp) && tmp == node;
+	}
+};
+
+// --- The proofs of a container as a source of verifyBatched --- //
+// A proof has no intermediate nodes to check.
+template <class P>
+struct MerkleHasher<P>::BinaryProofs
+{
+	const MerkleProofs<P>& proofs;
+
+	BinaryProofs(const MerkleProofs<P>& p) : proofs(p) {}
+	size_t size() const { return proofs.count(); }
+	bool leaf(size_t k, digest_t& d) const
+	{
+		if( !proofs.valid(k) )
+		{
+			return false;
+		}
+		proofs.leaf(k, d);
+		return true;
+	}
+	size_t depth(size_t k) const { return proofs.depth(k); }
+	bool step(size_t k, size_t s, int& pos, digest_t& sib) const
+	{
+		pos = proofs.right(k, s) ? 1 : 0;
+		proofs.sibling(k, s, sib);
+		return true;
+	}
+	bool check(size_t, size_t, const digest_t&, digest_t&) const { return true; }
+};
+
+
+// --- Method for verifying many hash chains against a signed root --- //
+template <class P>
+std::vector<int> MerkleHasher<P>::verifyHashChains( const std::vector<hash_chain_t>& chains, 
+	const std::vector<const std::string*>& lines, const std::string& root)
+{
+	return verifyBatched(TextChains(chains), lines, root);
+} // END verifyHashChains
+
+
+// --- Method for verifying the proofs of a container against a signed root --- //
+template <class P>
+std::vector<int> MerkleHasher<P>::verifyProofs( const MerkleProofs<P>& proofs, 
+	const std::vector<const std::string*>& lines, const std::string& root)
+{
+	return verifyBatched(BinaryProofs(proofs), lines, root);
+} // END verifyProofs
+
+
+// --- Verify the chains of a source C in batches on all threads --- //
+// The threads take batches of LEAF_BATCH chains from a shared counter. 
+// The chains of a batch are walked up together, one step at a time, so
+// that each step is a single P::nodes call over all the unfinished 
+// chains. A chain leaves the batch as soon as it fails or reaches its
+// end. The buffers are per thread, thus a step allocates nothing.
+template <class P>
+template <class C>
+std::vector<int> MerkleHasher<P>::verifyBatched( const C& chains, const std::vector<const std::string*>& lines, const std::string& root)
+{
+	std::vector<int> status(chains.size(), CHAIN_WRONG_ROOT);
+	digest_t signed_root;
+	if( !P::fromString(root, signed_root) )
+	{
+		return status;
+	}
+
+	std::atomic<size_t> next(0);
+	auto work = [&]()
+		{
+			// The current node of each chain and the pairs to hash
+			digest_t cur[LEAF_BATCH];
+			digest_t pairs[2*LEAF_BATCH];
+			digest_t out[LEAF_BATCH];
+			digest_t step;
+			size_t active[LEAF_BATCH];
+
+			size_t first;
+			while( (first = next.fetch_add(LEAF_BATCH)) < chains.size() )
+			{
+				size_t last = std::min(first + LEAF_BATCH, chains.size());
+
+				// The leaves, which must match the lines if given
+				size_t n = 0;
+				for (size_t k=first; k<last; ++k)
+				{
+					if( !chains.leaf(k, cur[n]) )
+					{
+						status[k] = CHAIN_MALFORMED;
+						continue;
+					}
+					if( k < lines.size() && lines[k] )
+					{
+						if( hash(*lines[k]) != cur[n] )
+						{
+							status[k] = CHAIN_WRONG_LINE;
+							continue;
+						}
+					}
+					active[n++] = k;
+				}
+
+				// Step s hashes the node with its sibling
+				for (size_t s=0; n>0; ++s)
+				{
+					size_t m = 0;
+					for (size_t j=0; j<n; ++j)
+					{
+						size_t k = active[j];
+						if( s == chains.depth(k) )
+						{
+							status[k] = (cur[j] == signed_root) ? CHAIN_OK : CHAIN_WRONG_ROOT;
+							continue;
+						}
+						int pos;
+						if( !chains.step(k, s, pos, step) )
+						{
+							status[k] = CHAIN_MALFORMED;
+							continue;
+						}
+						pairs[2*m + pos] = cur[j];
+						pairs[2*m + 1 - pos] = step;
+						active[m++] = k;
+					}
+					if( m == 0 )
+					{
+						break;
+					}
+					MERKLE_STATS_ADD(node_hashes, m);
+					P::nodes(pairs, m, out);
+
+					n = 0;
+					for (size_t j=0; j<m; ++j)
+					{
+						size_t k = active[j];
+						if( !chains.check(k, s, out[j], step) )
+						{
+							status[k] = CHAIN_BROKEN;
+							continue;
+						}
+						cur[n] = out[j];
+						active[n++] = k;
+					}
+				}
+			}
+		};
+
+	std::vector<std::thread> workers;
+	for (unsigned t=1; t<threads; ++t)
+	{
+		workers.push_back( std::thread(work) );
+	}
+	work();
+	for (size_t t=0; t<workers.size(); ++t)
+	{
+		workers[t].join();
+	}
+	return status;
+} // END verifyBatched
+
+
 #endif // MERKLE_HASHER_HPP
@@ -0,0 +1,703 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleIndex.hpp
+ *
+ *	Implements a persistent index of a Merkle tree, which
+ *	holds every node of the tree, so that hash chains can
+ *	later be extracted without rehashing the log file:
+ *		a)	MerkleIndexWriter streams the leaves into the
+ *			index file and then builds the upper levels
+ *			one by one from the level below, reading it
+ *			back from the file. Thus only a small buffer
+ *			is ever held in memory.
+ *		b)	MerkleIndex memory-maps an index file and
+ *			extracts the hash chain of a leaf by reading
+ *			only the ~log2(n) sibling nodes it needs.
+ *		c)	It also gives the root of any prefix of the
+ *			log and the consistency proof between that
+ *			root and the whole tree, which shows that the
+ *			log has only been appended to since.
+ *		d)	And the multi-proof of many leaves at once,
+ *			without the nodes their chains share (see
+ *			merkleMultiProof.hpp).
+ *
+ *	The tree is the one built by MerkleHasher: level l holds
+ *	the n>>l complete nodes of height l, the forest of complete
+ *	trees are the last nodes of the levels whose bit is set in
+ *	n and these are merged from right to left. The partial merges
+ *	of that last step (the spine) are stored separately.
+ *
+ *	The tree splits n leaves into the complete tree of the first
+ *	2^k < n leaves and the tree of the rest, as the trees of RFC
+ *	6962, so consistency proofs are those of its section 2.1.2.
+ *
+ *	File layout: header, spine (64 digests), levels 0..top.
+ *	The header records the hash policy, the size, modification
+ *	time and inode of the log file and the root, which ties the
+ *	index to the log and its signed root. A rewrite of the log
+ *	that keeps all three (e.g. one that sets the old modification
+ *	time back) is not noticed. Only policies with fixed size
+ *	digests can be stored.
+ */
+
+#ifndef MERKLE_INDEX_HPP
+#define MERKLE_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "myHashInterface.hpp"
+#include "merkleStats.hpp"
+#include "merkleMultiProof.hpp"
+
+
+// --- What ties an index to its log file --- //
+struct merkle_log_id_t
+{
+	uint64_t size;				// Size of the log file in bytes
+	uint64_t mtime_ns;			// Its modification time
+	uint64_t inode;				// And its inode number
+
+	bool operator==(const merkle_log_id_t& other) const
+	{
+		return size == other.size && mtime_ns == other.mtime_ns && inode == other.inode;
+	}
+};
+
+// --- The identity of a log file, all 0 if it is not a regular file --- //
+inline merkle_log_id_t logFileId(const std::string& file)
+{
+	merkle_log_id_t id = {0, 0, 0};
+	struct stat st;
+	if( stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) )
+	{
+		id.size = st.st_size;
+		id.mtime_ns = uint64_t(st.st_mtim.tv_sec)*1000000000 + st.st_mtim.tv_nsec;
+		id.inode = st.st_ino;
+	}
+	return id;
+}
+
+// --- The index file header --- //
+struct merkle_index_header_t
+{
+	char magic[8];				// "MRKLIDX1"
+	uint32_t version;
+	uint32_t digest_size;
+	char policy[16];			// P::name()
+	uint64_t leaves;			// Number of leaves n
+	merkle_log_id_t log;		// The log file
+	uint64_t levels;			// Number of stored levels
+	uint64_t spine_offset;		// File offset of the spine
+	uint64_t level_offset[64];	// File offset of each level
+	uint8_t root[64];			// The root digest
+};
+
+static const char MERKLE_INDEX_MAGIC[8] = {'M','R','K','L','I','D','X','1'};
+static const uint32_t MERKLE_INDEX_VERSION = 2;
+
+// --- Size of a file, or 0 if it is not a regular file --- //
+inline uint64_t regularFileSize(const std::string& file)
+{
+	struct stat st;
+	if( stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) )
+	{
+		return st.st_size;
+	}
+	return 0;
+}
+
+// --- Write all of buf at offset, returns false on error --- //
+inline bool pwriteAll(int fd, const void* buf, size_t len, uint64_t offset)
+{
+	const char* p = static_cast<const char*>(buf);
+	while(len > 0)
+	{
+		ssize_t n = ::pwrite(fd, p, len, offset);
+		if(n < 0 && errno == EINTR)	{	continue;	}
+		if(n <= 0)	{	return false;	}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+// --- Read all of buf from offset, returns false on error --- //
+inline bool preadAll(int fd, void* buf, size_t len, uint64_t offset)
+{
+	char* p = static_cast<char*>(buf);
+	while(len > 0)
+	{
+		ssize_t n = ::pread(fd, p, len, offset);
+		if(n < 0 && errno == EINTR)	{	continue;	}
+		if(n <= 0)	{	return false;	}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+
+
+// ----------------------------------------- //
+// ----- MerkleIndexWriter DECLARATION ----- //
+// ----------------------------------------- //
+template <class P>
+class MerkleIndexWriter
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleIndexWriter() : fd(-1), n(0), ok(false) {}
+	~MerkleIndexWriter() { if(fd >= 0) { ::close(fd); } }
+
+	// --- Create the index file, returns false on error --- //
+	bool open(const std::string& index_file);
+
+	// --- Append the next leaf --- //
+	void addLeaf(const digest_t& leaf);
+
+	// --- Build the upper levels and the header, returns false on error --- //
+	// The root is returned through root. An empty log gives no index.
+	bool finish(const merkle_log_id_t& log, digest_t& root);
+
+private:
+	MerkleIndexWriter(const MerkleIndexWriter&);
+	MerkleIndexWriter& operator=(const MerkleIndexWriter&);
+
+	// --- Write out the buffer --- //
+	void flush();
+
+	int fd;
+	uint64_t n;
+	bool ok;
+	merkle_index_header_t header;
+
+	// The write buffer and the file offset where it goes
+	std::vector<uint8_t> buf;
+	uint64_t buf_offset;
+
+	static const size_t BUFFER_DIGESTS = 1 << 15;
+
+}; // END MERKLEINDEXWRITER DECLARATION
+
+
+
+// ----------------------------------- //
+// ----- MerkleIndex DECLARATION ----- //
+// ----------------------------------- //
+template <class P>
+class MerkleIndex
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleIndex() : map(0), map_size(0), header(0) {}
+	~MerkleIndex() { if(map) { munmap(map, map_size); } }
+
+	// --- Map the index file, returns an error message or "" --- //
+	std::string open(const std::string& index_file);
+
+	// --- Basic information --- //
+	uint64_t leaves() const { return header->leaves; }
+	const merkle_log_id_t& log() const { return header->log; }
+
+	// --- Whether the index is of the log file as it is now --- //
+	bool matchesLog(const std::string& log_file) const { return header->log == logFileId(log_file); }
+	digest_t root() const { digest_t d; P::fromBytes(header->root, d); return d; }
+
+	// --- Node index of the given level (a complete node) --- //
+	digest_t node(uint64_t level, uint64_t index) const;
+
+	// --- Fold of the forest roots below the given height --- //
+	digest_t spine(uint64_t height) const;
+
+	// --- Hash chain of leaf number i (0-based), empty if out of range --- //
+	hash_chain_t getHashChain(uint64_t i) const;
+
+	// --- Root of the tree of the first m leaves, 1 <= m <= leaves() --- //
+	digest_t rootAt(uint64_t m) const;
+
+	// --- Consistency proof of the tree of the first m leaves, 1 <= m <= leaves() --- //
+	// The nodes that prove rootAt(m) to be the root of a prefix of the tree,
+	// at most ~2*log2(n) of them and none for m = leaves().
+	std::vector<digest_t> consistencyProof(uint64_t m) const;
+
+	// --- Multi-proof of the leaves (0-based, increasing) --- //
+	// The nodes in the order of walkMultiProof. Returns false if the
+	// indices are not increasing or out of range.
+	bool multiProof(const std::vector<uint64_t>& indices, std::vector<digest_t>& proof) const;
+
+private:
+	MerkleIndex(const MerkleIndex&);
+	MerkleIndex& operator=(const MerkleIndex&);
+
+	// --- Root of the leaves [begin, end) of a node of a consistency proof --- //
+	// Either a complete node or the fold of the forest at the right edge.
+	digest_t range(uint64_t begin, uint64_t end) const;
+
+	// --- The proof of the first m leaves of the subtree [begin, end) --- //
+	// As SUBPROOF of RFC 6962, whole telling whether the first m leaves are
+	// still the whole old tree, whose root the verifier has.
+	void subproof(uint64_t m, uint64_t begin, uint64_t end, bool whole, std::vector<digest_t>& proof) const;
+
+	void* map;
+	size_t map_size;
+	const merkle_index_header_t* header;
+
+}; // END MERKLEINDEX DECLARATION
+
+
+
+// -------------------------------------------- //
+// ----- MerkleIndexWriter IMPLEMENTATION ----- //
+// -------------------------------------------- //
+
+
+// --- Create the index file --- //
+template <class P>
+bool MerkleIndexWriter<P>::open(const std::string& index_file)
+{
+	if(P::DIGEST_SIZE == 0 || P::DIGEST_SIZE > sizeof(header.root))
+	{
+		return false;
+	}
+	fd = ::open(index_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MERKLE_INDEX_MAGIC, sizeof(header.magic));
+	header.version = MERKLE_INDEX_VERSION;
+	header.digest_size = P::DIGEST_SIZE;
+	strncpy(header.policy, P::name(), sizeof(header.policy) - 1);
+	header.spine_offset = sizeof(header);
+	header.level_offset[0] = header.spine_offset + 64*P::DIGEST_SIZE;
+
+	buf.reserve(BUFFER_DIGESTS * P::DIGEST_SIZE);
+	buf_offset = header.level_offset[0];
+	n = 0;
+	ok = true;
+	return true;
+} // END open
+
+
+// --- Append the next leaf --- //
+template <class P>
+void MerkleIndexWriter<P>::addLeaf(const digest_t& leaf)
+{
+	size_t at = buf.size();
+	buf.resize(at + P::DIGEST_SIZE);
+	P::toBytes(leaf, &buf[at]);
+	++n;
+	if(buf.size() >= BUFFER_DIGESTS * P::DIGEST_SIZE)
+	{
+		flush();
+	}
+} // END addLeaf
+
+
+// --- Write out the buffer --- //
+template <class P>
+void MerkleIndexWriter<P>::flush()
+{
+	if(!buf.empty())
+	{
+		ok = ok && pwriteAll(fd, buf.data(), buf.size(), buf_offset);
+		buf_offset += buf.size();
+		buf.clear();
+	}
+} // END flush
+
+
+// --- Build the upper levels and the header --- //
+template <class P>
+bool MerkleIndexWriter<P>::finish(const merkle_log_id_t& log, digest_t& root)
+{
+	flush();
+	if(!ok || n == 0)
+	{
+		return false;
+	}
+	const size_t DS = P::DIGEST_SIZE;
+
+	// Build level l+1 from level l, reading level l back
+	// from the file in chunks of an even number of nodes
+	uint64_t level = 0;
+	std::vector<uint8_t> in_buf;
+	std::vector<digest_t> pairs, parents;
+	while( (n >> level) >= 2 )
+	{
+		uint64_t n_in = n >> level;
+		uint64_t n_out = n_in / 2;
+		header.level_offset[level+1] = header.level_offset[level] + n_in*DS;
+		buf_offset = header.level_offset[level+1];
+
+		for (uint64_t done=0; done<n_out; )
+		{
+			uint64_t m = std::min<uint64_t>(n_out - done, BUFFER_DIGESTS / 2);
+			in_buf.resize(2*m*DS);
+			if( !preadAll(fd, in_buf.data(), in_buf.size(), header.level_offset[level] + 2*done*DS) )
+			{
+				return false;
+			}
+			pairs.resize(2*m);
+			parents.resize(m);
+			for (uint64_t i=0; i<2*m; ++i)	{	P::fromBytes(&in_buf[i*DS], pairs[i]);	}
+			P::nodes(pairs.data(), m, parents.data());
+			MERKLE_STATS_ADD(node_hashes, m);
+			for (uint64_t i=0; i<m; ++i)
+			{
+				size_t at = buf.size();
+				buf.resize(at + DS);
+				P::toBytes(parents[i], &buf[at]);
+			}
+			flush();
+			done += m;
+		}
+		++level;
+	}
+	header.levels = level + 1;
+
+	// The forest roots are the last nodes of the levels
+	// whose bit is set in n. Merge them from right to left,
+	// storing the fold below each of them into the spine.
+	std::vector<uint8_t> spine(64*DS, 0);
+	bool first = true;
+	std::vector<uint8_t> node_buf(DS);
+	for (uint64_t h=0; h<header.levels; ++h)
+	{
+		if( !((n >> h) & 1) )
+		{
+			continue;
+		}
+		if( !preadAll(fd, node_buf.data(), DS, header.level_offset[h] + ((n >> h) - 1)*DS) )
+		{
+			return false;
+		}
+		digest_t r;
+		P::fromBytes(node_buf.data(), r);
+		if(first)
+		{
+			root = r;
+			first = false;
+		}
+		else
+		{
+			P::toBytes(root, &spine[h*DS]);
+			digest_t merged;
+			P::node(r, root, merged);
+			MERKLE_STATS_ADD(node_hashes, 1);
+			root = merged;
+		}
+	}
+
+	// Write the spine and the header
+	header.leaves = n;
+	header.log = log;
+	P::toBytes(root, header.root);
+	ok = ok && pwriteAll(fd, spine.data(), spine.size(), header.spine_offset);
+	ok = ok && pwriteAll(fd, &header, sizeof(header), 0);
+	ok = ok && (fsync(fd) == 0);
+	return ok;
+} // END finish
+
+
+
+// -------------------------------------- //
+// ----- MerkleIndex IMPLEMENTATION ----- //
+// -------------------------------------- //
+
+
+// --- Map the index file --- //
+template <class P>
+std::string MerkleIndex<P>::open(const std::string& index_file)
+{
+	int fd = ::open(index_file.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return "cannot open the index file " + index_file;
+	}
+	struct stat st;
+	if( fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(merkle_index_header_t) )
+	{
+		::close(fd);
+		return "the index file " + index_file + " is too short";
+	}
+	void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED)
+	{
+		return "cannot map the index file " + index_file;
+	}
+	map = p;
+	map_size = st.st_size;
+	header = static_cast<const merkle_index_header_t*>(map);
+
+	// Only the needed nodes are ever touched
+	madvise(map, map_size, MADV_RANDOM);
+
+	if( memcmp(header->magic, MERKLE_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != MERKLE_INDEX_VERSION )
+	{
+		return index_file + " is not a Merkle index file";
+	}
+	if( header->digest_size != P::DIGEST_SIZE || strncmp(header->policy, P::name(), sizeof(header->policy)) != 0 )
+	{
+		return index_file + " was built with another hash (" + std::string(header->policy, strnlen(header->policy, sizeof(header->policy))) + ")";
+	}
+	// The levels of n leaves are 0..floor(log2(n)), level l has
+	// n>>l nodes, all of which as well as the spine must be mapped
+	uint64_t levels = 0;
+	while( (header->leaves >> levels) != 0 )
+	{
+		++levels;
+	}
+	if( header->leaves == 0 || header->levels != levels )
+	{
+		return "the index file " + index_file + " is corrupted";
+	}
+	const uint64_t DS = P::DIGEST_SIZE;
+	bool fits = header->spine_offset <= map_size && (map_size - header->spine_offset) / DS >= 64;
+	for (uint64_t l=0; fits && l<levels; ++l)
+	{
+		fits = header->level_offset[l] <= map_size && (map_size - header->level_offset[l]) / DS >= (header->leaves >> l);
+	}
+	if( !fits )
+	{
+		return "the index file " + index_file + " is truncated";
+	}
+	return "";
+} // END open
+
+
+// --- Node index of the given level --- //
+template <class P>
+typename MerkleIndex<P>::digest_t MerkleIndex<P>::node(uint64_t level, uint64_t index) const
+{
+	digest_t d;
+	P::fromBytes( static_cast<const uint8_t*>(map) + header->level_offset[level] + index*P::DIGEST_SIZE, d );
+	return d;
+} // END node
+
+
+// --- Fold of the forest roots below the given height --- //
+template <class P>
+typename MerkleIndex<P>::digest_t MerkleIndex<P>::spine(uint64_t height) const
+{
+	digest_t d;
+	P::fromBytes( static_cast<const uint8_t*>(map) + header->spine_offset + height*P::DIGEST_SIZE, d );
+	return d;
+} // END spine
+
+
+// --- Hash chain of leaf number i --- //
+// The chain has the same format as MerkleHasher::getHashChain.
+template <class P>
+hash_chain_t MerkleIndex<P>::getHashChain(uint64_t i) const
+{
+	hash_chain_t chain;
+	const uint64_t n = header->leaves;
+	if(i >= n)
+	{
+		return chain;
+	}
+
+	// Inside the complete tree the siblings are the
+	// neighbouring nodes on each level
+	digest_t cur = node(0, i);
+	digest_t next;
+	uint64_t pos = i;
+	uint64_t level = 0;
+	while( (pos ^ 1) < (n >> level) )
+	{
+		digest_t sib = node(level, pos ^ 1);
+		if( pos & 1 )
+		{
+			chain.push_back( std::make_pair(1, P::toString(cur)) );
+			chain.push_back( std::make_pair(0, P::toString(sib)) );
+			P::node(sib, cur, next);
+		}
+		else
+		{
+			chain.push_back( std::make_pair(0, P::toString(cur)) );
+			chain.push_back( std::make_pair(1, P::toString(sib)) );
+			P::node(cur, sib, next);
+		}
+		cur = next;
+		pos >>= 1;
+		++level;
+	}
+
+	// cur is now the root of a complete tree of the forest.
+	// First it is merged with the fold of the smaller trees
+	// on its right, then with the larger trees on its left.
+	if( n & ((uint64_t(1) << level) - 1) )
+	{
+		digest_t acc = spine(level);
+		chain.push_back( std::make_pair(0, P::toString(cur)) );
+		chain.push_back( std::make_pair(1, P::toString(acc)) );
+		P::node(cur, acc, next);
+		cur = next;
+	}
+	for (uint64_t g=level+1; g<header->levels; ++g)
+	{
+		if( (n >> g) & 1 )
+		{
+			digest_t left = node(g, (n >> g) - 1);
+			chain.push_back( std::make_pair(1, P::toString(cur)) );
+			chain.push_back( std::make_pair(0, P::toString(left)) );
+			P::node(left, cur, next);
+			cur = next;
+		}
+	}
+	chain.push_back( std::make_pair(-1, P::toString(cur)) );
+	return chain;
+} // END getHashChain
+
+
+// --- Root of the tree of the first m leaves --- //
+// The forest of m is made of complete nodes of the whole tree,
+// which are folded as in MerkleIndexWriter::finish.
+template <class P>
+typename MerkleIndex<P>::digest_t MerkleIndex<P>::rootAt(uint64_t m) const
+{
+	if(m == header->leaves)
+	{
+		return root();
+	}
+	digest_t acc, next;
+	bool first = true;
+	for (uint64_t h=0; (m >> h) != 0; ++h)
+	{
+		if( !((m >> h) & 1) )
+		{
+			continue;
+		}
+		digest_t r = node(h, (m >> h) - 1);
+		if(first)
+		{
+			acc = r;
+			first = false;
+		}
+		else
+		{
+			P::node(r, acc, next);
+			acc = next;
+		}
+	}
+	return acc;
+} // END rootAt
+
+
+// --- Consistency proof of the tree of the first m leaves --- //
+template <class P>
+std::vector<typename MerkleIndex<P>::digest_t> MerkleIndex<P>::consistencyProof(uint64_t m) const
+{
+	std::vector<digest_t> proof;
+	if(m >= 1 && m < header->leaves)
+	{
+		subproof(m, 0, header->leaves, true, proof);
+	}
+	return proof;
+} // END consistencyProof
+
+
+// --- Multi-proof of the leaves --- //
+// The walk hashes the root up from the leaves of the index, taking
+// the missing nodes from the index and recording them as the proof.
+template <class P>
+bool MerkleIndex<P>::multiProof(const std::vector<uint64_t>& indices, std::vector<digest_t>& proof) const
+{
+	proof.clear();
+	std::vector<digest_t> leaves(indices.size());
+	for (size_t i=0; i<indices.size(); ++i)
+	{
+		if( indices[i] >= header->leaves )
+		{
+			return false;
+		}
+		leaves[i] = node(0, indices[i]);
+	}
+	digest_t r;
+	return walkMultiProof<P>(header->leaves, indices, leaves, [&](uint64_t level, uint64_t index, digest_t& out)
+		{
+			out = (index == MULTI_PROOF_SPINE) ? spine(level) : node(level, index);
+			proof.push_back(out);
+			return true;
+		}, r);
+} // END multiProof
+
+
+// --- The proof of the first m leaves of the subtree [begin, end) --- //
+template <class P>
+void MerkleIndex<P>::subproof(uint64_t m, uint64_t begin, uint64_t end, bool whole, std::vector<digest_t>& proof) const
+{
+	uint64_t len = end - begin;
+	if(m == len)
+	{
+		// The old tree is a node of the new one, known to the
+		// verifier unless it is the whole old tree
+		if(!whole)
+		{
+			proof.push_back( range(begin, end) );
+		}
+		return;
+	}
+
+	// k is the largest power of two below len
+	uint64_t k = 1;
+	while( 2*k < len )	{	k <<= 1;	}
+	if(m <= k)
+	{
+		subproof(m, begin, begin + k, whole, proof);
+		proof.push_back( range(begin + k, end) );
+	}
+	else
+	{
+		subproof(m - k, begin + k, end, false, proof);
+		proof.push_back( range(begin, begin + k) );
+	}
+} // END subproof
+
+
+// --- Root of the leaves [begin, end) of a node of a consistency proof --- //
+// The ranges of the proof are either complete nodes or reach the end of
+// the tree, in which case they are the forest trees below some height h
+// and their fold is in the spine of the next tree up.
+template <class P>
+typename MerkleIndex<P>::digest_t MerkleIndex<P>::range(uint64_t begin, uint64_t end) const
+{
+	uint64_t len = end - begin;
+	uint64_t h = 0;
+	while( (uint64_t(1) << h) < len )	{	++h;	}
+	if( (uint64_t(1) << h) == len )
+	{
+		return node(h, begin >> h);
+	}
+	if(begin == 0)
+	{
+		return root();
+	}
+	uint64_t g = h;
+	while( !((header->leaves >> g) & 1) )	{	++g;	}
+	return spine(g);
+} // END range
+
+
+#endif // MERKLE_INDEX_HPP
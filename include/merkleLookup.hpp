@@ -0,0 +1,607 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleLookup.hpp
+ *
+ *	Implements a persistent lookup table from the leaves of
+ *	a Merkle tree to their positions, so that a line can be
+ *	found in the log by its content without hashing the log:
+ *		a)	MerkleLookupWriter collects the leaves while the
+ *			tree is built, in sorted runs spilled to a
+ *			temporary file, and merges the runs into the
+ *			leaves sorted by digest. The hash table and the
+ *			Bloom filter over the distinct digests are then
+ *			built in the mapped lookup file.
+ *		b)	MerkleLookup memory-maps a lookup file. A leaf
+ *			is first checked against the Bloom filter, so
+ *			most absent lines cost a few bits of it only.
+ *			Otherwise the hash table gives the run of the
+ *			digest and the run its leaf positions, a few
+ *			pages whatever the size of the log.
+ *
+ *	File layout: header, positions, entries, Bloom filter, hash
+ *	table. The entries are the distinct digests in sorted
+ *	order, each with the index of its first position. The
+ *	positions (0-based leaf numbers) of a digest follow each
+ *	other in increasing order. A slot of the hash table is 0
+ *	when empty, else the entry number + 1; collisions are
+ *	resolved by linear probing, the table being at most half
+ *	full. The digests are uniform, so their bytes are used as
+ *	the hashes: the first two words for the Bloom filter and
+ *	the third one for the table.
+ *
+ *	The header records the hash policy, the size, modification
+ *	time and inode of the log file and the root, as in the index
+ *	(see merkleIndex.hpp).
+ *
+ *	The writer holds one run of RUN_RECORDS leaves in memory (about
+ *	44 MB with 32 byte digests) and, when merging, a small buffer
+ *	of each run, ~40 KB per million lines. The temporary file takes
+ *	P::DIGEST_SIZE + 8 bytes per line, and the table and the filter
+ *	are built in the page cache, from which they are written out.
+ */
+
+#ifndef MERKLE_LOOKUP_HPP
+#define MERKLE_LOOKUP_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "myHashInterface.hpp"
+#include "merkleIndex.hpp"
+
+
+// --- The lookup file header --- //
+struct merkle_lookup_header_t
+{
+	char magic[8];				// "MRKLLKP1"
+	uint32_t version;
+	uint32_t digest_size;
+	char policy[16];			// P::name()
+	uint64_t leaves;			// Number of leaves n
+	merkle_log_id_t log;		// The log file
+	uint64_t distinct;			// Number of distinct leaves
+	uint64_t slots;				// Size of the hash table, a power of two
+	uint64_t bloom_bits;		// Size of the Bloom filter, a power of two
+	uint64_t bloom_hashes;		// Number of bits set per leaf
+	uint64_t bloom_offset;		// File offsets of the parts
+	uint64_t slot_offset;
+	uint64_t entry_offset;
+	uint64_t position_offset;
+	uint8_t root[64];			// The root digest
+};
+
+static const char MERKLE_LOOKUP_MAGIC[8] = {'M','R','K','L','L','K','P','1'};
+static const uint32_t MERKLE_LOOKUP_VERSION = 2;
+
+// --- The i-th 64-bit word of a digest in bytes --- //
+inline uint64_t lookupWord(const uint8_t* digest, unsigned i)
+{
+	uint64_t w;
+	memcpy(&w, digest + 8*i, sizeof(w));
+	return w;
+}
+
+
+
+// ------------------------------------------ //
+// ----- MerkleLookupWriter DECLARATION ----- //
+// ------------------------------------------ //
+template <class P>
+class MerkleLookupWriter
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleLookupWriter() : fd(-1), run_fd(-1), n(0), ok(false) {}
+	~MerkleLookupWriter() { if(fd >= 0) { ::close(fd); } if(run_fd >= 0) { ::close(run_fd); } }
+
+	// --- Create the lookup file, returns false on error --- //
+	bool open(const std::string& lookup_file);
+
+	// --- Append the next leaf --- //
+	void addLeaf(const digest_t& leaf);
+
+	// --- Sort the leaves and write the file, returns false on error --- //
+	// An empty log gives no lookup file.
+	bool finish(const merkle_log_id_t& log, const digest_t& root);
+
+private:
+	MerkleLookupWriter(const MerkleLookupWriter&);
+	MerkleLookupWriter& operator=(const MerkleLookupWriter&);
+
+	// --- Sort the leaves in memory and write them out as a run --- //
+	void spill();
+
+	// --- Merge the runs into the positions and the entries --- //
+	// Returns the number of distinct digests, or 0 on error.
+	uint64_t merge(const merkle_lookup_header_t& header);
+
+	int fd;
+
+	// The temporary file of the sorted runs, unlinked once 
+	// opened, and the number of leaves in each run
+	int run_fd;
+	std::vector<uint64_t> runs;
+
+	// The number of leaves and whether all writes succeeded
+	uint64_t n;
+	bool ok;
+
+	// The leaves of the current run, each a digest and its 
+	// position back to back, and their order by digest
+	std::vector<uint8_t> records;
+	std::vector<uint32_t> order;
+
+	// Leaves per run and leaves read from a run at once
+	static const size_t RUN_RECORDS = 1 << 20;
+	static const size_t MERGE_RECORDS = 1 << 10;
+
+	// Bloom filter bits per distinct leaf and bits set per leaf
+	static const unsigned BLOOM_BITS_PER_LEAF = 10;
+	static const unsigned BLOOM_HASHES = 7;
+
+}; // END MERKLELOOKUPWRITER DECLARATION
+
+
+
+// ------------------------------------ //
+// ----- MerkleLookup DECLARATION ----- //
+// ------------------------------------ //
+template <class P>
+class MerkleLookup
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleLookup() : map(0), map_size(0), header(0) {}
+	~MerkleLookup() { if(map) { munmap(map, map_size); } }
+
+	// --- Map the lookup file, returns an error message or "" --- //
+	std::string open(const std::string& lookup_file);
+
+	// --- Basic information --- //
+	uint64_t leaves() const { return header->leaves; }
+	uint64_t distinct() const { return header->distinct; }
+	const merkle_log_id_t& log() const { return header->log; }
+
+	// --- Whether the lookup table is of the log file as it is now --- //
+	bool matchesLog(const std::string& log_file) const { return header->log == logFileId(log_file); }
+	digest_t root() const { digest_t d; P::fromBytes(header->root, d); return d; }
+
+	// --- Whether the leaf may be in the log, by the Bloom filter only --- //
+	bool mayContain(const digest_t& leaf) const;
+
+	// --- Positions (0-based, increasing) of the leaf, empty if absent --- //
+	std::vector<uint64_t> find(const digest_t& leaf) const;
+
+private:
+	MerkleLookup(const MerkleLookup&);
+	MerkleLookup& operator=(const MerkleLookup&);
+
+	// --- The parts of the file --- //
+	const uint8_t* part(uint64_t offset) const { return static_cast<const uint8_t*>(map) + offset; }
+	const uint8_t* entry(uint64_t e) const { return part(header->entry_offset) + e*(P::DIGEST_SIZE + 8); }
+
+	void* map;
+	size_t map_size;
+	const merkle_lookup_header_t* header;
+
+}; // END MERKLELOOKUP DECLARATION
+
+
+
+// --------------------------------------------- //
+// ----- MerkleLookupWriter IMPLEMENTATION ----- //
+// --------------------------------------------- //
+
+
+// --- Create the lookup file --- //
+template <class P>
+bool MerkleLookupWriter<P>::open(const std::string& lookup_file)
+{
+	// The hashes need three words of the digest
+	if(P::DIGEST_SIZE < 24 || P::DIGEST_SIZE > 64)
+	{
+		return false;
+	}
+	fd = ::open(lookup_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	std::string run_file = lookup_file + ".runs";
+	run_fd = ::open(run_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(run_fd >= 0)
+	{
+		unlink(run_file.c_str());
+	}
+	n = 0;
+	runs.clear();
+	records.clear();
+	ok = fd >= 0 && run_fd >= 0;
+	return ok;
+} // END open
+
+
+// --- Append the next leaf --- //
+template <class P>
+void MerkleLookupWriter<P>::addLeaf(const digest_t& leaf)
+{
+	const size_t RS = P::DIGEST_SIZE + 8;
+	size_t at = records.size();
+	records.resize(at + RS);
+	P::toBytes(leaf, &records[at]);
+	memcpy(&records[at + P::DIGEST_SIZE], &n, 8);
+	++n;
+	if( records.size() == RUN_RECORDS*RS )
+	{
+		spill();
+	}
+} // END addLeaf
+
+
+// --- Sort the leaves in memory and write them out as a run --- //
+// The leaves of a run are in increasing position, thus the stable
+// sort orders equal digests by position.
+template <class P>
+void MerkleLookupWriter<P>::spill()
+{
+	const size_t DS = P::DIGEST_SIZE;
+	const size_t RS = DS + 8;
+	const size_t count = records.size() / RS;
+	if( count == 0 )
+	{
+		return;
+	}
+	order.resize(count);
+	for (size_t i=0; i<count; ++i)	{	order[i] = i;	}
+	const uint8_t* r = records.data();
+	std::stable_sort(order.begin(), order.end(), [r, DS, RS](uint32_t a, uint32_t b)
+		{
+			return memcmp(r + a*RS, r + b*RS, DS) < 0;
+		});
+
+	// Written in the sorted order through a small buffer
+	uint64_t offset = 0;
+	for (size_t k=0; k<runs.size(); ++k)	{	offset += runs[k]*RS;	}
+	std::vector<uint8_t> out;
+	out.reserve(MERGE_RECORDS*RS);
+	for (size_t i=0; i<count; ++i)
+	{
+		out.insert(out.end(), r + order[i]*RS, r + (order[i] + 1)*RS);
+		if( out.size() == MERGE_RECORDS*RS || i + 1 == count )
+		{
+			ok = ok && pwriteAll(run_fd, out.data(), out.size(), offset);
+			offset += out.size();
+			out.clear();
+		}
+	}
+	runs.push_back(count);
+	records.clear();
+} // END spill
+
+
+// --- Merge the runs into the positions and the entries --- //
+template <class P>
+uint64_t MerkleLookupWriter<P>::merge(const merkle_lookup_header_t& header)
+{
+	const size_t DS = P::DIGEST_SIZE;
+	const size_t RS = DS + 8;
+
+	// A cursor into each run: its next file offset, the
+	// leaves left to read and the buffered ones
+	struct cursor_t
+	{
+		uint64_t offset;
+		uint64_t left;
+		std::vector<uint8_t> buf;
+		size_t at;
+	};
+	std::vector<cursor_t> cursors(runs.size());
+	uint64_t offset = 0;
+	for (size_t k=0; k<runs.size(); ++k)
+	{
+		cursors[k].offset = offset;
+		cursors[k].left = runs[k];
+		cursors[k].at = 0;
+		offset += runs[k]*RS;
+	}
+	auto refill = [&](cursor_t& c)
+		{
+			size_t m = std::min<uint64_t>(c.left, MERGE_RECORDS);
+			c.buf.resize(m*RS);
+			c.at = 0;
+			if( !preadAll(run_fd, c.buf.data(), c.buf.size(), c.offset) )
+			{
+				ok = false;
+				c.buf.clear();
+			}
+			c.offset += m*RS;
+			c.left -= m;
+			return !c.buf.empty();
+		};
+
+	// The heap of the runs by their next leaf, smallest first;
+	// runs are in the order of the log, thus equal digests
+	// are taken by the run number
+	auto later = [&](size_t a, size_t b)
+		{
+			int c = memcmp(&cursors[a].buf[cursors[a].at], &cursors[b].buf[cursors[b].at], DS);
+			return c > 0 || (c == 0 && a > b);
+		};
+	std::vector<size_t> heap;
+	for (size_t k=0; k<cursors.size(); ++k)
+	{
+		if( refill(cursors[k]) )	{	heap.push_back(k);	}
+	}
+	std::make_heap(heap.begin(), heap.end(), later);
+
+	// Stream out the positions in the order of the digests,
+	// and an entry wherever the digest changes
+	std::vector<uint8_t> positions, entries;
+	uint8_t last[64];
+	uint64_t i = 0, distinct = 0;
+	uint64_t position_at = header.position_offset, entry_at = header.entry_offset;
+	while( !heap.empty() && ok )
+	{
+		std::pop_heap(heap.begin(), heap.end(), later);
+		cursor_t& c = cursors[heap.back()];
+		const uint8_t* record = &c.buf[c.at];
+		if( i == 0 || memcmp(last, record, DS) != 0 )
+		{
+			memcpy(last, record, DS);
+			entries.insert(entries.end(), record, record + DS);
+			entries.insert(entries.end(), reinterpret_cast<const uint8_t*>(&i), reinterpret_cast<const uint8_t*>(&i) + 8);
+			++distinct;
+		}
+		positions.insert(positions.end(), record + DS, record + RS);
+		++i;
+
+		c.at += RS;
+		if( c.at < c.buf.size() || (c.left > 0 && refill(c)) )
+		{
+			std::push_heap(heap.begin(), heap.end(), later);
+		}
+		else
+		{
+			heap.pop_back();
+		}
+		if( positions.size() >= MERGE_RECORDS*8 || heap.empty() )
+		{
+			ok = ok && pwriteAll(fd, positions.data(), positions.size(), position_at);
+			position_at += positions.size();
+			positions.clear();
+		}
+		if( entries.size() >= MERGE_RECORDS*RS || heap.empty() )
+		{
+			ok = ok && pwriteAll(fd, entries.data(), entries.size(), entry_at);
+			entry_at += entries.size();
+			entries.clear();
+		}
+	}
+	return (ok && i == n) ? distinct : 0;
+} // END merge
+
+
+// --- Sort the leaves and write the file --- //
+template <class P>
+bool MerkleLookupWriter<P>::finish(const merkle_log_id_t& log, const digest_t& root)
+{
+	const size_t DS = P::DIGEST_SIZE;
+	if(fd < 0 || n == 0)
+	{
+		return false;
+	}
+	spill();
+	records.shrink_to_fit();
+	order.clear();
+	order.shrink_to_fit();
+
+	merkle_lookup_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MERKLE_LOOKUP_MAGIC, sizeof(header.magic));
+	header.version = MERKLE_LOOKUP_VERSION;
+	header.digest_size = DS;
+	strncpy(header.policy, P::name(), sizeof(header.policy) - 1);
+	header.leaves = n;
+	header.log = log;
+	header.position_offset = sizeof(header);
+	header.entry_offset = header.position_offset + n*8;
+	header.distinct = merge(header);
+	::close(run_fd);
+	run_fd = -1;
+	if( header.distinct == 0 )
+	{
+		return false;
+	}
+	const uint64_t distinct = header.distinct;
+	header.slots = 2;
+	while(header.slots < 2*distinct)	{	header.slots <<= 1;	}
+	header.bloom_bits = 64;
+	while(header.bloom_bits < BLOOM_BITS_PER_LEAF*distinct)	{	header.bloom_bits <<= 1;	}
+	header.bloom_hashes = BLOOM_HASHES;
+	header.bloom_offset = header.entry_offset + distinct*(DS + 8);
+	header.slot_offset = header.bloom_offset + header.bloom_bits/8;
+	P::toBytes(root, header.root);
+
+	// The Bloom filter and the hash table are built in place,
+	// in the zeroed end of the mapped file
+	const uint64_t file_size = header.slot_offset + header.slots*8;
+	if( ftruncate(fd, file_size) != 0 )
+	{
+		return false;
+	}
+	void* p = mmap(0, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( p == MAP_FAILED )
+	{
+		return false;
+	}
+	uint8_t* m = static_cast<uint8_t*>(p);
+	uint8_t* bloom = m + header.bloom_offset;
+	uint8_t* slots = m + header.slot_offset;
+	madvise(m + header.entry_offset, distinct*(DS + 8), MADV_SEQUENTIAL);
+	for (uint64_t e=0; e<distinct; ++e)
+	{
+		const uint8_t* digest = m + header.entry_offset + e*(DS + 8);
+		uint64_t h1 = lookupWord(digest, 0);
+		uint64_t h2 = lookupWord(digest, 1) | 1;
+		for (uint64_t k=0; k<header.bloom_hashes; ++k)
+		{
+			uint64_t bit = (h1 + k*h2) & (header.bloom_bits - 1);
+			bloom[bit >> 3] |= uint8_t(1) << (bit & 7);
+		}
+		uint64_t s = lookupWord(digest, 2) & (header.slots - 1);
+		uint64_t slot;
+		while( memcpy(&slot, slots + s*8, 8), slot != 0 )	{	s = (s + 1) & (header.slots - 1);	}
+		slot = e + 1;
+		memcpy(slots + s*8, &slot, 8);
+	}
+	ok = ok && (msync(p, file_size, MS_SYNC) == 0);
+	munmap(p, file_size);
+
+	ok = ok && pwriteAll(fd, &header, sizeof(header), 0);
+	ok = ok && (fsync(fd) == 0);
+	return ok;
+} // END finish
+
+
+
+// --------------------------------------- //
+// ----- MerkleLookup IMPLEMENTATION ----- //
+// --------------------------------------- //
+
+
+// --- Map the lookup file --- //
+template <class P>
+std::string MerkleLookup<P>::open(const std::string& lookup_file)
+{
+	int fd = ::open(lookup_file.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return "cannot open the lookup file " + lookup_file;
+	}
+	struct stat st;
+	if( fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(merkle_lookup_header_t) )
+	{
+		::close(fd);
+		return "the lookup file " + lookup_file + " is too short";
+	}
+	void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED)
+	{
+		return "cannot map the lookup file " + lookup_file;
+	}
+	map = p;
+	map_size = st.st_size;
+	header = static_cast<const merkle_lookup_header_t*>(map);
+
+	// Only the needed pages are ever touched
+	madvise(map, map_size, MADV_RANDOM);
+
+	if( memcmp(header->magic, MERKLE_LOOKUP_MAGIC, sizeof(header->magic)) != 0 || header->version != MERKLE_LOOKUP_VERSION )
+	{
+		return lookup_file + " is not a Merkle lookup file";
+	}
+	if( header->digest_size != P::DIGEST_SIZE || strncmp(header->policy, P::name(), sizeof(header->policy)) != 0 )
+	{
+		return lookup_file + " was built with another hash (" + std::string(header->policy, strnlen(header->policy, sizeof(header->policy))) + ")";
+	}
+	if( header->leaves == 0 || header->distinct == 0 || header->distinct > header->leaves || 
+		header->slots < 2*header->distinct || (header->slots & (header->slots - 1)) != 0 ||
+		header->bloom_bits < 64 || (header->bloom_bits & (header->bloom_bits - 1)) != 0 )
+	{
+		return "the lookup file " + lookup_file + " is corrupted";
+	}
+
+	// Every part must be within the file
+	auto fits = [this](uint64_t offset, uint64_t count, uint64_t size)
+		{
+			return offset <= map_size && (map_size - offset) / size >= count;
+		};
+	if( !fits(header->position_offset, header->leaves, 8) || !fits(header->entry_offset, header->distinct, P::DIGEST_SIZE + 8) ||
+		!fits(header->bloom_offset, header->bloom_bits/8, 1) || !fits(header->slot_offset, header->slots, 8) )
+	{
+		return "the lookup file " + lookup_file + " is truncated";
+	}
+	return "";
+} // END open
+
+
+// --- Whether the leaf may be in the log --- //
+template <class P>
+bool MerkleLookup<P>::mayContain(const digest_t& leaf) const
+{
+	uint8_t digest[64];
+	P::toBytes(leaf, digest);
+	uint64_t h1 = lookupWord(digest, 0);
+	uint64_t h2 = lookupWord(digest, 1) | 1;
+	const uint8_t* bloom = part(header->bloom_offset);
+	for (uint64_t k=0; k<header->bloom_hashes; ++k)
+	{
+		uint64_t bit = (h1 + k*h2) & (header->bloom_bits - 1);
+		if( !(bloom[bit >> 3] & (uint8_t(1) << (bit & 7))) )
+		{
+			return false;
+		}
+	}
+	return true;
+} // END mayContain
+
+
+// --- Positions of the leaf --- //
+template <class P>
+std::vector<uint64_t> MerkleLookup<P>::find(const digest_t& leaf) const
+{
+	std::vector<uint64_t> positions;
+	if( !mayContain(leaf) )
+	{
+		return positions;
+	}
+	uint8_t digest[64];
+	P::toBytes(leaf, digest);
+
+	// Probe the table until the digest or an empty slot
+	const uint64_t mask = header->slots - 1;
+	uint64_t s = lookupWord(digest, 2) & mask;
+	for (uint64_t probes=0; probes<header->slots; ++probes)
+	{
+		uint64_t slot;
+		memcpy(&slot, part(header->slot_offset) + s*8, 8);
+		if(slot == 0)
+		{
+			break;
+		}
+		uint64_t e = slot - 1;
+		if( e < header->distinct && memcmp(entry(e), digest, P::DIGEST_SIZE) == 0 )
+		{
+			// The run ends where the next entry starts
+			uint64_t begin, end = header->leaves;
+			memcpy(&begin, entry(e) + P::DIGEST_SIZE, 8);
+			if( e + 1 < header->distinct )
+			{
+				memcpy(&end, entry(e + 1) + P::DIGEST_SIZE, 8);
+			}
+			for (uint64_t i=begin; i<end && i<header->leaves; ++i)
+			{
+				uint64_t pos;
+				memcpy(&pos, part(header->position_offset) + i*8, 8);
+				positions.push_back(pos);
+			}
+			break;
+		}
+		s = (s + 1) & mask;
+	}
+	return positions;
+} // END find
+
+
+#endif // MERKLE_LOOKUP_HPP
@@ -0,0 +1,151 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleMultiProof.hpp
+ *
+ *	Implements the walk of a multi-proof: the proof of many
+ *	leaves of one tree at once, which holds every node that
+ *	the separate hash chains of the leaves would need only
+ *	once, and none that can be hashed up from the leaves:
+ *		a)	The leaves are hashed up level by level. On
+ *			each level two known neighbours are merged
+ *			into their parent, a lone known node takes
+ *			its sibling from the proof, and a known node
+ *			without a sibling is the root of a tree of
+ *			the forest.
+ *		b)	The forest is then folded from the lowest
+ *			tree up, as in MerkleForest. The trees below
+ *			the first known one come from the proof as
+ *			a single node, their fold, and every unknown
+ *			tree above it as its root.
+ *
+ *	The proof is thus at most ~2*log2(n) nodes for a range of
+ *	leaves and k + log2(n) for k scattered ones, against the
+ *	~k*log2(n) of separate chains. The generator (MerkleIndex::
+ *	multiProof) and the verifier (MerkleHasher::verifyMultiProof)
+ *	both run this walk, so they agree on the order of the nodes.
+ */
+
+#ifndef MERKLE_MULTI_PROOF_HPP
+#define MERKLE_MULTI_PROOF_HPP
+
+#include <vector>
+#include <cstdint>
+
+#include "myHashInterface.hpp"
+#include "merkleStats.hpp"
+
+
+// --- The index of the node that is the fold of the trees below a level --- //
+static const uint64_t MULTI_PROOF_SPINE = UINT64_MAX;
+
+// --- Hash up the root of n leaves from some of them and the proof --- //
+// indices are the positions of the leaves (0-based, increasing, < n).
+// The missing nodes are asked from next(level, index, node) in the order
+// of the proof: index is that of a complete node on the level, or
+// MULTI_PROOF_SPINE for the fold of the forest trees below the level.
+// next returns false when the proof has no more nodes, and so does the walk.
+template <class P, class F>
+bool walkMultiProof(uint64_t n, const std::vector<uint64_t>& indices, const std::vector<typename P::digest_t>& leaves,
+	F next, typename P::digest_t& root)
+{
+	typedef typename P::digest_t digest_t;
+	if(indices.empty() || indices.size() != leaves.size() || indices.back() >= n)
+	{
+		return false;
+	}
+
+	// The known nodes of the current level, by increasing index
+	std::vector< std::pair<uint64_t, digest_t> > cur, up;
+	for (size_t i=0; i<indices.size(); ++i)
+	{
+		if( i > 0 && indices[i] <= indices[i-1] )
+		{
+			return false;
+		}
+		cur.push_back( std::make_pair(indices[i], leaves[i]) );
+	}
+
+	// The known roots of the forest trees
+	digest_t trees[64];
+	bool known[64] = {false};
+	digest_t sib, parent;
+	for (uint64_t level=0; !cur.empty(); ++level)
+	{
+		const uint64_t width = n >> level;
+		up.clear();
+		for (size_t i=0; i<cur.size(); )
+		{
+			uint64_t pos = cur[i].first;
+			if( (pos ^ 1) >= width )
+			{
+				trees[level] = cur[i].second;
+				known[level] = true;
+				++i;
+				continue;
+			}
+			if( !(pos & 1) && i + 1 < cur.size() && cur[i+1].first == pos + 1 )
+			{
+				P::node(cur[i].second, cur[i+1].second, parent);
+				i += 2;
+			}
+			else
+			{
+				if( !next(level, pos ^ 1, sib) )
+				{
+					return false;
+				}
+				if(pos & 1)	{	P::node(sib, cur[i].second, parent);	}
+				else		{	P::node(cur[i].second, sib, parent);	}
+				++i;
+			}
+			MERKLE_STATS_ADD(node_hashes, 1);
+			up.push_back( std::make_pair(pos >> 1, parent) );
+		}
+		cur.swap(up);
+	}
+
+	// Fold the forest from the lowest tree up
+	bool have = false;
+	for (uint64_t g=0; g<64 && (n >> g) != 0; ++g)
+	{
+		if( !((n >> g) & 1) )
+		{
+			continue;
+		}
+		digest_t tree = trees[g];
+		if( !known[g] )
+		{
+			if( !have )
+			{
+				continue;
+			}
+			if( !next(g, (n >> g) - 1, tree) )
+			{
+				return false;
+			}
+		}
+		if( !have && (n & ((uint64_t(1) << g) - 1)) )
+		{
+			if( !next(g, MULTI_PROOF_SPINE, root) )
+			{
+				return false;
+			}
+			have = true;
+		}
+		if( have )
+		{
+			P::node(tree, root, parent);
+			MERKLE_STATS_ADD(node_hashes, 1);
+			root = parent;
+		}
+		else
+		{
+			root = tree;
+			have = true;
+		}
+	}
+	return have;
+} // END walkMultiProof
+
+
+#endif // MERKLE_MULTI_PROOF_HPP
@@ -0,0 +1,408 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleProofs.hpp
+ *
+ *	Implements a binary container of many hash chains (proofs),
+ *	which replaces the text files of one chain each:
+ *		a)	MerkleProofsWriter appends the proofs through a
+ *			large buffer with sequential writes and puts the
+ *			offset table and the header in place at the end.
+ *		b)	MerkleProofs memory-maps a container and reads
+ *			any proof through the offset table.
+ *
+ *	A proof only holds the leaf and the sibling digests, with
+ *	one direction bit per step, as the intermediate nodes of
+ *	a hash chain follow from these. MerkleProofs::getHashChain
+ *	rebuilds the text chain of MerkleHasher::getHashChain.
+ *
+ *	File layout: header, proofs, offset table (one uint64_t
+ *	per proof). A proof is a merkle_proof_record_t followed
+ *	by the leaf and depth sibling digests. Bit s of directions
+ *	is set if the node at step s is the right child, i.e. the
+ *	sibling is on the left. The id of a proof is chosen by the
+ *	writer (the line number for the hasher).
+ *	Only policies with fixed size digests can be stored.
+ */
+
+#ifndef MERKLE_PROOFS_HPP
+#define MERKLE_PROOFS_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "myHashInterface.hpp"
+#include "merkleIndex.hpp"
+
+
+// --- The container file header --- //
+struct merkle_proofs_header_t
+{
+	char magic[8];				// "MRKLPRF1"
+	uint32_t version;
+	uint32_t digest_size;
+	char policy[16];			// P::name()
+	uint64_t count;				// Number of proofs
+	uint64_t table_offset;		// File offset of the offset table
+	uint8_t root[64];			// The root digest
+};
+
+// --- The start of every proof --- //
+struct merkle_proof_record_t
+{
+	uint64_t id;
+	uint32_t depth;				// Number of siblings
+	uint32_t reserved;
+	uint64_t directions;		// Bit s: the node at step s is a right child
+};
+
+static const char MERKLE_PROOFS_MAGIC[8] = {'M','R','K','L','P','R','F','1'};
+static const uint32_t MERKLE_PROOFS_VERSION = 1;
+
+// --- Whether the file is a proof container --- //
+inline bool isMerkleProofsFile(const std::string& file)
+{
+	char magic[8];
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+	bool ok = preadAll(fd, magic, sizeof(magic), 0) && memcmp(magic, MERKLE_PROOFS_MAGIC, sizeof(magic)) == 0;
+	::close(fd);
+	return ok;
+}
+
+
+
+// ------------------------------------------ //
+// ----- MerkleProofsWriter DECLARATION ----- //
+// ------------------------------------------ //
+template <class P>
+class MerkleProofsWriter
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleProofsWriter() : fd(-1), ok(false) {}
+	~MerkleProofsWriter() { if(fd >= 0) { ::close(fd); } }
+
+	// --- Create the container file, returns false on error --- //
+	bool open(const std::string& proofs_file);
+
+	// --- Append the proof of a hash chain --- //
+	// Returns false if the chain is malformed or too long.
+	bool add(uint64_t id, const hash_chain_t& chain);
+
+	// --- Write the offset table and the header, returns false on error --- //
+	bool finish(const digest_t& root);
+
+private:
+	MerkleProofsWriter(const MerkleProofsWriter&);
+	MerkleProofsWriter& operator=(const MerkleProofsWriter&);
+
+	// --- Write out the buffer --- //
+	void flush();
+
+	int fd;
+	bool ok;
+	merkle_proofs_header_t header;
+	std::vector<uint64_t> offsets;
+
+	// The write buffer and the file offset where it goes
+	std::vector<uint8_t> buf;
+	uint64_t buf_offset;
+
+	static const size_t BUFFER_SIZE = 1 << 20;
+
+}; // END MERKLEPROOFSWRITER DECLARATION
+
+
+
+// ------------------------------------ //
+// ----- MerkleProofs DECLARATION ----- //
+// ------------------------------------ //
+template <class P>
+class MerkleProofs
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleProofs() : map(0), map_size(0), header(0) {}
+	~MerkleProofs() { if(map) { munmap(map, map_size); } }
+
+	// --- Map the container file, returns an error message or "" --- //
+	std::string open(const std::string& proofs_file);
+
+	// --- Basic information --- //
+	uint64_t count() const { return header->count; }
+	digest_t root() const { digest_t d; P::fromBytes(header->root, d); return d; }
+
+	// --- Whether proof k lies within the file --- //
+	bool valid(uint64_t k) const;
+
+	// --- The parts of proof k (a valid one) --- //
+	uint64_t id(uint64_t k) const { return record(k).id; }
+	size_t depth(uint64_t k) const { return record(k).depth; }
+	bool right(uint64_t k, size_t s) const { return (record(k).directions >> s) & 1; }
+	void leaf(uint64_t k, digest_t& d) const { P::fromBytes(digests(k), d); }
+	void sibling(uint64_t k, size_t s, digest_t& d) const { P::fromBytes(digests(k) + (s + 1)*P::DIGEST_SIZE, d); }
+
+	// --- Hash chain of proof k, empty if it is not valid --- //
+	// The chain has the same format as MerkleHasher::getHashChain.
+	hash_chain_t getHashChain(uint64_t k) const;
+
+private:
+	MerkleProofs(const MerkleProofs&);
+	MerkleProofs& operator=(const MerkleProofs&);
+
+	// --- The record of proof k and the digests after it --- //
+	uint64_t offset(uint64_t k) const;
+	merkle_proof_record_t record(uint64_t k) const;
+	const uint8_t* digests(uint64_t k) const { return static_cast<const uint8_t*>(map) + offset(k) + sizeof(merkle_proof_record_t); }
+
+	void* map;
+	size_t map_size;
+	const merkle_proofs_header_t* header;
+
+}; // END MERKLEPROOFS DECLARATION
+
+
+
+// --------------------------------------------- //
+// ----- MerkleProofsWriter IMPLEMENTATION ----- //
+// --------------------------------------------- //
+
+
+// --- Create the container file --- //
+template <class P>
+bool MerkleProofsWriter<P>::open(const std::string& proofs_file)
+{
+	if(P::DIGEST_SIZE == 0 || P::DIGEST_SIZE > sizeof(header.root))
+	{
+		return false;
+	}
+	fd = ::open(proofs_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MERKLE_PROOFS_MAGIC, sizeof(header.magic));
+	header.version = MERKLE_PROOFS_VERSION;
+	header.digest_size = P::DIGEST_SIZE;
+	strncpy(header.policy, P::name(), sizeof(header.policy) - 1);
+
+	offsets.clear();
+	buf.reserve(BUFFER_SIZE);
+	buf_offset = sizeof(header);
+	ok = true;
+	return true;
+} // END open
+
+
+// --- Append the proof of a hash chain --- //
+// The chain alternates the node and its sibling, with the
+// position of each, and ends with the root (see getHashChain).
+template <class P>
+bool MerkleProofsWriter<P>::add(uint64_t id, const hash_chain_t& chain)
+{
+	if( chain.size() % 2 == 0 || chain.size()/2 > 64 )
+	{
+		return false;
+	}
+	merkle_proof_record_t rec;
+	rec.id = id;
+	rec.depth = chain.size()/2;
+	rec.reserved = 0;
+	rec.directions = 0;
+
+	size_t at = buf.size();
+	buf.resize(at + sizeof(rec) + (rec.depth + 1)*P::DIGEST_SIZE);
+	uint8_t* out = &buf[at] + sizeof(rec);
+	digest_t d;
+	for (size_t s=0; s<=rec.depth; ++s)
+	{
+		// The leaf, then the siblings at the odd entries
+		const std::string& hex = chain[s ? 2*s - 1 : 0].second;
+		if( !P::fromString(hex, d) || (s < rec.depth && chain[2*s].first != 0 && chain[2*s].first != 1) )
+		{
+			buf.resize(at);
+			return false;
+		}
+		if( s < rec.depth && chain[2*s].first == 1 )
+		{
+			rec.directions |= uint64_t(1) << s;
+		}
+		P::toBytes(d, out + s*P::DIGEST_SIZE);
+	}
+	memcpy(&buf[at], &rec, sizeof(rec));
+	offsets.push_back(buf_offset + at);
+
+	if(buf.size() >= BUFFER_SIZE)
+	{
+		flush();
+	}
+	return true;
+} // END add
+
+
+// --- Write out the buffer --- //
+template <class P>
+void MerkleProofsWriter<P>::flush()
+{
+	if(!buf.empty())
+	{
+		ok = ok && pwriteAll(fd, buf.data(), buf.size(), buf_offset);
+		buf_offset += buf.size();
+		buf.clear();
+	}
+} // END flush
+
+
+// --- Write the offset table and the header --- //
+template <class P>
+bool MerkleProofsWriter<P>::finish(const digest_t& root)
+{
+	flush();
+	header.count = offsets.size();
+	header.table_offset = buf_offset;
+	P::toBytes(root, header.root);
+	ok = ok && pwriteAll(fd, offsets.data(), offsets.size()*sizeof(uint64_t), header.table_offset);
+	ok = ok && pwriteAll(fd, &header, sizeof(header), 0);
+	return ok;
+} // END finish
+
+
+
+// --------------------------------------- //
+// ----- MerkleProofs IMPLEMENTATION ----- //
+// --------------------------------------- //
+
+
+// --- Map the container file --- //
+template <class P>
+std::string MerkleProofs<P>::open(const std::string& proofs_file)
+{
+	int fd = ::open(proofs_file.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		return "cannot open the proof file " + proofs_file;
+	}
+	struct stat st;
+	if( fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(merkle_proofs_header_t) )
+	{
+		::close(fd);
+		return "the proof file " + proofs_file + " is too short";
+	}
+	void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED)
+	{
+		return "cannot map the proof file " + proofs_file;
+	}
+	map = p;
+	map_size = st.st_size;
+	header = static_cast<const merkle_proofs_header_t*>(map);
+
+	if( memcmp(header->magic, MERKLE_PROOFS_MAGIC, sizeof(header->magic)) != 0 || header->version != MERKLE_PROOFS_VERSION )
+	{
+		return proofs_file + " is not a Merkle proof file";
+	}
+	if( header->digest_size != P::DIGEST_SIZE || strncmp(header->policy, P::name(), sizeof(header->policy)) != 0 )
+	{
+		return proofs_file + " was made with another hash (" + std::string(header->policy, strnlen(header->policy, sizeof(header->policy))) + ")";
+	}
+	if( header->table_offset > map_size || header->count > (map_size - header->table_offset) / sizeof(uint64_t) )
+	{
+		return "the proof file " + proofs_file + " is truncated";
+	}
+	return "";
+} // END open
+
+
+// --- The offset of proof k --- //
+template <class P>
+uint64_t MerkleProofs<P>::offset(uint64_t k) const
+{
+	uint64_t off;
+	memcpy(&off, static_cast<const uint8_t*>(map) + header->table_offset + k*sizeof(uint64_t), sizeof(off));
+	return off;
+} // END offset
+
+
+// --- The record of proof k --- //
+template <class P>
+merkle_proof_record_t MerkleProofs<P>::record(uint64_t k) const
+{
+	merkle_proof_record_t rec;
+	memcpy(&rec, static_cast<const uint8_t*>(map) + offset(k), sizeof(rec));
+	return rec;
+} // END record
+
+
+// --- Whether proof k lies within the file --- //
+template <class P>
+bool MerkleProofs<P>::valid(uint64_t k) const
+{
+	if( k >= header->count )
+	{
+		return false;
+	}
+	uint64_t off = offset(k);
+	if( off < sizeof(merkle_proofs_header_t) || off > header->table_offset ||
+		header->table_offset - off < sizeof(merkle_proof_record_t) )
+	{
+		return false;
+	}
+	merkle_proof_record_t rec = record(k);
+	return rec.depth <= 64 &&
+		(rec.depth + 1)*P::DIGEST_SIZE <= header->table_offset - off - sizeof(merkle_proof_record_t);
+} // END valid
+
+
+// --- Hash chain of proof k --- //
+template <class P>
+hash_chain_t MerkleProofs<P>::getHashChain(uint64_t k) const
+{
+	hash_chain_t chain;
+	if( !valid(k) )
+	{
+		return chain;
+	}
+	digest_t cur, sib, next;
+	leaf(k, cur);
+	for (size_t s=0; s<depth(k); ++s)
+	{
+		sibling(k, s, sib);
+		if( right(k, s) )
+		{
+			chain.push_back( std::make_pair(1, P::toString(cur)) );
+			chain.push_back( std::make_pair(0, P::toString(sib)) );
+			P::node(sib, cur, next);
+		}
+		else
+		{
+			chain.push_back( std::make_pair(0, P::toString(cur)) );
+			chain.push_back( std::make_pair(1, P::toString(sib)) );
+			P::node(cur, sib, next);
+		}
+		cur = next;
+	}
+	chain.push_back( std::make_pair(-1, P::toString(cur)) );
+	return chain;
+} // END getHashChain
+
+
+#endif // MERKLE_PROOFS_HPP
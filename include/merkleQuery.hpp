@@ -0,0 +1,547 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleQuery.hpp
+ *
+ *	Implements the class template MerkleQuery, which answers
+ *	hash chain requests on a log file for as long as it lives
+ *	(see --serve of the hasher). Instead of hashing the whole
+ *	log for every chain, as MerkleHasher::getHashChain does:
+ *		a)	The log is memory-mapped and the byte offset of
+ *			every 2^BASE_HEIGHT-th line is noted once, so any
+ *			run of lines can be hashed on its own.
+ *		b)	The nodes of height BASE_HEIGHT and above, i.e.
+ *			the roots of complete subtrees, are kept in an LRU
+ *			cache of a given memory budget. A missing node is
+ *			built from its children, down to the subtrees of
+ *			2^BASE_HEIGHT lines, which are hashed from the log.
+ *		c)	The levels below BASE_HEIGHT of a chain come from
+ *			hashing the 2^BASE_HEIGHT lines around the leaf.
+ *
+ *	Thus the first chain of a region costs about a pass over
+ *	the log, but repeated and nearby requests only hash the
+ *	lines next to their leaves, as the siblings far from the
+ *	leaf are shared and stay in the cache.
+ *
+ *	The tree and the chains are those of MerkleHasher and
+ *	MerkleIndex (level l has the n>>l complete nodes of height
+ *	l, the forest trees being the last nodes of the levels
+ *	whose bit is set in n). If lines are appended to the log
+ *	file, the new part is mapped and scanned and the cache kept,
+ *	as the complete subtrees of the old lines stay the same. If
+ *	the log changes otherwise (it shrinks, is replaced, its last
+ *	line had no newline or the end of the scanned part differs),
+ *	the cache is emptied and the log is mapped again. A rewrite
+ *	of the scanned part before its last TAIL_SIZE bytes that
+ *	keeps the size and the inode is not noticed.
+ */
+
+#ifndef MERKLE_QUERY_HPP
+#define MERKLE_QUERY_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "myHashInterface.hpp"
+#include "merkleStats.hpp"
+
+
+// ----------------------------------- //
+// ----- MerkleQuery DECLARATION ----- //
+// ----------------------------------- //
+template <class P>
+class MerkleQuery
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	// --- The counters of the cache --- //
+	// The hits and misses are those of the nodes of height
+	// BASE_HEIGHT and above, which are the cached ones.
+	struct cache_stats_t
+	{
+		uint64_t chains;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t lines_hashed;
+		uint64_t reloads;
+		uint64_t appends;
+	};
+
+	// --- The cache holds at most about cache_bytes of nodes --- //
+	MerkleQuery(size_t cache_bytes);
+	~MerkleQuery();
+
+	// --- Open the log file, returns "" or the error --- //
+	std::string open(const std::string& file);
+
+	// --- Follow the changes of the log since it was opened --- //
+	// Lines appended to it are added, keeping the cache, any other
+	// change maps the log again. Returns "" or the error.
+	std::string refresh();
+
+	// --- The number of leaves --- //
+	uint64_t leaves() const { return n; }
+
+	// --- The hash chain of leaf i (0-based), empty if there is none --- //
+	// The chain has the same format as MerkleHasher::getHashChain.
+	hash_chain_t getHashChain(uint64_t i);
+
+	// --- The root as text, "" for an empty log --- //
+	std::string getRoot();
+
+	// --- The counters and the memory use of the cache --- //
+	const cache_stats_t& stats() const { return st; }
+	size_t cacheEntries() const { return lru.size(); }
+	size_t cacheBytes() const { return lru.size() * entryBytes(); }
+	size_t cacheBudget() const { return budget; }
+	std::string statsJson() const;
+
+	// The subtrees of 2^BASE_HEIGHT lines are hashed from the log
+	static const unsigned BASE_HEIGHT = 10;
+
+private:
+	MerkleQuery(const MerkleQuery&);
+	MerkleQuery& operator=(const MerkleQuery&);
+
+	// --- The complete node of height h at index k of its level --- //
+	digest_t node(unsigned h, uint64_t k);
+
+	// --- Fold the forest trees below the given height --- //
+	digest_t fold(unsigned below);
+
+	// --- Hash the 2^h leaves from leaf first on into level --- //
+	// The leaves must lie in one subtree of 2^BASE_HEIGHT lines.
+	void hashLeaves(uint64_t first, unsigned h, std::vector<digest_t>& level);
+
+	// --- Unmap and forget the log --- //
+	void close();
+
+	// --- Map the first size bytes of the log and find its lines --- //
+	// The lines before byte from are already known. Returns "" or the error.
+	std::string mapLines(uint64_t from, uint64_t size);
+
+	// --- The LRU cache, keyed by (k << 6 | h) --- //
+	bool lookup(uint64_t key, digest_t& d);
+	void store(uint64_t key, const digest_t& d);
+
+	// --- The approximate memory of a cache entry --- //
+	// The digest, the list links and the hash table node and bucket.
+	static size_t entryBytes()
+	{
+		return sizeof(std::pair<uint64_t, digest_t>) + 2*sizeof(void*)
+			+ sizeof(std::pair<uint64_t, void*>) + 3*sizeof(void*);
+	}
+
+	std::string file;
+	int fd;
+	const char* map;
+	size_t map_size;
+	struct stat file_stat;
+
+	// The last bytes of the scanned part, to see that it is unchanged
+	std::string tail;
+	static const size_t TAIL_SIZE = 4096;
+
+	// The number of lines and the offset of every 2^BASE_HEIGHT-th
+	uint64_t n;
+	std::vector<uint64_t> base_offset;
+
+	typedef std::list< std::pair<uint64_t, digest_t> > lru_t;
+	lru_t lru;
+	std::unordered_map<uint64_t, typename lru_t::iterator> where;
+	size_t budget;
+	cache_stats_t st;
+
+}; // END MERKLEQUERY DECLARATION
+
+
+
+// -------------------------------------- //
+// ----- MerkleQuery IMPLEMENTATION ----- //
+// -------------------------------------- //
+
+
+// --- Constructor --- //
+template <class P>
+MerkleQuery<P>::MerkleQuery(size_t cache_bytes)
+	: fd(-1), map(0), map_size(0), n(0), budget(cache_bytes)
+{
+	memset(&st, 0, sizeof(st));
+	memset(&file_stat, 0, sizeof(file_stat));
+} // END MerkleQuery
+
+
+template <class P>
+MerkleQuery<P>::~MerkleQuery()
+{
+	close();
+} // END ~MerkleQuery
+
+
+// --- Unmap and forget the log --- //
+template <class P>
+void MerkleQuery<P>::close()
+{
+	if( map )
+	{
+		munmap(const_cast<char*>(map), map_size);
+	}
+	if( fd >= 0 )
+	{
+		::close(fd);
+	}
+	fd = -1;
+	map = 0;
+	map_size = 0;
+	n = 0;
+	base_offset.clear();
+	tail.clear();
+	lru.clear();
+	where.clear();
+} // END close
+
+
+// --- Open the log file --- //
+// The lines are counted as by LineReader: a last line
+// without '\n' is a line too.
+template <class P>
+std::string MerkleQuery<P>::open(const std::string& log_file)
+{
+	close();
+	file = log_file;
+	fd = ::open(file.c_str(), O_RDONLY);
+	if( fd < 0 || fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) )
+	{
+		close();
+		return "can not open the regular file " + file;
+	}
+	return mapLines(0, file_stat.st_size);
+} // END open
+
+
+// --- Map the first size bytes of the log and find its lines --- //
+template <class P>
+std::string MerkleQuery<P>::mapLines(uint64_t from, uint64_t size)
+{
+	if( map )
+	{
+		munmap(const_cast<char*>(map), map_size);
+		map = 0;
+	}
+	map_size = size;
+	if( map_size == 0 )
+	{
+		return "";
+	}
+	void* m = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if( m == MAP_FAILED )
+	{
+		close();
+		return "can not map " + file + ": " + strerror(errno);
+	}
+	map = static_cast<const char*>(m);
+
+	// One sequential pass to find the lines, the
+	// requests then go anywhere in the log
+	madvise(m, map_size, MADV_SEQUENTIAL);
+	const uint64_t base = uint64_t(1) << BASE_HEIGHT;
+	const char* p = map + from;
+	const char* end = map + map_size;
+	while( p < end )
+	{
+		if( (n & (base - 1)) == 0 )
+		{
+			base_offset.push_back(p - map);
+		}
+		++n;
+		const char* nl = static_cast<const char*>( memchr(p, '\n', end - p) );
+		p = nl ? nl + 1 : end;
+	}
+	madvise(m, map_size, MADV_RANDOM);
+	size_t keep = std::min(map_size, TAIL_SIZE);
+	tail.assign(end - keep, keep);
+	return "";
+} // END mapLines
+
+
+// --- Follow the changes of the log --- //
+// Lines appended to the same file after a complete last line leave
+// the old leaves, and thus the complete subtrees in the cache, as
+// they were.
+template <class P>
+std::string MerkleQuery<P>::refresh()
+{
+	struct stat now;
+	bool same_file = (::stat(file.c_str(), &now) == 0 && fd >= 0 && now.st_ino == file_stat.st_ino && now.st_dev == file_stat.st_dev);
+	if( same_file && now.st_size == file_stat.st_size && now.st_mtim.tv_sec == file_stat.st_mtim.tv_sec
+		&& now.st_mtim.tv_nsec == file_stat.st_mtim.tv_nsec )
+	{
+		return "";
+	}
+	if( same_file && uint64_t(now.st_size) > map_size && (map_size == 0 || map[map_size - 1] == '\n') )
+	{
+		// The end of the scanned part must be as it was
+		std::string old(tail.size(), '\0');
+		if( tail.empty() || (pread(fd, &old[0], old.size(), map_size - old.size()) == ssize_t(old.size()) && old == tail) )
+		{
+			st.appends++;
+			file_stat = now;
+			return mapLines(map_size, now.st_size);
+		}
+	}
+	st.reloads++;
+	return open(file);
+} // END refresh
+
+
+// --- Hash the 2^h leaves from leaf first on into level --- //
+template <class P>
+void MerkleQuery<P>::hashLeaves(uint64_t first, unsigned h, std::vector<digest_t>& level)
+{
+	const size_t count = size_t(1) << h;
+	std::vector<const char*> line(count);
+	std::vector<size_t> len(count);
+
+	// Skip to the first line from the start of its base subtree
+	const char* p = map + base_offset[first >> BASE_HEIGHT];
+	const char* end = map + map_size;
+	for (uint64_t skip = first & ((uint64_t(1) << BASE_HEIGHT) - 1); skip > 0; --skip)
+	{
+		p = static_cast<const char*>( memchr(p, '\n', end - p) ) + 1;
+	}
+	for (size_t j=0; j<count; ++j)
+	{
+		const char* nl = static_cast<const char*>( memchr(p, '\n', end - p) );
+		line[j] = p;
+		len[j] = (nl ? nl : end) - p;
+		p = nl ? nl + 1 : end;
+	}
+	level.resize(count);
+	P::leaves(line.data(), len.data(), count, level.data());
+	st.lines_hashed += count;
+	MERKLE_STATS_ADD(leaf_hashes, count);
+} // END hashLeaves
+
+
+// --- The complete node of height h at index k of its level --- //
+// Nodes below BASE_HEIGHT are hashed from the log, the others
+// are looked up and built from their children if missing.
+template <class P>
+typename MerkleQuery<P>::digest_t MerkleQuery<P>::node(unsigned h, uint64_t k)
+{
+	digest_t d;
+	uint64_t key = (k << 6) | h;
+	if( h >= BASE_HEIGHT && lookup(key, d) )
+	{
+		st.hits++;
+		return d;
+	}
+	if( h <= BASE_HEIGHT )
+	{
+		std::vector<digest_t> level;
+		hashLeaves(k << h, h, level);
+		for (size_t m=level.size()/2; m>0; m/=2)
+		{
+			P::nodes(level.data(), m, level.data());
+		}
+		MERKLE_STATS_ADD(node_hashes, level.size() - 1);
+		d = level[0];
+	}
+	else
+	{
+		digest_t left = node(h - 1, 2*k);
+		digest_t right = node(h - 1, 2*k + 1);
+		P::node(left, right, d);
+		MERKLE_STATS_ADD(node_hashes, 1);
+	}
+	if( h >= BASE_HEIGHT )
+	{
+		st.misses++;
+		store(key, d);
+	}
+	return d;
+} // END node
+
+
+// --- Fold the forest trees below the given height --- //
+// As MerkleForest::fold, from the lowest tree up.
+template <class P>
+typename MerkleQuery<P>::digest_t MerkleQuery<P>::fold(unsigned below)
+{
+	uint64_t bits = (below >= 64) ? n : n & ((uint64_t(1) << below) - 1);
+	unsigned g = __builtin_ctzll(bits);
+	digest_t acc = node(g, (n >> g) - 1);
+	digest_t next;
+	for (bits &= bits - 1; bits; bits &= bits - 1)
+	{
+		g = __builtin_ctzll(bits);
+		P::node(node(g, (n >> g) - 1), acc, next);
+		acc = next;
+	}
+	return acc;
+} // END fold
+
+
+// --- The hash chain of leaf i --- //
+// The steps below BASE_HEIGHT come from hashing the subtree of the
+// leaf, the rest as in MerkleIndex::getHashChain.
+template <class P>
+hash_chain_t MerkleQuery<P>::getHashChain(uint64_t i)
+{
+	hash_chain_t chain;
+	if( i >= n )
+	{
+		return chain;
+	}
+	st.chains++;
+
+	// The height of the low subtree of the leaf: BASE_HEIGHT,
+	// unless the forest tree of the leaf is smaller
+	unsigned low = 0;
+	while( low < BASE_HEIGHT && ((i >> low) ^ 1) < (n >> low) )
+	{
+		++low;
+	}
+	std::vector<digest_t> level;
+	hashLeaves((i >> low) << low, low, level);
+	uint64_t pos = i & ((uint64_t(1) << low) - 1);
+	for (unsigned l=0; l<low; ++l, pos >>= 1)
+	{
+		const digest_t& cur = level[pos];
+		const digest_t& sib = level[pos ^ 1];
+		chain.push_back( std::make_pair(int(pos & 1), P::toString(cur)) );
+		chain.push_back( std::make_pair(int(!(pos & 1)), P::toString(sib)) );
+		P::nodes(level.data(), level.size() >> (l + 1), level.data());
+	}
+	MERKLE_STATS_ADD(node_hashes, (size_t(1) << low) - 1);
+	digest_t cur = level[0];
+	digest_t next;
+	if( low == BASE_HEIGHT )
+	{
+		store( ((i >> low) << 6) | low, cur );
+	}
+
+	// The siblings above come from the cache
+	pos = i >> low;
+	uint64_t h = low;
+	while( (pos ^ 1) < (n >> h) )
+	{
+		digest_t sib = node(h, pos ^ 1);
+		if( pos & 1 )
+		{
+			chain.push_back( std::make_pair(1, P::toString(cur)) );
+			chain.push_back( std::make_pair(0, P::toString(sib)) );
+			P::node(sib, cur, next);
+		}
+		else
+		{
+			chain.push_back( std::make_pair(0, P::toString(cur)) );
+			chain.push_back( std::make_pair(1, P::toString(sib)) );
+			P::node(cur, sib, next);
+		}
+		cur = next;
+		pos >>= 1;
+		++h;
+	}
+
+	// cur is now the root of a forest tree, merged first with the
+	// smaller trees on its right, then with the larger on its left
+	if( n & ((uint64_t(1) << h) - 1) )
+	{
+		digest_t acc = fold(h);
+		chain.push_back( std::make_pair(0, P::toString(cur)) );
+		chain.push_back( std::make_pair(1, P::toString(acc)) );
+		P::node(cur, acc, next);
+		cur = next;
+	}
+	for (uint64_t g=h+1; g<64; ++g)
+	{
+		if( (n >> g) & 1 )
+		{
+			digest_t left = node(g, (n >> g) - 1);
+			chain.push_back( std::make_pair(1, P::toString(cur)) );
+			chain.push_back( std::make_pair(0, P::toString(left)) );
+			P::node(left, cur, next);
+			cur = next;
+		}
+	}
+	chain.push_back( std::make_pair(-1, P::toString(cur)) );
+	return chain;
+} // END getHashChain
+
+
+// --- The root as text --- //
+template <class P>
+std::string MerkleQuery<P>::getRoot()
+{
+	return (n == 0) ? std::string() : P::toString(fold(64));
+} // END getRoot
+
+
+// --- Look a node up, making it the most recently used --- //
+template <class P>
+bool MerkleQuery<P>::lookup(uint64_t key, digest_t& d)
+{
+	typename std::unordered_map<uint64_t, typename lru_t::iterator>::iterator it = where.find(key);
+	if( it == where.end() )
+	{
+		return false;
+	}
+	lru.splice(lru.begin(), lru, it->second);
+	d = it->second->second;
+	return true;
+} // END lookup
+
+
+// --- Add a node, evicting the least recently used over the budget --- //
+template <class P>
+void MerkleQuery<P>::store(uint64_t key, const digest_t& d)
+{
+	if( where.count(key) || entryBytes() > budget )
+	{
+		return;
+	}
+	while( (lru.size() + 1) * entryBytes() > budget )
+	{
+		where.erase(lru.back().first);
+		lru.pop_back();
+		st.evictions++;
+	}
+	lru.push_front( std::make_pair(key, d) );
+	where[key] = lru.begin();
+} // END store
+
+
+// --- The counters and the memory use of the cache as JSON --- //
+template <class P>
+std::string MerkleQuery<P>::statsJson() const
+{
+	std::ostringstream out;
+	uint64_t lookups = st.hits + st.misses;
+	out << "{\"lines\": " << n << ", \"chains\": " << st.chains
+		<< ", \"hits\": " << st.hits << ", \"misses\": " << st.misses
+		<< ", \"hit_rate\": " << (lookups ? double(st.hits) / lookups : 0.0)
+		<< ", \"evictions\": " << st.evictions << ", \"lines_hashed\": " << st.lines_hashed
+		<< ", \"reloads\": " << st.reloads << ", \"appends\": " << st.appends
+		<< ", \"cache_entries\": " << cacheEntries() << ", \"cache_bytes\": " << cacheBytes()
+		<< ", \"cache_budget\": " << budget << "}";
+	return out.str();
+} // END statsJson
+
+
+#endif // MERKLE_QUERY_HPP
@@ -0,0 +1,321 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleState.hpp
+ *
+ *	Implements the class template MerkleState, which holds
+ *	what is needed to continue building the Merkle tree of
+ *	a log file that has grown since the last run:
+ *		a)	The forest of complete trees (see
+ *			merkleForest.hpp).
+ *		b)	The number of lines hashed into the forest and
+ *			the byte offset right after the last of them.
+ *		c)	The device and inode of the log file and a
+ *			checksum of the last TAIL_SIZE (4 KiB) bytes
+ *			before the offset, which are used to detect
+ *			that the log file has been truncated, rotated
+ *			or rewritten at the end of its signed part.
+ *			The signed part is not read again, thus a
+ *			rewrite of the lines before the last 4 KiB
+ *			that keeps the file is not noticed; the new
+ *			root covers them as they were signed.
+ *
+ *	The state is kept in a small text file next to the log
+ *	file (<log_file>.state), which is replaced atomically.
+ *	Only complete lines (ending with '\n') are ever taken
+ *	into the state, as the last line may still be written.
+ */
+
+#ifndef MERKLE_STATE_HPP
+#define MERKLE_STATE_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "myHashInterface.hpp"
+#include "merkleForest.hpp"
+
+
+// ----------------------------------- //
+// ----- MerkleState DECLARATION ----- //
+// ----------------------------------- //
+template <class P>
+class MerkleState
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	MerkleState() : offset(0), lines(0), device(0), inode(0) {}
+
+	// --- Reading and writing the state file --- //
+	// load returns an error message, or "" on success.
+	std::string load(const std::string& state_file);
+	bool save(const std::string& state_file) const;
+
+	// --- Whether the log file still continues this state --- //
+	// Returns the reason why not, or "" if it does.
+	std::string check(const std::string& log_file) const;
+
+	// --- Record the identity of the log file up to offset --- //
+	void mark(const std::string& log_file);
+
+	// --- The end of the last complete line of the log file --- //
+	static uint64_t completeLinesEnd(const std::string& log_file);
+
+	// The byte offset after the last hashed line
+	// and the number of hashed lines
+	uint64_t offset;
+	uint64_t lines;
+
+	// The forest of complete trees
+	MerkleForest<P> forest;
+
+private:
+	// --- Checksum of the bytes right before offset --- //
+	static std::string tailChecksum(int fd, uint64_t offset);
+
+	uint64_t device;
+	uint64_t inode;
+	std::string tail;
+
+	// The number of bytes covered by the checksum
+	static const size_t TAIL_SIZE = 4096;
+
+}; // END MERKLESTATE DECLARATION
+
+
+
+// -------------------------------------- //
+// ----- MerkleState IMPLEMENTATION ----- //
+// -------------------------------------- //
+
+
+// --- Reading the state file --- //
+template <class P>
+std::string MerkleState<P>::load(const std::string& state_file)
+{
+	std::ifstream in(state_file);
+	if( !in.is_open() )
+	{
+		return "cannot open the state file " + state_file;
+	}
+
+	std::string line, key, policy;
+	std::getline(in, line);
+	if( line != "merkle-state 1" )
+	{
+		return state_file + " is not a state file";
+	}
+	forest.clear();
+
+	// Every key must be given once and read in full
+	enum { POLICY, OFFSET, LINES, DEVICE, INODE, TAIL, KEYS };
+	const char* names[KEYS] = { "policy", "offset", "lines", "device", "inode", "tail" };
+	bool seen[KEYS] = { false, false, false, false, false, false };
+	while( std::getline(in, line) )
+	{
+		std::istringstream fields(line);
+		key.clear();
+		fields >> key;
+		int k = KEYS;
+		if( key == "policy" )		{	k = POLICY;	fields >> policy;	}
+		else if( key == "offset" )	{	k = OFFSET;	fields >> offset;	}
+		else if( key == "lines" )	{	k = LINES;	fields >> lines;	}
+		else if( key == "device" )	{	k = DEVICE;	fields >> device;	}
+		else if( key == "inode" )	{	k = INODE;	fields >> inode;	}
+		else if( key == "tail" )	{	k = TAIL;	fields >> tail;		}
+		else if( key == "slot" )
+		{
+			// slot <height>\t<digest>, the digest is the rest of the line
+			size_t height;
+			fields >> height;
+			size_t tab = line.find('\t');
+			digest_t d;
+			if( !fields || tab == std::string::npos || height >= MerkleForest<P>::MAX_HEIGHT || 
+				forest.filled(height) || !P::fromString(line.substr(tab + 1), d) )
+			{
+				return state_file + " has a broken slot";
+			}
+			forest.set(height, d);
+			continue;
+		}
+		if( k == KEYS || seen[k] || !fields )
+		{
+			return state_file + " has a broken line: " + line;
+		}
+		seen[k] = true;
+	}
+	for (int k=0; k<KEYS; ++k)
+	{
+		if( !seen[k] )
+		{
+			return state_file + " has no " + names[k];
+		}
+	}
+	if( policy != P::name() )
+	{
+		return state_file + " was made with another hash (" + policy + ")";
+	}
+
+	// The forest holds a tree for each set bit of the number of lines
+	if( forest.leaves() != lines )
+	{
+		return state_file + " has a forest of " + std::to_string(forest.leaves()) + 
+			" lines instead of " + std::to_string(lines);
+	}
+	return "";
+} // END load
+
+
+// --- Writing the state file --- //
+// The state is written into a temporary file, which
+// then replaces the old state in a single rename.
+template <class P>
+bool MerkleState<P>::save(const std::string& state_file) const
+{
+	std::string tmp_file = state_file + ".tmp";
+	{
+		std::ofstream out(tmp_file);
+		if( !out.is_open() )
+		{
+			return false;
+		}
+		out << "merkle-state 1\n";
+		out << "policy " << P::name() << "\n";
+		out << "offset " << offset << "\n";
+		out << "lines " << lines << "\n";
+		out << "device " << device << "\n";
+		out << "inode " << inode << "\n";
+		out << "tail " << tail << "\n";
+		for (unsigned h=0; h<MerkleForest<P>::MAX_HEIGHT; ++h)
+		{
+			if( forest.filled(h) )
+			{
+				out << "slot " << h << "\t" << P::toString(forest.root(h)) << "\n";
+			}
+		}
+		out.flush();
+		if( !out )
+		{
+			return false;
+		}
+	}
+	return rename(tmp_file.c_str(), state_file.c_str()) == 0;
+} // END save
+
+
+// --- Whether the log file still continues this state --- //
+template <class P>
+std::string MerkleState<P>::check(const std::string& log_file) const
+{
+	int fd = ::open(log_file.c_str(), O_RDONLY);
+	if( fd < 0 )
+	{
+		return "cannot open the log file " + log_file;
+	}
+	struct stat st;
+	std::string error;
+	if( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) )
+	{
+		error = "the log file is not a regular file";
+	}
+	else if( uint64_t(st.st_dev) != device || uint64_t(st.st_ino) != inode )
+	{
+		error = "the log file has been replaced (rotated?)";
+	}
+	else if( uint64_t(st.st_size) < offset )
+	{
+		error = "the log file has been truncated";
+	}
+	else if( tailChecksum(fd, offset) != tail )
+	{
+		error = "the end of the already signed part of the log file has changed";
+	}
+	::close(fd);
+	return error;
+} // END check
+
+
+// --- Record the identity of the log file up to offset --- //
+template <class P>
+void MerkleState<P>::mark(const std::string& log_file)
+{
+	int fd = ::open(log_file.c_str(), O_RDONLY);
+	if( fd < 0 )
+	{
+		return;
+	}
+	struct stat st;
+	if( fstat(fd, &st) == 0 )
+	{
+		device = st.st_dev;
+		inode = st.st_ino;
+	}
+	tail = tailChecksum(fd, offset);
+	::close(fd);
+} // END mark
+
+
+// --- The end of the last complete line of the log file --- //
+// Searches backwards for the last '\n', 0 if there is none.
+template <class P>
+uint64_t MerkleState<P>::completeLinesEnd(const std::string& log_file)
+{
+	int fd = ::open(log_file.c_str(), O_RDONLY);
+	if( fd < 0 )
+	{
+		return 0;
+	}
+	struct stat st;
+	uint64_t end = 0;
+	if( fstat(fd, &st) == 0 )
+	{
+		char buf[TAIL_SIZE];
+		uint64_t pos = st.st_size;
+		while( pos > 0 && end == 0 )
+		{
+			size_t n = std::min<uint64_t>(pos, sizeof(buf));
+			pos -= n;
+			if( ::pread(fd, buf, n, pos) != ssize_t(n) )
+			{
+				break;
+			}
+			for (size_t i=n; i>0; --i)
+			{
+				if( buf[i-1] == '\n' )
+				{
+					end = pos + i;
+					break;
+				}
+			}
+		}
+	}
+	::close(fd);
+	return end;
+} // END completeLinesEnd
+
+
+// --- Checksum of the bytes right before offset --- //
+template <class P>
+std::string MerkleState<P>::tailChecksum(int fd, uint64_t offset)
+{
+	size_t n = std::min<uint64_t>(offset, TAIL_SIZE);
+	std::string bytes(n, '\0');
+	if( n > 0 && ::pread(fd, &bytes[0], n, offset - n) != ssize_t(n) )
+	{
+		return "-";
+	}
+	return sha256(bytes);
+} // END tailChecksum
+
+
+#endif // MERKLE_STATE_HPP
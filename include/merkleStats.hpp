@@ -0,0 +1,135 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	merkleStats.hpp
+ *
+ *	Counters and timers of the hot paths of the hasher, which
+ *	are reported as JSON with --stats:
+ *		a)	Bytes and lines read, leaf and internal hashes.
+ *		b)	Time spent on reading the lines, hashing the leaves
+ *			and merging them into the tree. With several threads
+ *			these are summed over the threads.
+ *		c)	Wall time of the phases of the main program (root,
+ *			hash chains, writing the output, ...). A phase is 
+ *			marked at its end and lasts from the previous mark.
+ *		d)	Peak resident memory of the process.
+ *
+ *	The counters are updated once per batch of lines, except
+ *	for the internal hashes, thus they cost next to nothing.
+ *	Compiling with -DMERKLE_NO_STATS turns all the macros
+ *	below into nothing, removing the instrumentation entirely.
+ */
+
+#ifndef MERKLE_STATS_HPP
+#define MERKLE_STATS_HPP
+
+#ifndef MERKLE_NO_STATS
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+
+#include <sys/resource.h>
+
+
+// --- The counters, shared by all threads --- //
+struct merkle_stats_t
+{
+	std::atomic<uint64_t> bytes_read;
+	std::atomic<uint64_t> lines;
+	std::atomic<uint64_t> leaf_hashes;
+	std::atomic<uint64_t> node_hashes;
+
+	// Nanoseconds, summed over the threads
+	std::atomic<uint64_t> read_ns;
+	std::atomic<uint64_t> leaf_ns;
+	std::atomic<uint64_t> merge_ns;
+
+	// Wall time of the phases of the main thread (seconds)
+	// and the end of the last phase
+	std::vector< std::pair<std::string, double> > phases;
+	std::chrono::steady_clock::time_point last_phase;
+
+	merkle_stats_t() : bytes_read(0), lines(0), leaf_hashes(0), node_hashes(0), read_ns(0), leaf_ns(0), merge_ns(0),
+		last_phase(std::chrono::steady_clock::now()) {}
+};
+
+inline merkle_stats_t& merkleStats()
+{
+	static merkle_stats_t stats;
+	return stats;
+}
+
+
+// --- Adds the time of its scope to a counter --- //
+class MerkleStatsTimer
+{
+public:
+	MerkleStatsTimer(std::atomic<uint64_t>& counter) : ns(counter), start(std::chrono::steady_clock::now()) {}
+	~MerkleStatsTimer()
+	{
+		ns.fetch_add( std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(),
+					  std::memory_order_relaxed );
+	}
+private:
+	std::atomic<uint64_t>& ns;
+	std::chrono::steady_clock::time_point start;
+};
+
+
+// --- Marks the end of a phase of the main thread --- //
+inline void merkleStatsPhase(const char* name)
+{
+	merkle_stats_t& s = merkleStats();
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	s.phases.push_back( std::make_pair(std::string(name), std::chrono::duration<double>(now - s.last_phase).count()) );
+	s.last_phase = now;
+}
+
+
+// --- The statistics as a JSON object --- //
+inline std::string merkleStatsJson()
+{
+	merkle_stats_t& s = merkleStats();
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(6);
+	out << "{\n";
+	out << "  \"bytes_read\": " << s.bytes_read << ",\n";
+	out << "  \"lines\": " << s.lines << ",\n";
+	out << "  \"leaf_hashes\": " << s.leaf_hashes << ",\n";
+	out << "  \"node_hashes\": " << s.node_hashes << ",\n";
+	out << "  \"read_seconds\": " << s.read_ns * 1e-9 << ",\n";
+	out << "  \"leaf_hash_seconds\": " << s.leaf_ns * 1e-9 << ",\n";
+	out << "  \"merge_seconds\": " << s.merge_ns * 1e-9 << ",\n";
+	out << "  \"peak_rss_kb\": " << usage.ru_maxrss << ",\n";
+	out << "  \"phases\": {";
+	for (size_t i=0; i<s.phases.size(); ++i)
+	{
+		out << (i ? ", " : "") << "\"" << s.phases[i].first << "\": " << s.phases[i].second;
+	}
+	out << "}\n}";
+	return out.str();
+}
+
+
+#define MERKLE_STATS_ADD(counter, n)	merkleStats().counter.fetch_add((n), std::memory_order_relaxed)
+#define MERKLE_STATS_TIMER(counter)		MerkleStatsTimer merkle_stats_timer_(merkleStats().counter)
+#define MERKLE_STATS_PHASE(name)		merkleStatsPhase(name)
+
+
+#else // MERKLE_NO_STATS
+
+#define MERKLE_STATS_ADD(counter, n)	((void)0)
+#define MERKLE_STATS_TIMER(counter)		((void)0)
+#define MERKLE_STATS_PHASE(name)		((void)0)
+
+#endif // MERKLE_NO_STATS
+
+#endif // MERKLE_STATS_HPP
@@ -7,6 +7,29 @@
  *  holds the hash_chain_t type defination and the 
  *  identidy_hash function, which just return the input. 
  *	
+ *	Also holds the hash policies used by MerkleHasher. A
+ *	policy defines the digest type of the tree nodes, how
+ *	leaves and internal nodes are hashed and how a digest
+ *	is turned into text at the output boundary:
+ *		a)	Sha256Policy: 		32 byte binary digests, internal
+ *								nodes are SHA256(left || right).
+ *		b)	Sha256HexPolicy:	Compatibility mode, which reproduces
+ *								the original hex-of-hex tree, where
+ *								internal nodes are SHA256 of the
+ *								concatenated hex strings.
+ *		c)	IdentityPolicy:		Test policy built on identity_hash
+ *								and myHashMerge.
+ *		d)	Sha512_256Policy:	32 byte SHA-512/256 digests.
+ *		e)	Blake2sPolicy:		32 byte BLAKE2s-256 digests.
+ *
+ *	Besides single leaves and nodes, the policies hash batches
+ *	of leaves and of sibling pairs, which the SHA256 policies
+ *	pass to the multi-buffer kernels of sha256Backend.hpp.
+ *	Messages given in pieces are hashed with the streaming
+ *	interface ctx_t, init(ctx), update(ctx, data, len) and
+ *	final(ctx, out); the nodes of the policies d) and e) are
+ *	hashed by streaming both children into one context.
+ *
  */
 
 #ifndef MY_HASH_INTERFACE_HPP
@@ -16,9 +39,19 @@
 #include <sstream>
 #include <string>
 #include <iomanip>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 
 // Hash functionality from OpenSSL
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+
+// Multi-buffer and SHA-NI SHA256 kernels
+#include "sha256Backend.hpp"
 
 
 // --- Typedef the hash_chain_t type --- //
@@ -28,10 +61,7 @@ typedef std::vector< std::pair<int, std::string> > hash_chain_t;
 std::string sha256(const std::string str)
 {
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, str.c_str(), str.size());
-    SHA256_Final(hash, &sha256);
+    EVP_Digest(str.c_str(), str.size(), hash, 0, EVP_sha256(), 0);
     std::stringstream ss;
     for(int i = 0; i < SHA256_DIGEST_LENGTH; i++)
     {
@@ -53,4 +83,325 @@ std::string identity_hash(const std::string str)
 } 
 
 
+// --- Fixed size binary SHA256 digest --- //
+typedef std::array<uint8_t, SHA256_DIGEST_LENGTH> sha256_digest_t;
+
+// Arrays of digests are passed to the kernels as plain bytes
+static_assert(sizeof(sha256_digest_t) == SHA256_DIGEST_LENGTH, "sha256_digest_t must not be padded");
+
+// --- Lower case hex encoding into a caller provided buffer --- //
+// The buffer must hold at least 2*len characters.
+inline void toHex(const uint8_t* data, size_t len, char* out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for(size_t i = 0; i < len; i++)
+    {
+        out[2*i]   = digits[data[i] >> 4];
+        out[2*i+1] = digits[data[i] & 0x0f];
+    }
+}
+
+// --- Hex decoding, returns false on malformed input --- //
+inline bool fromHex(const std::string& str, uint8_t* out, size_t len)
+{
+    if(str.size() != 2*len)
+    {
+        return false;
+    }
+    for(size_t i = 0; i < 2*len; i++)
+    {
+        char c = str[i];
+        int v;
+        if(c >= '0' && c <= '9')      { v = c - '0'; }
+        else if(c >= 'a' && c <= 'f') { v = c - 'a' + 10; }
+        else if(c >= 'A' && c <= 'F') { v = c - 'A' + 10; }
+        else { return false; }
+        if(i % 2 == 0) { out[i/2] = v << 4; }
+        else           { out[i/2] |= v; }
+    }
+    return true;
+}
+
+
+// --- SHA256 policy over binary digests --- //
+struct Sha256Policy
+{
+    typedef sha256_digest_t digest_t;
+
+    // --- Name and size of the digests, used in binary files --- //
+    static const size_t DIGEST_SIZE = SHA256_DIGEST_LENGTH;
+    static const char* name() { return "sha256"; }
+
+    // --- Streaming interface --- //
+    typedef evp_ctx_t ctx_t;
+    static void init(ctx_t& ctx) { EVP_DigestInit_ex(ctx.evp, EVP_sha256(), 0); }
+    static void update(ctx_t& ctx, const void* data, size_t len) { EVP_DigestUpdate(ctx.evp, data, len); }
+    static void final(ctx_t& ctx, digest_t& out) { EVP_DigestFinal_ex(ctx.evp, out.data(), 0); }
+
+    static void leaf(const char* data, size_t len, digest_t& out)
+    {
+        sha256One(reinterpret_cast<const uint8_t*>(data), len, out.data());
+    }
+
+    // Both children are hashed as one 64 byte message,
+    // no concatenated copy is made.
+    static void node(const digest_t& left, const digest_t& right, digest_t& out)
+    {
+        uint8_t buf[2*SHA256_DIGEST_LENGTH];
+        memcpy(buf, left.data(), left.size());
+        memcpy(buf + left.size(), right.data(), right.size());
+        sha256One(buf, sizeof(buf), out.data());
+    }
+
+    // --- Hash n leaves at once --- //
+    static void leaves(const char* const* data, const size_t* len, size_t n, digest_t* out)
+    {
+        sha256Many(reinterpret_cast<const uint8_t* const*>(data), len, n, out->data());
+    }
+
+    // --- Hash n sibling pairs at once --- //
+    // out[i] = node(pairs[2i], pairs[2i+1]), out may be pairs itself.
+    // The siblings are next to each other in memory, thus each pair
+    // is directly a 64 byte message.
+    static void nodes(const digest_t* pairs, size_t n, digest_t* out)
+    {
+        const size_t CHUNK = 64;
+        const uint8_t* data[CHUNK];
+        size_t len[CHUNK];
+        for (size_t i = 0; i < n; i += CHUNK)
+        {
+            size_t m = std::min(CHUNK, n - i);
+            for (size_t j = 0; j < m; j++)
+            {
+                data[j] = pairs[2*(i+j)].data();
+                len[j] = 2*SHA256_DIGEST_LENGTH;
+            }
+            sha256Many(data, len, m, out[i].data());
+        }
+    }
+
+    static std::string toString(const digest_t& d)
+    {
+        std::string s(2*d.size(), '0');
+        toHex(d.data(), d.size(), &s[0]);
+        return s;
+    }
+
+    static bool fromString(const std::string& s, digest_t& d)
+    {
+        return fromHex(s, d.data(), d.size());
+    }
+
+    static void toBytes(const digest_t& d, uint8_t* out) { memcpy(out, d.data(), DIGEST_SIZE); }
+    static void fromBytes(const uint8_t* in, digest_t& d) { memcpy(d.data(), in, DIGEST_SIZE); }
+};
+
+
+// --- SHA256 policy reproducing the original hex-of-hex tree --- //
+// Leaves are the same as in Sha256Policy, but internal nodes are
+// the SHA256 of the two hex encoded children, as was done by
+// MerkleHasher<sha256,myHashMerge>. The hex text is built in a
+// stack buffer, so there are still no heap allocations.
+struct Sha256HexPolicy : public Sha256Policy
+{
+    static const char* name() { return "sha256-hex"; }
+
+    static void node(const digest_t& left, const digest_t& right, digest_t& out)
+    {
+        char buf[4*SHA256_DIGEST_LENGTH];
+        toHex(left.data(), left.size(), buf);
+        toHex(right.data(), right.size(), buf + 2*SHA256_DIGEST_LENGTH);
+        sha256One(reinterpret_cast<const uint8_t*>(buf), sizeof(buf), out.data());
+    }
+
+    // --- Hash n sibling pairs at once --- //
+    static void nodes(const digest_t* pairs, size_t n, digest_t* out)
+    {
+        const size_t CHUNK = 16;
+        char buf[CHUNK][4*SHA256_DIGEST_LENGTH];
+        const uint8_t* data[CHUNK];
+        size_t len[CHUNK];
+        for (size_t i = 0; i < n; i += CHUNK)
+        {
+            size_t m = std::min(CHUNK, n - i);
+            for (size_t j = 0; j < m; j++)
+            {
+                toHex(pairs[2*(i+j)].data(), 2*SHA256_DIGEST_LENGTH, buf[j]);
+                data[j] = reinterpret_cast<const uint8_t*>(buf[j]);
+                len[j] = sizeof(buf[j]);
+            }
+            sha256Many(data, len, m, out[i].data());
+        }
+    }
+};
+
+
+// --- Test policy built on identity_hash and myHashMerge --- //
+struct IdentityPolicy
+{
+    typedef std::string digest_t;
+
+    // The digests have no fixed size, thus they can
+    // not be stored in binary files
+    static const size_t DIGEST_SIZE = 0;
+    static const char* name() { return "identity"; }
+
+    // --- Streaming interface --- //
+    typedef std::string ctx_t;
+    static void init(ctx_t& ctx) { ctx.clear(); }
+    static void update(ctx_t& ctx, const void* data, size_t len) { ctx.append(static_cast<const char*>(data), len); }
+    static void final(ctx_t& ctx, digest_t& out) { out = identity_hash(ctx); }
+
+    static void leaf(const char* data, size_t len, digest_t& out)
+    {
+        out = identity_hash(std::string(data, len));
+    }
+
+    static void node(const digest_t& left, const digest_t& right, digest_t& out)
+    {
+        out = identity_hash( myHashMerge(left, right) );
+    }
+
+    static void leaves(const char* const* data, const size_t* len, size_t n, digest_t* out)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            leaf(data[i], len[i], out[i]);
+        }
+    }
+
+    static void nodes(const digest_t* pairs, size_t n, digest_t* out)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            digest_t d;
+            node(pairs[2*i], pairs[2*i+1], d);
+            out[i] = d;
+        }
+    }
+
+    static std::string toString(const digest_t& d)
+    {
+        return d;
+    }
+
+    static bool fromString(const std::string& s, digest_t& d)
+    {
+        d = s;
+        return true;
+    }
+
+    static void toBytes(const digest_t&, uint8_t*) {}
+    static void fromBytes(const uint8_t*, digest_t& d) { d.clear(); }
+};
+
+
+// --- Policy over a 32 byte hash of OpenSSL's EVP interface --- //
+// A gives the name of the policy and the OpenSSL digest. Every
+// thread keeps one context, which is reset for each message, so
+// hashing does not allocate. A node streams both children into 
+// the context, without a concatenated copy.
+template <class A>
+struct EvpPolicy
+{
+    typedef std::array<uint8_t, 32> digest_t;
+
+    static const size_t DIGEST_SIZE = 32;
+    static const char* name() { return A::name(); }
+
+    // --- The digest, fetched once --- //
+    static const EVP_MD* md()
+    {
+    #if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        static const EVP_MD* m = EVP_MD_fetch(0, A::evpName(), 0);
+    #else
+        static const EVP_MD* m = EVP_get_digestbyname(A::evpName());
+    #endif
+        return m;
+    }
+    static bool available() { return md() != 0; }
+
+    // --- Streaming interface --- //
+    typedef evp_ctx_t ctx_t;
+    static void init(ctx_t& ctx) { EVP_DigestInit_ex(ctx.evp, md(), 0); }
+    static void update(ctx_t& ctx, const void* data, size_t len) { EVP_DigestUpdate(ctx.evp, data, len); }
+    static void final(ctx_t& ctx, digest_t& out) { EVP_DigestFinal_ex(ctx.evp, out.data(), 0); }
+
+    // --- The context of the calling thread --- //
+    static ctx_t& local()
+    {
+        static thread_local ctx_t ctx;
+        return ctx;
+    }
+
+    static void leaf(const char* data, size_t len, digest_t& out)
+    {
+        ctx_t& ctx = local();
+        init(ctx);
+        update(ctx, data, len);
+        final(ctx, out);
+    }
+
+    static void node(const digest_t& left, const digest_t& right, digest_t& out)
+    {
+        ctx_t& ctx = local();
+        init(ctx);
+        update(ctx, left.data(), left.size());
+        update(ctx, right.data(), right.size());
+        final(ctx, out);
+    }
+
+    static void leaves(const char* const* data, const size_t* len, size_t n, digest_t* out)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            leaf(data[i], len[i], out[i]);
+        }
+    }
+
+    // out may be pairs itself, out[i] is only written
+    // after pairs[2i] and pairs[2i+1] have been read
+    static void nodes(const digest_t* pairs, size_t n, digest_t* out)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            digest_t d;
+            node(pairs[2*i], pairs[2*i+1], d);
+            out[i] = d;
+        }
+    }
+
+    static std::string toString(const digest_t& d)
+    {
+        std::string s(2*d.size(), '0');
+        toHex(d.data(), d.size(), &s[0]);
+        return s;
+    }
+
+    static bool fromString(const std::string& s, digest_t& d)
+    {
+        return fromHex(s, d.data(), d.size());
+    }
+
+    static void toBytes(const digest_t& d, uint8_t* out) { memcpy(out, d.data(), DIGEST_SIZE); }
+    static void fromBytes(const uint8_t* in, digest_t& d) { memcpy(d.data(), in, DIGEST_SIZE); }
+};
+
+// --- SHA-512/256 policy --- //
+struct Sha512_256Algorithm
+{
+    static const char* name() { return "sha512-256"; }
+    static const char* evpName() { return "SHA512-256"; }
+};
+typedef EvpPolicy<Sha512_256Algorithm> Sha512_256Policy;
+
+// --- BLAKE2s-256 policy --- //
+struct Blake2sAlgorithm
+{
+    static const char* name() { return "blake2s-256"; }
+    static const char* evpName() { return "BLAKE2s256"; }
+};
+typedef EvpPolicy<Blake2sAlgorithm> Blake2sPolicy;
+
+
 #endif // MY_HASH_INTERFACE_HPP
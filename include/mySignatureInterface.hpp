@@ -2,7 +2,8 @@
  *	Author:	Madis Ollikainen 
  *	File:	mySignatureInterface.hpp  
  *
- *	Implenets an empty signature fucntion.
+ *	Implenets an empty signature fucntion
+ *	and its counterpart for verification.
  */
 
 #ifndef MY_SIGNATURE_INTERFACE_HPP
@@ -31,4 +32,13 @@ std::string signature(std::string& str)
 	return str;
 }
 
+// The root signed by a signature, which for the 
+// empty signature is the signature itself. Returns
+// "" if the signature can not be verified.
+
+std::string signedRoot(const std::string& sign)
+{
+	return sign;
+}
+
 #endif // MY_SIGNATURE_INTERFACE_HPP
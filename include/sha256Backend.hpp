@@ -0,0 +1,639 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	sha256Backend.hpp
+ *
+ *	Implements a SHA256 backend for hashing many short
+ *	messages at once. Log lines are short, so hashing them
+ *	one by one through OpenSSL is dominated by the per-call
+ *	overhead. The backend has the following kernels:
+ *		a)	scalar:	portable single buffer compression.
+ *		b)	shani:	compression with the x86 SHA extensions,
+ *					two messages interleaved.
+ *		c)	sse2:	4 messages at once in 128 bit lanes.
+ *		d)	avx2:	8 messages at once in 256 bit lanes.
+ *		e)	avx512:	16 messages at once in 512 bit lanes.
+ *
+ *	The multi-buffer kernels are all built from the same
+ *	round function over GCC vector types, compiled for the
+ *	different instruction sets with target attributes. The
+ *	best kernels supported by the CPU are chosen at runtime
+ *	via CPUID (or set with sha256SetBackend):
+ *		sha256One	hashes a single message,
+ *		sha256Many	hashes a batch of independent messages.
+ */
+
+#ifndef SHA256_BACKEND_HPP
+#define SHA256_BACKEND_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+// Fallback single buffer hashing from OpenSSL
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define SHA256_BACKEND_X86
+	#include <cpuid.h>
+	#include <immintrin.h>
+#endif
+
+
+// --- The SHA256 round constants --- //
+static const uint32_t SHA256_K[64] __attribute__((aligned(64))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// --- The SHA256 initial state --- //
+static const uint32_t SHA256_IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// --- Big endian loads and stores --- //
+static inline uint32_t sha256LoadBE(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return __builtin_bswap32(v);
+}
+static inline void sha256StoreBE(uint8_t* p, uint32_t v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+
+// --- One compression over W lanes --- //
+// The state is st[8*W] and the message words w[16*W], both
+// with the W lanes of a word next to each other. With W=1
+// and V=uint32_t this is the plain scalar compression.
+#define SHA256_ROTR(x,n)	( ((x) >> (n)) | ((x) << (32-(n))) )
+#define SHA256_S0(x)		( SHA256_ROTR(x,2) ^ SHA256_ROTR(x,13) ^ SHA256_ROTR(x,22) )
+#define SHA256_S1(x)		( SHA256_ROTR(x,6) ^ SHA256_ROTR(x,11) ^ SHA256_ROTR(x,25) )
+#define SHA256_s0(x)		( SHA256_ROTR(x,7) ^ SHA256_ROTR(x,18) ^ ((x) >> 3) )
+#define SHA256_s1(x)		( SHA256_ROTR(x,17) ^ SHA256_ROTR(x,19) ^ ((x) >> 10) )
+
+template <class V, int W>
+static inline __attribute__((always_inline)) void sha256BlockLanes(uint32_t* st, const uint32_t* w)
+{
+	V s[8];
+	V m[16];
+	for (int i=0; i<8; ++i)	{	memcpy(&s[i], st + i*W, sizeof(V));	}
+	for (int i=0; i<16; ++i)	{	memcpy(&m[i], w + i*W, sizeof(V));	}
+
+	V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+	#pragma GCC unroll 64
+	for (int t=0; t<64; ++t)
+	{
+		if(t >= 16)
+		{
+			m[t&15] = SHA256_s1(m[(t-2)&15]) + m[(t-7)&15] + SHA256_s0(m[(t-15)&15]) + m[t&15];
+		}
+		V t1 = h + SHA256_S1(e) + ((e & f) ^ (~e & g)) + SHA256_K[t] + m[t&15];
+		V t2 = SHA256_S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+	s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+	for (int i=0; i<8; ++i)	{	memcpy(st + i*W, &s[i], sizeof(V));	}
+}
+
+
+// --- The compression kernels for the different instruction sets --- //
+typedef void (*sha256_lanes_fn)(uint32_t* st, const uint32_t* w);
+
+static void sha256BlockScalar(uint32_t* st, const uint32_t* w)
+{
+	sha256BlockLanes<uint32_t,1>(st, w);
+}
+
+#ifdef SHA256_BACKEND_X86
+
+typedef uint32_t sha256_v4_t  __attribute__((vector_size(16)));
+typedef uint32_t sha256_v8_t  __attribute__((vector_size(32)));
+typedef uint32_t sha256_v16_t __attribute__((vector_size(64)));
+
+static void sha256BlockX4(uint32_t* st, const uint32_t* w)
+{
+	sha256BlockLanes<sha256_v4_t,4>(st, w);
+}
+
+__attribute__((target("avx2")))
+static void sha256BlockX8(uint32_t* st, const uint32_t* w)
+{
+	sha256BlockLanes<sha256_v8_t,8>(st, w);
+}
+
+__attribute__((target("avx512f")))
+static void sha256BlockX16(uint32_t* st, const uint32_t* w)
+{
+	sha256BlockLanes<sha256_v16_t,16>(st, w);
+}
+
+// --- Single buffer compression with the SHA extensions --- //
+__attribute__((target("sha,sse4.1")))
+static void sha256BlocksShaNi(uint32_t* state, const uint8_t* data, size_t nblocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// Rearrange the state into ABEF and CDGH
+	__m128i tmp = _mm_loadu_si128( reinterpret_cast<const __m128i*>(state) );
+	__m128i state1 = _mm_loadu_si128( reinterpret_cast<const __m128i*>(state + 4) );
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (size_t n=0; n<nblocks; ++n, data += 64)
+	{
+		__m128i abef = state0;
+		__m128i cdgh = state1;
+		__m128i m[4];
+
+		// 16 groups of 4 rounds, the message schedule
+		// is kept in the 4 rolling registers m[]
+		#pragma GCC unroll 16
+		for (int i=0; i<16; ++i)
+		{
+			if(i < 4)
+			{
+				m[i] = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i*>(data + 16*i) ), MASK );
+			}
+			else
+			{
+				__m128i t = _mm_sha256msg1_epu32(m[i&3], m[(i+1)&3]);
+				t = _mm_add_epi32(t, _mm_alignr_epi8(m[(i+3)&3], m[(i+2)&3], 4));
+				m[i&3] = _mm_sha256msg2_epu32(t, m[(i+3)&3]);
+			}
+			__m128i msg = _mm_add_epi32(m[i&3], _mm_load_si128( reinterpret_cast<const __m128i*>(SHA256_K + 4*i) ));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	// Rearrange the state back into ABCD and EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(state), state0 );
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(state + 4), state1 );
+}
+
+// --- Two interleaved single block compressions with the SHA extensions --- //
+// The two messages are independent, so the latency of one round
+// instruction is hidden behind the other message.
+__attribute__((target("sha,sse4.1")))
+static void sha256BlockShaNiX2(uint32_t* state_a, const uint8_t* data_a, uint32_t* state_b, const uint8_t* data_b)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	__m128i ta = _mm_shuffle_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>(state_a) ), 0xB1 );
+	__m128i a1 = _mm_shuffle_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>(state_a + 4) ), 0x1B );
+	__m128i a0 = _mm_alignr_epi8(ta, a1, 8);
+	a1 = _mm_blend_epi16(a1, ta, 0xF0);
+	__m128i tb = _mm_shuffle_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>(state_b) ), 0xB1 );
+	__m128i b1 = _mm_shuffle_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>(state_b + 4) ), 0x1B );
+	__m128i b0 = _mm_alignr_epi8(tb, b1, 8);
+	b1 = _mm_blend_epi16(b1, tb, 0xF0);
+
+	__m128i a_abef = a0, a_cdgh = a1, b_abef = b0, b_cdgh = b1;
+	__m128i ma[4], mb[4];
+
+	#pragma GCC unroll 16
+	for (int i=0; i<16; ++i)
+	{
+		if(i < 4)
+		{
+			ma[i] = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i*>(data_a + 16*i) ), MASK );
+			mb[i] = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i*>(data_b + 16*i) ), MASK );
+		}
+		else
+		{
+			__m128i t = _mm_sha256msg1_epu32(ma[i&3], ma[(i+1)&3]);
+			__m128i u = _mm_sha256msg1_epu32(mb[i&3], mb[(i+1)&3]);
+			t = _mm_add_epi32(t, _mm_alignr_epi8(ma[(i+3)&3], ma[(i+2)&3], 4));
+			u = _mm_add_epi32(u, _mm_alignr_epi8(mb[(i+3)&3], mb[(i+2)&3], 4));
+			ma[i&3] = _mm_sha256msg2_epu32(t, ma[(i+3)&3]);
+			mb[i&3] = _mm_sha256msg2_epu32(u, mb[(i+3)&3]);
+		}
+		__m128i k = _mm_load_si128( reinterpret_cast<const __m128i*>(SHA256_K + 4*i) );
+		__m128i msg_a = _mm_add_epi32(ma[i&3], k);
+		__m128i msg_b = _mm_add_epi32(mb[i&3], k);
+		a1 = _mm_sha256rnds2_epu32(a1, a0, msg_a);
+		b1 = _mm_sha256rnds2_epu32(b1, b0, msg_b);
+		msg_a = _mm_shuffle_epi32(msg_a, 0x0E);
+		msg_b = _mm_shuffle_epi32(msg_b, 0x0E);
+		a0 = _mm_sha256rnds2_epu32(a0, a1, msg_a);
+		b0 = _mm_sha256rnds2_epu32(b0, b1, msg_b);
+	}
+
+	a0 = _mm_add_epi32(a0, a_abef);
+	a1 = _mm_add_epi32(a1, a_cdgh);
+	b0 = _mm_add_epi32(b0, b_abef);
+	b1 = _mm_add_epi32(b1, b_cdgh);
+
+	ta = _mm_shuffle_epi32(a0, 0x1B);
+	a1 = _mm_shuffle_epi32(a1, 0xB1);
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(state_a), _mm_blend_epi16(ta, a1, 0xF0) );
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(state_a + 4), _mm_alignr_epi8(a1, ta, 8) );
+	tb = _mm_shuffle_epi32(b0, 0x1B);
+	b1 = _mm_shuffle_epi32(b1, 0xB1);
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(state_b), _mm_blend_epi16(tb, b1, 0xF0) );
+	_mm_storeu_si128( reinterpret_cast<__m128i*>(state_b + 4), _mm_alignr_epi8(b1, tb, 8) );
+}
+
+#endif // SHA256_BACKEND_X86
+
+
+// --- Padding of the tail of a message --- //
+// Writes the last partial block and the padding into tail
+// (room for 2 blocks) and returns the number of tail blocks.
+static inline size_t sha256Tail(const uint8_t* data, size_t len, uint8_t* tail)
+{
+	size_t rem = len % 64;
+	size_t nt = (rem < 56) ? 1 : 2;
+	memset(tail, 0, 64*nt);
+	memcpy(tail, data + len - rem, rem);
+	tail[rem] = 0x80;
+	uint64_t bits = uint64_t(len) * 8;
+	for (int i=0; i<8; ++i)
+	{
+		tail[64*nt - 1 - i] = uint8_t(bits >> (8*i));
+	}
+	return nt;
+}
+
+
+// --- Single message with the portable kernel --- //
+static void sha256OneScalar(const uint8_t* data, size_t len, uint8_t* out)
+{
+	uint32_t st[8];
+	uint32_t w[16];
+	memcpy(st, SHA256_IV, sizeof(st));
+	uint8_t tail[128];
+	size_t full = len / 64;
+	size_t nt = sha256Tail(data, len, tail);
+	for (size_t b=0; b<full+nt; ++b)
+	{
+		const uint8_t* p = (b < full) ? data + 64*b : tail + 64*(b-full);
+		for (int i=0; i<16; ++i)	{	w[i] = sha256LoadBE(p + 4*i);	}
+		sha256BlockScalar(st, w);
+	}
+	for (int i=0; i<8; ++i)	{	sha256StoreBE(out + 4*i, st[i]);	}
+}
+
+// --- An EVP digest context, freed with its owner --- //
+struct evp_ctx_t
+{
+	EVP_MD_CTX* evp;
+	evp_ctx_t() : evp(EVP_MD_CTX_new()) {}
+	~evp_ctx_t() { EVP_MD_CTX_free(evp); }
+private:
+	evp_ctx_t(const evp_ctx_t&);
+	evp_ctx_t& operator=(const evp_ctx_t&);
+};
+
+// --- Single message through OpenSSL --- //
+// Every thread keeps one context, thus hashing does not allocate.
+static void sha256OneOpenSSL(const uint8_t* data, size_t len, uint8_t* out)
+{
+	static thread_local evp_ctx_t ctx;
+	EVP_DigestInit_ex(ctx.evp, EVP_sha256(), 0);
+	EVP_DigestUpdate(ctx.evp, data, len);
+	EVP_DigestFinal_ex(ctx.evp, out, 0);
+}
+
+#ifdef SHA256_BACKEND_X86
+// --- Single message with the SHA extensions --- //
+static void sha256OneShaNi(const uint8_t* data, size_t len, uint8_t* out)
+{
+	uint32_t st[8];
+	memcpy(st, SHA256_IV, sizeof(st));
+	uint8_t tail[128];
+	size_t full = len / 64;
+	size_t nt = sha256Tail(data, len, tail);
+	sha256BlocksShaNi(st, data, full);
+	sha256BlocksShaNi(st, tail, nt);
+	for (int i=0; i<8; ++i)	{	sha256StoreBE(out + 4*i, st[i]);	}
+}
+#endif
+
+
+#ifdef SHA256_BACKEND_X86
+// --- Two messages at once with the SHA extensions --- //
+static void sha256TwoShaNi(const uint8_t* data_a, size_t len_a, uint8_t* out_a, const uint8_t* data_b, size_t len_b, uint8_t* out_b)
+{
+	uint32_t sa[8], sb[8];
+	memcpy(sa, SHA256_IV, sizeof(sa));
+	memcpy(sb, SHA256_IV, sizeof(sb));
+	uint8_t tail_a[128], tail_b[128];
+	size_t full_a = len_a / 64, full_b = len_b / 64;
+	size_t nb_a = full_a + sha256Tail(data_a, len_a, tail_a);
+	size_t nb_b = full_b + sha256Tail(data_b, len_b, tail_b);
+
+	// Interleave the common blocks, then finish the longer one
+	size_t common = std::min(nb_a, nb_b);
+	for (size_t b=0; b<common; ++b)
+	{
+		const uint8_t* pa = (b < full_a) ? data_a + 64*b : tail_a + 64*(b-full_a);
+		const uint8_t* pb = (b < full_b) ? data_b + 64*b : tail_b + 64*(b-full_b);
+		sha256BlockShaNiX2(sa, pa, sb, pb);
+	}
+	for (size_t b=common; b<nb_a; ++b)
+	{
+		sha256BlocksShaNi(sa, (b < full_a) ? data_a + 64*b : tail_a + 64*(b-full_a), 1);
+	}
+	for (size_t b=common; b<nb_b; ++b)
+	{
+		sha256BlocksShaNi(sb, (b < full_b) ? data_b + 64*b : tail_b + 64*(b-full_b), 1);
+	}
+	for (int i=0; i<8; ++i)
+	{
+		sha256StoreBE(out_a + 4*i, sa[i]);
+		sha256StoreBE(out_b + 4*i, sb[i]);
+	}
+}
+#endif
+
+
+// --- Up to W messages at once with a multi-buffer kernel --- //
+// Lane j hashes message idx[j] into out + 32*idx[j]. Lanes whose 
+// message has fewer blocks than the longest one are run on their
+// last block again, but their state is not updated.
+template <int W>
+static void sha256GroupLanes(sha256_lanes_fn kernel, const uint8_t* const* all_data, const size_t* all_len, const uint32_t* idx, size_t n, uint8_t* out)
+{
+	const uint8_t* data[W];
+	size_t len[W];
+	for (size_t j=0; j<n; ++j)
+	{
+		data[j] = all_data[idx[j]];
+		len[j] = all_len[idx[j]];
+	}
+
+	uint32_t st[8*W] __attribute__((aligned(64)));
+	uint32_t w[16*W] __attribute__((aligned(64)));
+	uint8_t tail[W][128];
+	size_t full[W];
+	size_t nblocks[W];
+	size_t max_blocks = 0;
+	bool same = true;
+
+	for (size_t j=0; j<W; ++j)
+	{
+		// Unused lanes hash an empty message
+		size_t lj = (j < n) ? len[j] : 0;
+		const uint8_t* dj = (j < n) ? data[j] : tail[j];
+		if(j >= n)	{	data[j] = dj;	}
+		full[j] = lj / 64;
+		nblocks[j] = full[j] + sha256Tail(dj, lj, tail[j]);
+		if(j > 0 && nblocks[j] != nblocks[0])	{	same = false;	}
+		max_blocks = std::max(max_blocks, nblocks[j]);
+		for (int i=0; i<8; ++i)	{	st[i*W + j] = SHA256_IV[i];	}
+	}
+
+	uint32_t saved[8*W];
+	for (size_t b=0; b<max_blocks; ++b)
+	{
+		// Gather the message words lane by lane
+		for (size_t j=0; j<W; ++j)
+		{
+			size_t bj = std::min(b, nblocks[j] - 1);
+			const uint8_t* p = (bj < full[j]) ? data[j] + 64*bj : tail[j] + 64*(bj - full[j]);
+			for (int i=0; i<16; ++i)	{	w[i*W + j] = sha256LoadBE(p + 4*i);	}
+		}
+		if(!same)	{	memcpy(saved, st, sizeof(saved));	}
+		kernel(st, w);
+		if(!same)
+		{
+			for (size_t j=0; j<W; ++j)
+			{
+				if(b >= nblocks[j])
+				{
+					for (int i=0; i<8; ++i)	{	st[i*W + j] = saved[i*W + j];	}
+				}
+			}
+		}
+	}
+
+	for (size_t j=0; j<n; ++j)
+	{
+		for (int i=0; i<8; ++i)	{	sha256StoreBE(out + 32*idx[j] + 4*i, st[i*W + j]);	}
+	}
+}
+
+
+// --- The backend selection --- //
+enum sha256_backend_t { SHA256_SCALAR, SHA256_OPENSSL, SHA256_SHANI, SHA256_SSE2, SHA256_AVX2, SHA256_AVX512 };
+
+struct sha256_dispatch_t
+{
+	sha256_backend_t one;
+	sha256_backend_t many;
+};
+
+// --- Which kernels the CPU (and the OS) supports --- //
+static inline bool sha256CpuSupports(sha256_backend_t b)
+{
+	if(b == SHA256_SCALAR || b == SHA256_OPENSSL)
+	{
+		return true;
+	}
+#ifdef SHA256_BACKEND_X86
+	if(b == SHA256_SSE2)
+	{
+		return true;
+	}
+	unsigned eax, ebx, ecx, edx;
+	if( !__get_cpuid(1, &eax, &ebx, &ecx, &edx) )
+	{
+		return false;
+	}
+	bool sse41 = ecx & (1u << 19);
+	bool osxsave = ecx & (1u << 27);
+	if( !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) )
+	{
+		return false;
+	}
+	bool sha = ebx & (1u << 29);
+	bool avx2 = ebx & (1u << 5);
+	bool avx512f = ebx & (1u << 16);
+
+	// The OS must save the wide registers
+	uint64_t xcr0 = 0;
+	if(osxsave)
+	{
+		uint32_t lo, hi;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		xcr0 = (uint64_t(hi) << 32) | lo;
+	}
+
+	switch(b)
+	{
+		case SHA256_SHANI:	return sha && sse41;
+		case SHA256_AVX2:	return avx2 && (xcr0 & 0x6) == 0x6;
+		case SHA256_AVX512:	return avx512f && (xcr0 & 0xe6) == 0xe6;
+		default:			return false;
+	}
+#else
+	return false;
+#endif
+}
+
+// --- The current selection, the best supported kernels by default --- //
+static inline sha256_dispatch_t& sha256Dispatch()
+{
+	static sha256_dispatch_t d = []()
+	{
+		sha256_dispatch_t r;
+		r.one = sha256CpuSupports(SHA256_SHANI) ? SHA256_SHANI : SHA256_OPENSSL;
+		if(sha256CpuSupports(SHA256_AVX512))		{	r.many = SHA256_AVX512;	}
+		else if(r.one == SHA256_SHANI)				{	r.many = SHA256_SHANI;	}
+		else if(sha256CpuSupports(SHA256_AVX2))		{	r.many = SHA256_AVX2;	}
+		else										{	r.many = SHA256_OPENSSL;	}
+		return r;
+	}();
+	return d;
+}
+
+// --- Names of the backends --- //
+static inline const char* sha256BackendName(sha256_backend_t b)
+{
+	switch(b)
+	{
+		case SHA256_SCALAR:		return "scalar";
+		case SHA256_OPENSSL:	return "openssl";
+		case SHA256_SHANI:		return "shani";
+		case SHA256_SSE2:		return "sse2";
+		case SHA256_AVX2:		return "avx2";
+		case SHA256_AVX512:		return "avx512";
+	}
+	return "";
+}
+
+// --- Force a backend by name, returns false if it is not supported --- //
+// The single message kernel is set to the same backend, unless
+// the backend is a multi-buffer one.
+static inline bool sha256SetBackend(const std::string& name)
+{
+	for (int i=SHA256_SCALAR; i<=SHA256_AVX512; ++i)
+	{
+		sha256_backend_t b = sha256_backend_t(i);
+		if(name == sha256BackendName(b))
+		{
+			if( !sha256CpuSupports(b) )
+			{
+				return false;
+			}
+			sha256Dispatch().many = b;
+			if(b == SHA256_SCALAR || b == SHA256_OPENSSL || b == SHA256_SHANI)
+			{
+				sha256Dispatch().one = b;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// --- Hash a single message --- //
+static inline void sha256One(const uint8_t* data, size_t len, uint8_t* out)
+{
+	switch(sha256Dispatch().one)
+	{
+#ifdef SHA256_BACKEND_X86
+		case SHA256_SHANI:	sha256OneShaNi(data, len, out);		break;
+#endif
+		case SHA256_SCALAR:	sha256OneScalar(data, len, out);	break;
+		default:			sha256OneOpenSSL(data, len, out);	break;
+	}
+}
+
+// --- Hash n independent messages, out holds 32*n bytes --- //
+// out may overlap the messages only if they all have the same length,
+// as then they are hashed in order, W at a time.
+static inline void sha256Many(const uint8_t* const* data, const size_t* len, size_t n, uint8_t* out)
+{
+	size_t width = 1;
+	sha256_lanes_fn kernel = 0;
+	switch(sha256Dispatch().many)
+	{
+#ifdef SHA256_BACKEND_X86
+		case SHA256_SSE2:	width = 4;	kernel = sha256BlockX4;		break;
+		case SHA256_AVX2:	width = 8;	kernel = sha256BlockX8;		break;
+		case SHA256_AVX512:	width = 16;	kernel = sha256BlockX16;	break;
+		case SHA256_SHANI:
+			width = 2;
+			break;
+#endif
+		case SHA256_SCALAR:
+			for (size_t i=0; i<n; ++i)	{	sha256OneScalar(data[i], len[i], out + 32*i);	}
+			return;
+		default:
+			for (size_t i=0; i<n; ++i)	{	sha256OneOpenSSL(data[i], len[i], out + 32*i);	}
+			return;
+	}
+
+	// The messages are sorted by their number of blocks (stable,
+	// so equal length messages keep their order), so that lanes
+	// of a group seldom idle. Full groups go through the multi-
+	// buffer kernel, a short remainder is cheaper with the single
+	// message kernel.
+	const size_t CHUNK = 256;
+	const size_t KEYS = 16;
+	uint32_t idx[CHUNK];
+	for (size_t c=0; c<n; c+=CHUNK)
+	{
+		size_t cn = std::min(CHUNK, n - c);
+		size_t count[KEYS+1] = {0};
+		for (size_t i=0; i<cn; ++i)
+		{
+			count[ std::min((len[c+i] + 72) / 64, KEYS - 1) + 1 ]++;
+		}
+		for (size_t k=1; k<=KEYS; ++k)	{	count[k] += count[k-1];	}
+		for (size_t i=0; i<cn; ++i)
+		{
+			idx[ count[ std::min((len[c+i] + 72) / 64, KEYS - 1) ]++ ] = c + i;
+		}
+
+		size_t i = 0;
+		for ( ; i + width <= cn || (i < cn && cn - i > width/2); i += width)
+		{
+			size_t m = std::min(width, cn - i);
+			switch(width)
+			{
+#ifdef SHA256_BACKEND_X86
+				case 2:
+					sha256TwoShaNi(data[idx[i]], len[idx[i]], out + 32*idx[i], data[idx[i+1]], len[idx[i+1]], out + 32*idx[i+1]);
+					break;
+#endif
+				case 4:		sha256GroupLanes<4>(kernel, data, len, idx + i, m, out);	break;
+				case 8:		sha256GroupLanes<8>(kernel, data, len, idx + i, m, out);	break;
+				default:	sha256GroupLanes<16>(kernel, data, len, idx + i, m, out);	break;
+			}
+		}
+		for ( ; i<cn; ++i)
+		{
+			sha256One(data[idx[i]], len[idx[i]], out + 32*idx[i]);
+		}
+	}
+}
+
+
+#endif // SHA256_BACKEND_HPP
@@ -0,0 +1,467 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	signDaemon.hpp
+ *
+ *	Implements the class template SignDaemon, which signs log
+ *	records sent over a Unix domain socket by many clients and
+ *	returns every client the hash chain of each of its records:
+ *		a)	A client sends records as lines ('\n' terminated)
+ *			on a stream connection.
+ *		b)	The records of all the clients are collected into
+ *			rounds, a round being closed once it has the given
+ *			number of records or the given time has passed
+ *			since its first record.
+ *		c)	Every round gets one Merkle tree, whose root is
+ *			signed once (see MerkleHasher::getTreeChains).
+ *		d)	Each record is answered on its connection, in the
+ *			order the records were sent, by the line
+ *
+ *			<nr>\t<round>\t<index>\t<signature>\t<chain>
+ *
+ *			where nr is the number of the record on the
+ *			connection (1-based), index its leaf in the tree
+ *			of the round (0-based) and chain the steps of the
+ *			hash chain as pos:hash separated by spaces, the
+ *			last one being -1:root.
+ *
+ *	One thread reads the socket and cuts the rounds, another
+ *	hashes and signs them. The closed rounds wait for signing
+ *	in a BoundedQueue: once it is full the reading stops until
+ *	a round is signed, thus when signing falls behind, the
+ *	clients are held back by their sockets filling up instead
+ *	of the daemon buffering without limit.
+ *	A client that does not read its answers holds the signing
+ *	up for at most SEND_TIMEOUT_MS, after which it is dropped.
+ */
+
+#ifndef SIGN_DAEMON_HPP
+#define SIGN_DAEMON_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "myHashInterface.hpp"
+#include "merkleHasher.hpp"
+#include "boundedQueue.hpp"
+
+
+// ---------------------------------- //
+// ----- SignDaemon DECLARATION ----- //
+// ---------------------------------- //
+template <class P>
+class SignDaemon
+{
+
+public:
+
+	typedef typename P::digest_t digest_t;
+
+	// --- A round is closed after round_records records or round_seconds --- //
+	// At most rounds_queued closed rounds wait for signing.
+	SignDaemon(const std::string& socket_path, size_t round_records, double round_seconds, size_t rounds_queued);
+
+	// --- Closes the socket and removes it --- //
+	~SignDaemon();
+
+	// --- Bind the socket, false (with error()) if it can not be done --- //
+	// A socket left behind by an earlier run is replaced.
+	bool open();
+	const std::string& error() const { return err; }
+
+	// --- Serve the clients until *stop is set --- //
+	// Every round is signed by sign(round, records, root), which
+	// returns the signature sent to the clients. The last round
+	// is closed and signed before returning.
+	template <class F>
+	void run(volatile sig_atomic_t* stop, F sign);
+
+	// --- Totals of the run --- //
+	uint64_t rounds() const { return round_count; }
+	uint64_t records() const { return record_count; }
+
+	// The longest record accepted, a longer one drops the client
+	static const size_t MAX_RECORD = 1 << 16;
+
+private:
+	SignDaemon(const SignDaemon&);
+	SignDaemon& operator=(const SignDaemon&);
+
+	typedef std::chrono::steady_clock clock;
+
+	// --- A connection, closed once neither side holds it --- //
+	struct Client
+	{
+		int fd;
+		uint64_t records;
+		std::string in;
+		std::atomic<bool> gone;
+
+		Client(int f) : fd(f), records(0), gone(false) {}
+		~Client() { ::close(fd); }
+	};
+
+	// --- A record: its client and its bytes in the round --- //
+	struct Record
+	{
+		std::shared_ptr<Client> client;
+		uint64_t nr;
+		size_t offset;
+		size_t len;
+	};
+
+	// --- The records of a round --- //
+	struct Round
+	{
+		uint64_t nr;
+		std::string data;
+		std::vector<Record> records;
+		clock::time_point start;
+	};
+
+	// --- Take the complete records of a client into the round --- //
+	// Returns false if the client sent a record that is too long.
+	bool takeRecords(const std::shared_ptr<Client>& c, BoundedQueue<Round*>& queue);
+
+	// --- Hand the current round over for signing and start the next --- //
+	// Blocks while the queue is full.
+	void closeRound(BoundedQueue<Round*>& queue);
+
+	// --- Hash and sign a round and answer its records --- //
+	template <class F>
+	void signRound(Round& r, F& sign);
+
+	// --- Write all of data, giving up on a client that does not read --- //
+	static bool sendAll(Client& c, const std::string& data);
+
+	std::string path;
+	size_t round_records;
+	double round_seconds;
+	size_t rounds_queued;
+	int listen_fd;
+	std::string err;
+
+	std::unique_ptr<Round> current;
+	std::atomic<uint64_t> round_count;
+	std::atomic<uint64_t> record_count;
+
+	// How long poll waits at most, so that a stop is noticed
+	static const int POLL_MS = 100;
+
+	// How long a reply may wait for a client to read
+	static const int SEND_TIMEOUT_MS = 1000;
+
+	static const size_t READ_CHUNK = 1 << 16;
+
+}; // END SIGNDAEMON DECLARATION
+
+
+
+// ------------------------------------- //
+// ----- SignDaemon IMPLEMENTATION ----- //
+// ------------------------------------- //
+
+
+// --- Constructor --- //
+template <class P>
+SignDaemon<P>::SignDaemon(const std::string& socket_path, size_t records, double seconds, size_t queued)
+	: path(socket_path), round_records((records < 1) ? 1 : records), round_seconds(seconds),
+	  rounds_queued((queued < 1) ? 1 : queued), listen_fd(-1), round_count(0), record_count(0)
+{
+} // END SignDaemon
+
+
+// --- Closes the socket and removes it --- //
+template <class P>
+SignDaemon<P>::~SignDaemon()
+{
+	if( listen_fd >= 0 )
+	{
+		::close(listen_fd);
+		::unlink(path.c_str());
+	}
+} // END ~SignDaemon
+
+
+// --- Bind the socket --- //
+template <class P>
+bool SignDaemon<P>::open()
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if( path.empty() || path.size() >= sizeof(addr.sun_path) )
+	{
+		err = "the socket path is empty or too long";
+		return false;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size());
+
+	// Only a socket is ever removed
+	struct stat st;
+	if( ::stat(path.c_str(), &st) == 0 )
+	{
+		if( !S_ISSOCK(st.st_mode) )
+		{
+			err = path + " exists and is not a socket";
+			return false;
+		}
+		::unlink(path.c_str());
+	}
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( fd < 0 )
+	{
+		err = std::string("socket: ") + strerror(errno);
+		return false;
+	}
+	if( ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0 )
+	{
+		err = path + ": " + strerror(errno);
+		::close(fd);
+		return false;
+	}
+	listen_fd = fd;
+	return true;
+} // END open
+
+
+// --- Serve the clients until *stop is set --- //
+// This thread accepts the clients, reads their records and
+// closes the rounds, a second thread signs them.
+template <class P>
+template <class F>
+void SignDaemon<P>::run(volatile sig_atomic_t* stop, F sign)
+{
+	BoundedQueue<Round*> queue(rounds_queued);
+	std::thread signer([&]()
+		{
+			Round* r;
+			while( queue.pop(r) )
+			{
+				signRound(*r, sign);
+				delete r;
+			}
+		});
+
+	current.reset(new Round());
+	current->nr = 1;
+	std::vector< std::shared_ptr<Client> > clients;
+	std::vector<pollfd> fds;
+	std::vector<char> buf(READ_CHUNK);
+	while( !*stop )
+	{
+		fds.resize(clients.size() + 1);
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (size_t i=0; i<clients.size(); ++i)
+		{
+			fds[i+1].fd = clients[i]->fd;
+			fds[i+1].events = POLLIN;
+		}
+
+		// Wake up for the deadline of the open round
+		int timeout = POLL_MS;
+		if( !current->records.empty() )
+		{
+			double left = round_seconds - std::chrono::duration<double>(clock::now() - current->start).count();
+			int left_ms = int(left * 1000 + 1);
+			timeout = (left_ms < 0) ? 0 : (left_ms < timeout) ? left_ms : timeout;
+		}
+		int ready = ::poll(fds.data(), fds.size(), timeout);
+		if( ready < 0 && errno != EINTR )
+		{
+			break;
+		}
+
+		// Read what the clients sent, dropping those that
+		// are gone (in either direction)
+		size_t kept = 0;
+		for (size_t i=0; i<clients.size(); ++i)
+		{
+			std::shared_ptr<Client>& c = clients[i];
+			bool alive = !c->gone;
+			if( alive && ready > 0 && (fds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) )
+			{
+				ssize_t n = ::read(c->fd, buf.data(), buf.size());
+				if( n > 0 )
+				{
+					c->in.append(buf.data(), n);
+					alive = takeRecords(c, queue);
+				}
+				else if( n == 0 || (errno != EAGAIN && errno != EINTR) )
+				{
+					alive = false;
+				}
+			}
+			if( alive )
+			{
+				clients[kept++].swap(c);
+			}
+		}
+		clients.resize(kept);
+
+		// Accept the new clients
+		if( ready > 0 && (fds[0].revents & POLLIN) )
+		{
+			int fd;
+			while( (fd = ::accept4(listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 )
+			{
+				clients.push_back( std::make_shared<Client>(fd) );
+			}
+		}
+
+		if( !current->records.empty() &&
+			std::chrono::duration<double>(clock::now() - current->start).count() >= round_seconds )
+		{
+			closeRound(queue);
+		}
+	}
+
+	// Sign the last round and wait for the signer
+	closeRound(queue);
+	queue.close();
+	signer.join();
+	current.reset();
+} // END run
+
+
+// --- Take the complete records of a client into the round --- //
+template <class P>
+bool SignDaemon<P>::takeRecords(const std::shared_ptr<Client>& c, BoundedQueue<Round*>& queue)
+{
+	size_t begin = 0;
+	size_t end;
+	while( (end = c->in.find('\n', begin)) != std::string::npos )
+	{
+		if( current->records.empty() )
+		{
+			current->start = clock::now();
+		}
+		Record rec;
+		rec.client = c;
+		rec.nr = ++c->records;
+		rec.offset = current->data.size();
+		rec.len = end - begin;
+		current->data.append(c->in, begin, end - begin);
+		current->records.push_back(rec);
+		begin = end + 1;
+		if( current->records.size() >= round_records )
+		{
+			closeRound(queue);
+		}
+	}
+	c->in.erase(0, begin);
+	return c->in.size() <= MAX_RECORD;
+} // END takeRecords
+
+
+// --- Hand the current round over for signing and start the next --- //
+template <class P>
+void SignDaemon<P>::closeRound(BoundedQueue<Round*>& queue)
+{
+	if( current->records.empty() )
+	{
+		return;
+	}
+	uint64_t nr = current->nr;
+	queue.push(current.release());
+	current.reset(new Round());
+	current->nr = nr + 1;
+} // END closeRound
+
+
+// --- Hash and sign a round and answer its records --- //
+// The answers to a client are sent in one go, in the order
+// of its records.
+template <class P>
+template <class F>
+void SignDaemon<P>::signRound(Round& r, F& sign)
+{
+	size_t n = r.records.size();
+	std::vector<const char*> line(n);
+	std::vector<size_t> len(n);
+	std::vector<digest_t> leaves(n);
+	for (size_t i=0; i<n; ++i)
+	{
+		line[i] = r.data.data() + r.records[i].offset;
+		len[i] = r.records[i].len;
+	}
+	P::leaves(line.data(), len.data(), n, leaves.data());
+
+	MerkleHasher<P> hasher;
+	std::string root;
+	std::vector<hash_chain_t> chains = hasher.getTreeChains(leaves, root);
+	std::string sig = sign(r.nr, uint64_t(n), root);
+
+	std::map< Client*, std::string > replies;
+	for (size_t i=0; i<n; ++i)
+	{
+		const Record& rec = r.records[i];
+		if( rec.client->gone )
+		{
+			continue;
+		}
+		std::string& out = replies[rec.client.get()];
+		out += std::to_string(rec.nr) + "\t" + std::to_string(r.nr) + "\t" + std::to_string(i) + "\t" + sig + "\t";
+		for (size_t s=0; s<chains[i].size(); ++s)
+		{
+			out += ((s > 0) ? " " : "") + std::to_string(chains[i][s].first) + ":" + chains[i][s].second;
+		}
+		out += "\n";
+	}
+	for (typename std::map< Client*, std::string >::iterator it = replies.begin(); it != replies.end(); ++it)
+	{
+		sendAll(*it->first, it->second);
+	}
+	round_count++;
+	record_count += n;
+} // END signRound
+
+
+// --- Write all of data, giving up on a client that does not read --- //
+// A client given up on is shut down, which the reading thread
+// sees as the end of the connection.
+template <class P>
+bool SignDaemon<P>::sendAll(Client& c, const std::string& data)
+{
+	size_t sent = 0;
+	while( sent < data.size() )
+	{
+		ssize_t n = ::send(c.fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if( n > 0 )
+		{
+			sent += n;
+			continue;
+		}
+		if( n < 0 && (errno == EAGAIN || errno == EINTR) )
+		{
+			pollfd p = { c.fd, POLLOUT, 0 };
+			if( ::poll(&p, 1, SEND_TIMEOUT_MS) > 0 && !(p.revents & (POLLERR | POLLHUP)) )
+			{
+				continue;
+			}
+		}
+		c.gone = true;
+		::shutdown(c.fd, SHUT_RDWR);
+		return false;
+	}
+	return true;
+} // END sendAll
+
+
+#endif // SIGN_DAEMON_HPP
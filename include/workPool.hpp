@@ -0,0 +1,226 @@
+/**
+ *	Author:	Madis Ollikainen
+ *	File:	workPool.hpp
+ *
+ *	Implements the WorkPool class, a pool of threads running
+ *	tasks of very different sizes (whole small files, pieces
+ *	of large files) with work stealing:
+ *		a)	Every worker has its own deque of tasks. It takes
+ *			its tasks from the back, thus the tasks a task
+ *			submits are run next, while they are hot.
+ *		b)	An idle worker steals from the front of the other
+ *			deques, i.e. the oldest (and usually largest) work.
+ *		c)	Tasks submitted from outside the pool are dealt
+ *			out to the deques in turn.
+ *
+ *	Tasks may submit more tasks. wait() returns once all the
+ *	submitted tasks, also those submitted by tasks, are done.
+ */
+
+#ifndef WORK_POOL_HPP
+#define WORK_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+
+// -------------------------------- //
+// ----- WorkPool DECLARATION ----- //
+// -------------------------------- //
+class WorkPool
+{
+
+public:
+
+	typedef std::function<void()> task_t;
+
+	// --- Start the given number of workers --- //
+	WorkPool(unsigned threads);
+
+	// --- Waits for the tasks and stops the workers --- //
+	~WorkPool();
+
+	// --- Add a task, from any thread --- //
+	void submit(const task_t& task);
+
+	// --- Wait until all the submitted tasks are done --- //
+	void wait();
+
+	unsigned size() const { return workers.size(); }
+
+private:
+	WorkPool(const WorkPool&);
+	WorkPool& operator=(const WorkPool&);
+
+	// --- The deque of a worker --- //
+	struct Worker
+	{
+		std::mutex mtx;
+		std::deque<task_t> tasks;
+	};
+
+	// --- The worker thread --- //
+	void work(unsigned self);
+
+	// --- Take a task from the own deque or steal one --- //
+	bool take(unsigned self, task_t& task);
+
+	// --- The index of the calling worker in this pool, -1 outside --- //
+	int workerIndex() const
+	{
+		return (current().first == this) ? current().second : -1;
+	}
+	static std::pair<const WorkPool*, int>& current()
+	{
+		static thread_local std::pair<const WorkPool*, int> worker(0, -1);
+		return worker;
+	}
+
+	std::vector< std::unique_ptr<Worker> > workers;
+	std::vector<std::thread> threads;
+
+	// Tasks in the deques and tasks not yet finished
+	std::atomic<long> queued;
+	std::atomic<size_t> pending;
+	std::atomic<unsigned> next;
+
+	// Idle workers sleep on wake, wait() on done
+	std::mutex sleep_mtx;
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool stopping;
+
+}; // END WORKPOOL DECLARATION
+
+
+
+// ----------------------------------- //
+// ----- WorkPool IMPLEMENTATION ----- //
+// ----------------------------------- //
+
+
+// --- Start the given number of workers --- //
+inline WorkPool::WorkPool(unsigned n) : queued(0), pending(0), next(0), stopping(false)
+{
+	n = (n < 1) ? 1 : n;
+	for (unsigned w=0; w<n; ++w)
+	{
+		workers.push_back( std::unique_ptr<Worker>(new Worker()) );
+	}
+	for (unsigned w=0; w<n; ++w)
+	{
+		threads.push_back( std::thread(&WorkPool::work, this, w) );
+	}
+} // END WorkPool
+
+
+// --- Waits for the tasks and stops the workers --- //
+inline WorkPool::~WorkPool()
+{
+	wait();
+	{
+		std::unique_lock<std::mutex> lock(sleep_mtx);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t w=0; w<threads.size(); ++w)
+	{
+		threads[w].join();
+	}
+} // END ~WorkPool
+
+
+// --- Add a task, from any thread --- //
+// A worker puts the task on its own deque.
+inline void WorkPool::submit(const task_t& task)
+{
+	int self = workerIndex();
+	unsigned w = (self >= 0) ? self : next++ % workers.size();
+	pending++;
+	{
+		std::unique_lock<std::mutex> lock(workers[w]->mtx);
+		workers[w]->tasks.push_back(task);
+	}
+	{
+		std::unique_lock<std::mutex> lock(sleep_mtx);
+		queued++;
+	}
+	wake.notify_one();
+} // END submit
+
+
+// --- Wait until all the submitted tasks are done --- //
+inline void WorkPool::wait()
+{
+	std::unique_lock<std::mutex> lock(sleep_mtx);
+	done.wait(lock, [this]{ return pending == 0; });
+} // END wait
+
+
+// --- Take a task from the own deque or steal one --- //
+inline bool WorkPool::take(unsigned self, task_t& task)
+{
+	{
+		Worker& own = *workers[self];
+		std::unique_lock<std::mutex> lock(own.mtx);
+		if( !own.tasks.empty() )
+		{
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	for (size_t k=1; k<workers.size(); ++k)
+	{
+		Worker& victim = *workers[(self + k) % workers.size()];
+		std::unique_lock<std::mutex> lock(victim.mtx);
+		if( !victim.tasks.empty() )
+		{
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+} // END take
+
+
+// --- The worker thread --- //
+inline void WorkPool::work(unsigned self)
+{
+	current() = std::make_pair(this, int(self));
+	task_t task;
+	while( true )
+	{
+		{
+			std::unique_lock<std::mutex> lock(sleep_mtx);
+			wake.wait(lock, [this]{ return queued > 0 || stopping; });
+			if( queued <= 0 )
+			{
+				return;
+			}
+		}
+		if( !take(self, task) )
+		{
+			// Another worker got it first
+			continue;
+		}
+		queued--;
+		task();
+		task = task_t();
+		if( --pending == 0 )
+		{
+			std::unique_lock<std::mutex> lock(sleep_mtx);
+			done.notify_all();
+		}
+	}
+} // END work
+
+
+#endif // WORK_POOL_HPP
@@ -38,3 +38,188 @@ do
 done
 
 
+
+
+# ----------------------------------------------------------- #
+# The modes of the (SHA256) hasher are checked against plain 
+# signing (-i) and hash chain extraction (--chain-lines) of the 
+# same logs: every mode must give the same root and the same 
+# chains. Each check prints PASS or FAIL, and the script exits 
+# with the number of failed checks.
+# ----------------------------------------------------------- #
+echo ''
+echo 'Checking the modes of the hasher'
+echo ''
+
+H=./build/hasher
+T=test_output/modes
+rm -rf ${T}
+mkdir -p ${T}/ref
+FAILED=0
+
+# check <name> <command..>: the command must succeed
+check()
+{
+	if "${@:2}" > /dev/null 2>&1
+	then
+		echo "PASS ${1}"
+	else
+		echo "FAIL ${1}"
+		FAILED=$((FAILED+1))
+	fi
+}
+
+# check_fails <name> <command..>: the command must fail
+check_fails()
+{
+	if "${@:2}" > /dev/null 2>&1
+	then
+		echo "FAIL ${1} (not refused)"
+		FAILED=$((FAILED+1))
+	else
+		echo "PASS ${1} (refused)"
+	fi
+}
+
+# tamper <file> <line>: flip the last hex digit of the line
+tamper()
+{
+	awk -v N=${2} 'NR == N { d = substr($0, length($0)); $0 = substr($0, 1, length($0) - 1) (d == "0" ? "1" : "0") } { print }' ${1}
+}
+
+# same_chains <dir> <prefix>: the chains of the LINES in 
+# <dir>/<prefix>N must be the reference ones
+LINES=(3 7 1546)
+same_chains()
+{
+	for n in ${LINES[@]}
+	do
+		cmp -s ${T}/ref/acc.log.hash_chain_line_${n} ${1}/${2}${n} || return 1
+	done
+}
+
+# The reference root and chains
+L=${T}/acc.log
+cp example_logs/access_log_example ${L}
+${H} -i ${L} --chain-lines 3,7,1546 --sign > /dev/null
+mv ${L}.signature ${L}.hash_chain_line_* ${T}/ref/
+sed -n '3p;7p;1546p' ${L} > ${T}/lines
+
+# Chains by content are those by line number
+${H} -i ${L} --chain ${T}/lines --sign > /dev/null
+for k in 0 1 2
+do
+	mv ${L}.hash_chain_$((k+1)) ${L}.by_content_${LINES[k]}
+done
+check "chain by content" same_chains ${T} acc.log.by_content_
+check "chain signature" cmp ${L}.signature ${T}/ref/acc.log.signature
+
+# Verifying the chains, and refusing a tampered one
+check "verify" ${H} -i ${L} --verify ${T}/ref --signature ${T}/ref/acc.log.signature
+mkdir -p ${T}/bad
+tamper ${T}/ref/acc.log.hash_chain_line_7 2 > ${T}/bad/acc.log.hash_chain_line_7
+check_fails "verify tampered chain" ${H} -i ${L} --verify ${T}/bad --signature ${T}/ref/acc.log.signature
+
+# Proof containers
+${H} -i ${L} --chain-lines 3,7,1546 --proofs > /dev/null
+check "proof container" ${H} -i ${L} --verify ${L}.hash_chains_line
+${H} -i ${L} --export-proofs ${L}.hash_chains_line > ${T}/exported
+check "export proofs" grep -q "$(sed -n 2p ${T}/ref/acc.log.hash_chain_line_1546)" ${T}/exported
+
+# Compressed logs and a cut off one
+gzip -c ${L} > ${T}/gz.log
+${H} -i ${T}/gz.log > /dev/null
+check "gzip" cmp ${T}/gz.log.signature ${T}/ref/acc.log.signature
+N=$(wc -l < ${L})
+check "lines past the end" sh -c "${H} -i ${T}/gz.log --chain-lines $((N-1))-$((N+5)) | grep -q 'Line numbers $((N+1)) to $((N+5)) are not'"
+head -c 2000 ${T}/gz.log > ${T}/cut.log
+check_fails "truncated gzip" ${H} -i ${T}/cut.log
+if grep -q '^CFLAGS.*-DHAVE_ZSTD' Makefile && command -v zstd > /dev/null
+then
+	zstd -q -c ${L} > ${T}/zst.log
+	${H} -i ${T}/zst.log > /dev/null
+	check "zstd" cmp ${T}/zst.log.signature ${T}/ref/acc.log.signature
+fi
+
+# Resuming after the first 1000 lines
+head -n 1000 ${L} > ${T}/res.log
+${H} -i ${T}/res.log --resume > /dev/null
+tail -n +1001 ${L} >> ${T}/res.log
+${H} -i ${T}/res.log --resume > /dev/null
+check "resume" cmp ${T}/res.log.signature ${T}/ref/acc.log.signature
+sed -i '/^slot/d' ${T}/res.log.state
+check_fails "resume without the forest" ${H} -i ${T}/res.log --resume
+
+# Threads, split and direct input on a log of over 8 MB
+awk 'BEGIN { for (i=0; i<400000; i++) printf "line %d of the large log\n", i }' > ${T}/big.log
+${H} -i ${T}/big.log > /dev/null
+mv ${T}/big.log.signature ${T}/ref/big.log.signature
+${H} -i ${T}/big.log --threads 4 > /dev/null
+check "threads" cmp ${T}/big.log.signature ${T}/ref/big.log.signature
+${H} -i ${T}/big.log --direct > /dev/null
+check "direct" cmp ${T}/big.log.signature ${T}/ref/big.log.signature
+${H} -i ${T}/big.log --threads 4 --direct > /dev/null
+check "threads direct" cmp ${T}/big.log.signature ${T}/ref/big.log.signature
+
+# Following the log in blocks of 1000 lines
+head -n 1000 ${L} > ${T}/first.log
+${H} -i ${T}/first.log > /dev/null
+cp ${L} ${T}/follow.log
+${H} -i ${T}/follow.log --follow --block-lines 1000 > /dev/null &
+sleep 1
+kill -INT $!
+wait $!
+check "follow" test "$(head -n 1 ${T}/follow.log.blocks | cut -f5)" = "$(cat ${T}/first.log.signature)"
+
+# A batch of two logs
+mkdir -p ${T}/batch
+cp ${L} ${T}/batch/a.log
+cp ${T}/first.log ${T}/batch/b.log
+${H} --batch ${T}/batch --batch-name ${T}/batch > /dev/null
+check "batch" test "$(head -n 1 ${T}/batch.batch | cut -f3)" = "$(cat ${T}/ref/acc.log.signature)"
+check "batch chain" ${H} -i ${T}/batch --verify ${T}/batch.hash_chain_file_1 --signature ${T}/batch.signature
+
+# The index and the lookup table
+${H} -i ${L} --lookup > /dev/null
+check "index" cmp ${L}.signature ${T}/ref/acc.log.signature
+mkdir -p ${T}/index ${T}/lookup
+${H} -i ${L} --index-chain 3,7,1546 > /dev/null
+mv ${L}.hash_chain_line_* ${T}/index/
+check "index chain" same_chains ${T}/index acc.log.hash_chain_line_
+${H} -i ${L} --lookup-chain ${T}/lines > /dev/null
+for k in 0 1 2
+do
+	mv ${L}.hash_chain_$((k+1)) ${T}/lookup/chain_${LINES[k]}
+done
+check "lookup chain" same_chains ${T}/lookup chain_
+
+# Serving the chains from a resident process
+printf "%s\n" ${LINES[@]} | ${H} -i ${L} --serve 2> /dev/null | awk -v RS= -v D=${T} '{ print > (D "/served_" NR) }'
+for k in 0 1 2
+do
+	mv ${T}/served_$((k+1)) ${T}/served${LINES[k]}
+done
+check "serve" same_chains ${T} served
+
+# Consistency of the log with its first 1000 lines
+${H} -i ${L} --consistency 1000 > /dev/null
+check "consistency" ${H} -i ${L} --verify-consistency ${L}.consistency_1000 --old-signature ${T}/first.log.signature
+check_fails "wrong old signature" ${H} -i ${L} --verify-consistency ${L}.consistency_1000 --old-signature ${T}/ref/acc.log.signature
+
+# The multi-proof of a range and single lines
+${H} -i ${L} --multi-proof 2-5,9,1546 > /dev/null
+check "multi-proof" ${H} -i ${L} --verify-multi-proof ${L}.multi_proof --verify-lines ${L}
+tamper ${L}.multi_proof $(wc -l < ${L}.multi_proof) > ${T}/bad.multi_proof
+check_fails "tampered multi-proof" ${H} -i ${L} --verify-multi-proof ${T}/bad.multi_proof
+
+# The signing daemon, whose answered chains are checked by the load client
+make -s sign_load > /dev/null
+./build/signd -s ${T}/signd.sock > /dev/null &
+sleep 0.5
+check "signd" ./build/sign_load ${T}/signd.sock 2 100 8
+kill $!
+wait $!
+
+echo ''
+echo "${FAILED} checks failed"
+exit ${FAILED}
@@ -20,7 +20,10 @@
  *	-v 	(--version)		Prints the code version
  *						defined by the git version.
  *
- *	-i 	<file_name>		The log file (REQUIRED)
+ *	-i 	<file_name>		The log file (REQUIRED). Files
+ *						compressed with gzip (or zstd, if
+ *						compiled in) are decompressed
+ *						while hashing.
  *
  *	--sign 				If given, then the log file 
  *						will be signed. (DEFAULT)
@@ -28,6 +31,116 @@
  *						corresponding to <file>
  *						will be retrived.
  *	--leaves 			If given, save the leafs into <file_name> 
+ *	--leaves-binary		As --leaves, but the leaves are saved
+ *						as binary digests (32 bytes each).
+ *	--threads <N>		Hash the leaves on N threads.
+ *	--direct			If given, the log file is read past
+ *						the page cache (O_DIRECT with
+ *						io_uring read-ahead), for logs
+ *						larger than the memory.
+ *	--compat			If given, internal nodes are hashed 
+ *						over hex strings as in the original
+ *						version, so that old roots are
+ *						reproduced.
+ *	--hash <name>		The hash function: sha256 (DEFAULT),
+ *						sha512-256 or blake2s-256. The same
+ *						hash must be given for all the runs
+ *						on a log file.
+ *	--chain-lines <N,M,..>	If given, the hash chains of the
+ *						given line numbers are retrived
+ *						(also for duplicate lines).
+ *	--index				If given, the whole Merkle tree is
+ *						saved into <log_file>.index while
+ *						signing.
+ *	--index-chain <N,M,..>	If given, the hash chains of the
+ *						given line numbers are read from
+ *						<log_file>.index without hashing
+ *						the log file.
+ *	--lookup			As --index, and a lookup table from
+ *						the leaves to their line numbers is
+ *						also saved into <log_file>.lookup.
+ *	--lookup-chain <file_name>	As --chain, but the lines of
+ *						<file_name> are found through
+ *						<log_file>.lookup and their hash
+ *						chains read from the index, without
+ *						hashing the log file.
+ *	--consistency <M>	If given, the consistency proof of
+ *						the first M lines (the log when it
+ *						was signed before) is read from
+ *						<log_file>.index and written into
+ *						<log_file>.consistency_<M>.
+ *	--verify-consistency <file>	If given, the consistency
+ *						proof <file> is verified: its new
+ *						root against the signature and its
+ *						old root against --old-signature.
+ *	--old-signature <file>	The signature of the first M lines,
+ *						compulsory with --verify-consistency.
+ *	--multi-proof <N-M,..>	If given, a single proof of all
+ *						the given lines (ranges N-M or line
+ *						numbers) is read from <log_file>.index
+ *						and written into <log_file>.multi_proof,
+ *						with each shared node only once.
+ *	--verify-multi-proof <file>	If given, the multi-proof
+ *						<file> is verified against the
+ *						signature (and --verify-lines).
+ *	--resume			If given, the signing continues from
+ *						<log_file>.state and only the lines
+ *						appended since the last run are
+ *						hashed. The state is then updated.
+ *	--follow			If given, the log file is followed as
+ *						it grows and signed in blocks, whose
+ *						records go to <log_file>.blocks.
+ *						Continues after the last record.
+ *						Runs until interrupted (Ctrl-C).
+ *	--block-lines <N>	Close a block after N lines.
+ *	--block-seconds <T>	Close a block T seconds after its
+ *						first line (DEFAULT 10, if neither
+ *						limit is given).
+ *	--stats				If given, counters and timings of
+ *						the run are printed as JSON into
+ *						stderr (see merkleStats.hpp).
+ *	--verify <path>		If given, the hash chains in the
+ *						directory (or the single chain file
+ *						or proof container) <path> are 
+ *						verified against the signature of
+ *						the log file.
+ *	--verify-lines <file>	If given with --verify, the leaf of
+ *						every chain is also checked against
+ *						its line in <file>, the line number
+ *						being the one in the chain file name.
+ *	--signature <file>	The signature to verify against.
+ *						(DEFAULT <log_file>.signature)
+ *	--proofs			If given, the hash chains are written
+ *						into a single binary proof container
+ *						(<log_file>.hash_chains for --chain,
+ *						<log_file>.hash_chains_line for
+ *						--chain-lines and --index-chain)
+ *						instead of a text file per chain.
+ *						--verify accepts these containers.
+ *	--export-proofs <file>	If given, the proof container
+ *						<file> is printed as text.
+ *	--batch <files>		If given, the log files <files> (a
+ *						directory, a glob pattern or @ and
+ *						a file listing them) are signed
+ *						together instead of -i: their roots
+ *						are the leaves of a second-level
+ *						tree, whose root is signed into
+ *						<name>.signature. The roots go to
+ *						<name>.batch and the chain of each
+ *						file root to <name>.hash_chain_file_<N>
+ *						(or the container <name>.hash_chains_file
+ *						with --proofs). Uses all cores unless
+ *						--threads is given.
+ *	--batch-name <name>	The name of the batch outputs.
+ *						(DEFAULT batch)
+ *	--serve				If given, hash chains are served for
+ *						line numbers read from stdin (N or
+ *						N,M,..; also "root" and "stats"),
+ *						each chain written to stdout and
+ *						ended by an empty line. Subtree roots
+ *						are kept in a cache between requests.
+ *	--cache-mb <M>		The memory budget of the --serve
+ *						cache. (DEFAULT 64)
  *
  */
 
@@ -35,50 +148,1664 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cerrno>
+
+#include <thread>
+
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
 
 #include "readcmd.hpp"
 #include "myHashInterface.hpp"
 #include "mySignatureInterface.hpp"
 #include "merkleHasher.hpp"
+#include "merkleProofs.hpp"
+#include "merkleBatch.hpp"
+#include "merkleQuery.hpp"
+#include "merkleStats.hpp"
+
+
+
+
+// --- A range of line numbers (1-based), the first and the last line --- //
+typedef std::pair<uint64_t, uint64_t> line_range_t;
+
+// --- The commandline options --- //
+struct hasher_options_t
+{
+	//  Whether to generate the signature or not. 
+	// If no other option is given, the signature is created.
+	bool SIGN;			
+	
+	//  Whether to generate hash chains or not.
+	bool HASH_CHAIN;
+
+	//  Whether to save the leaves (hashes of lines) or not,
+	// and whether as binary digests instead of hex lines.
+	bool LEAVES;
+	bool LEAVES_BINARY;
+
+	// The path to the log file
+	std::string log_file;
+
+	// The file name for the log files signature.
+	// At the moment will be log_file + ".signature"
+	std::string log_signature_file;
+
+	// The path to the file which holds the lines
+	// for which to extract the hash chains
+	std::string hash_chain_lines_file;
+
+	// Whether to generate hash chains by line number,
+	// and the line numbers (1-based)
+	bool CHAIN_LINES;
+	std::vector<line_range_t> chain_line_ranges;
+
+	// The file where to store the leaves.
+	// At the moment will be log_file + ".leaves"
+	std::string leaves_file;
+
+	// Whether to use the compatibility mode, which
+	// reproduces the original hex-of-hex tree roots.
+	bool COMPAT;
+
+	// The name of the hash function
+	std::string hash_name;
+
+	// The number of threads used for hashing the leaves
+	unsigned THREADS;
+
+	// Whether to read the log files past the page cache
+	bool DIRECT;
+
+	// Whether to save the Merkle tree index while signing
+	bool INDEX;
+
+	// Whether to read hash chains from the index
+	bool INDEX_CHAIN;
+
+	// The file where to store the index.
+	// At the moment will be log_file + ".index"
+	std::string index_file;
+
+	// The line numbers (1-based) of the hash
+	// chains to read from the index
+	std::vector<line_range_t> index_chain_ranges;
+
+	// Whether to save the lookup table of the leaves with the
+	// index, and whether to find the hash chains of the lines
+	// in a file through it
+	bool LOOKUP;
+	bool LOOKUP_CHAIN;
+
+	// The file where to store the lookup table.
+	// At the moment will be log_file + ".lookup"
+	std::string lookup_file;
+
+	// The file of the lines to find through the lookup table
+	std::string lookup_chain_lines_file;
+
+	// Whether to write the consistency proof of the first 
+	// lines of the log, and the number of these lines
+	bool CONSISTENCY;
+	uint64_t consistency_lines;
+
+	// Whether to verify a consistency proof, the proof file
+	// and the signature of its old root ("" for none)
+	bool VERIFY_CONSISTENCY;
+	std::string consistency_file;
+	std::string old_signature_file;
+
+	// Whether to write the multi-proof of some lines and
+	// the line numbers (1-based), and whether to verify 
+	// a multi-proof and its file
+	bool MULTI_PROOF;
+	std::vector<line_range_t> multi_proof_ranges;
+	bool VERIFY_MULTI_PROOF;
+	std::string multi_proof_file;
+
+	// Whether to continue signing from the saved state
+	bool RESUME;
+
+	// The file where the state is kept.
+	// At the moment will be log_file + ".state"
+	std::string state_file;
+
+	// Whether to follow the log file and sign it in blocks
+	bool FOLLOW;
+
+	// The file where the block records are written.
+	// At the moment will be log_file + ".blocks"
+	std::string blocks_file;
+
+	// The block size limits, 0 for no limit
+	uint64_t block_lines;
+	double block_seconds;
+
+	// Whether to print the statistics of the run
+	bool STATS;
+
+	// Whether to verify hash chains, the directory or
+	// file of the chains and the file of the lines 
+	// to check the leaves against ("" for none)
+	bool VERIFY;
+	std::string verify_chains;
+	std::string verify_lines_file;
+
+	// Whether to write the hash chains into proof containers
+	bool PROOFS;
+
+	// Whether to print a proof container as text, and its path
+	bool EXPORT_PROOFS;
+	std::string export_proofs_file;
+
+	// Whether to sign many log files together, the 
+	// files given and the name of the outputs
+	bool BATCH;
+	std::string batch_files;
+	std::string batch_name;
+
+	// Whether to serve hash chains from stdin, and the
+	// memory budget of the node cache in MB
+	bool SERVE;
+	size_t cache_mb;
+
+	hasher_options_t() : SIGN(false), HASH_CHAIN(false), LEAVES(false), LEAVES_BINARY(false), CHAIN_LINES(false), COMPAT(false), hash_name("sha256"), THREADS(1), DIRECT(false), INDEX(false), INDEX_CHAIN(false), LOOKUP(false), LOOKUP_CHAIN(false), CONSISTENCY(false), consistency_lines(0), VERIFY_CONSISTENCY(false), MULTI_PROOF(false), VERIFY_MULTI_PROOF(false), RESUME(false),
+		FOLLOW(false), block_lines(0), block_seconds(0), STATS(false), VERIFY(false), PROOFS(false), EXPORT_PROOFS(false), BATCH(false), batch_name("batch"), SERVE(false), cache_mb(64) {}
+};
+
+
+// --- Write a hash chain into a file, one step per line --- //
+static void writeHashChain(const std::string& hash_chain_file, const hash_chain_t& hash_chain_out)
+{
+	std::ofstream hc_out(hash_chain_file);
+	if(hc_out.is_open())
+	{
+		for (uint i=0; i<hash_chain_out.size(); ++i)
+		{
+			hc_out << hash_chain_out[i].first << "\t" << hash_chain_out[i].second << std::endl; 
+		}
+	}
+	hc_out.close();
+}
+
+// --- Where the hash chains go: a text file each or a proof container --- //
+// Chain id goes either into the file <text_prefix><id> or into the 
+// container proofs_file, which is only complete after close.
+template <class P>
+class ChainOutput
+{
+public:
+	ChainOutput(bool proofs, const std::string& text_prefix, const std::string& proofs_file) 
+		: PROOFS(proofs), prefix(text_prefix), file(proofs_file) {}
+
+	// --- Returns false if the container can not be written --- //
+	bool open()
+	{
+		return !PROOFS || writer.open(file);
+	}
+
+	void write(uint64_t id, const hash_chain_t& chain)
+	{
+		if(PROOFS)
+		{
+			writer.add(id, chain);
+		}
+		else
+		{
+			writeHashChain(prefix + std::to_string(id), chain);
+		}
+	}
+
+	// --- Returns false if the container could not be written --- //
+	bool close(const std::string& root)
+	{
+		typename P::digest_t d;
+		return !PROOFS || (P::fromString(root, d) && writer.finish(d));
+	}
+
+	const std::string& proofsFile() const { return file; }
+
+private:
+	bool PROOFS;
+	std::string prefix;
+	std::string file;
+	MerkleProofsWriter<P> writer;
+};
+
+// --- Read a hash chain written by writeHashChain --- //
+static bool readHashChain(const std::string& hash_chain_file, hash_chain_t& hash_chain_in)
+{
+	std::ifstream hc_in(hash_chain_file);
+	if(!hc_in.is_open())
+	{
+		return false;
+	}
+	std::string line;
+	while( std::getline(hc_in, line) )
+	{
+		size_t tab = line.find('\t');
+		if( tab == std::string::npos )
+		{
+			return false;
+		}
+		hash_chain_in.push_back( std::make_pair(atoi(line.c_str()), line.substr(tab + 1)) );
+	}
+	return true;
+}
+
+// --- The root covered by a signature file, "" if it can not be verified --- //
+static std::string readSignedRoot(const std::string& signature_file)
+{
+	std::string sign;
+	std::ifstream signature_in(signature_file);
+	std::getline(signature_in, sign);
+	signature_in.close();
+	return signedRoot(sign);
+}
+
+// --- The hash chain files of a directory, or the file itself --- //
+// The files are those named *.hash_chain_*, in the order of their 
+// names, shorter names first so that numbers are in order.
+static std::vector<std::string> listHashChains(const std::string& path)
+{
+	std::vector<std::string> files;
+	struct stat st;
+	if( stat(path.c_str(), &st) != 0 )
+	{
+		return files;
+	}
+	if( !S_ISDIR(st.st_mode) )
+	{
+		files.push_back(path);
+		return files;
+	}
+	DIR* dir = opendir(path.c_str());
+	if( dir == 0 )
+	{
+		return files;
+	}
+	while( struct dirent* entry = readdir(dir) )
+	{
+		std::string name = entry->d_name;
+		if( name.find(".hash_chain_") != std::string::npos )
+		{
+			files.push_back(path + "/" + name);
+		}
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end(), [](const std::string& a, const std::string& b)
+		{
+			return a.size() != b.size() ? a.size() < b.size() : a < b;
+		});
+	return files;
+}
+
+// --- The line number at the end of a hash chain file name, 0 if none --- //
+static uint64_t chainLineNumber(const std::string& hash_chain_file)
+{
+	size_t us = hash_chain_file.rfind('_');
+	return (us == std::string::npos) ? 0 : strtoull(hash_chain_file.c_str() + us + 1, 0, 10);
+}
+
+// --- The log files of a batch --- //
+// Either @ and a file with one path per line, a directory (its 
+// regular files in the order of their names, hidden ones left out)
+// or a glob pattern.
+static std::vector<std::string> listBatchFiles(const std::string& spec)
+{
+	std::vector<std::string> files;
+	struct stat st;
+	if( !spec.empty() && spec[0] == '@' )
+	{
+		std::ifstream list(spec.substr(1));
+		std::string line;
+		while( std::getline(list, line) )
+		{
+			if( !line.empty() )
+			{
+				files.push_back(line);
+			}
+		}
+	}
+	else if( stat(spec.c_str(), &st) == 0 && S_ISDIR(st.st_mode) )
+	{
+		DIR* dir = opendir(spec.c_str());
+		while( struct dirent* entry = (dir ? readdir(dir) : 0) )
+		{
+			std::string path = spec + "/" + entry->d_name;
+			if( entry->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) )
+			{
+				files.push_back(path);
+			}
+		}
+		if( dir )
+		{
+			closedir(dir);
+		}
+		std::sort(files.begin(), files.end());
+	}
+	else
+	{
+		glob_t found;
+		if( glob(spec.c_str(), 0, 0, &found) == 0 )
+		{
+			for (size_t i=0; i<found.gl_pathc; ++i)
+			{
+				files.push_back(found.gl_pathv[i]);
+			}
+		}
+		globfree(&found);
+	}
+	return files;
+}
+
+// --- Parse a line number, returns false unless it is all digits and fits --- //
+static bool parseLineNumber(const std::string& nr, uint64_t& line_nr)
+{
+	if( nr.empty() || nr.find_first_not_of("0123456789") != std::string::npos )
+	{
+		return false;
+	}
+	errno = 0;
+	line_nr = strtoull(nr.c_str(), 0, 10);
+	return errno == 0;
+}
+
+// --- Parse a comma separated list of line numbers and ranges N-M --- //
+// Returns false if an item is malformed or a range ends before it starts.
+static bool parseLineRanges(const char* list, std::vector<line_range_t>& ranges)
+{
+	ranges.clear();
+	std::stringstream lines(list ? list : "");
+	std::string item;
+	while( std::getline(lines, item, ',') )
+	{
+		size_t dash = item.find('-');
+		line_range_t range;
+		if( !parseLineNumber(item.substr(0, dash), range.first) )
+		{
+			return false;
+		}
+		range.second = range.first;
+		if( dash != std::string::npos && 
+			(!parseLineNumber(item.substr(dash + 1), range.second) || range.second < range.first) )
+		{
+			return false;
+		}
+		ranges.push_back(range);
+	}
+	return !ranges.empty();
+}
+
+// --- The lines of a range that are in a log of the given number of lines --- //
+// Returns false if there are none.
+static bool presentLines(const line_range_t& range, uint64_t lines, line_range_t& present)
+{
+	present.first = std::max(range.first, uint64_t(1));
+	present.second = std::min(range.second, lines);
+	return present.first <= present.second;
+}
+
+// --- The lines of a range past the end of a log of the given number of lines --- //
+// Returns false if there are none. Line 0 is not in any log either.
+static bool pastLines(const line_range_t& range, uint64_t lines, line_range_t& past)
+{
+	past.first = std::max(range.first, lines + 1);
+	past.second = range.second;
+	return past.first <= past.second;
+}
+
+// --- "number N is" or "numbers N to M are" for the messages --- //
+static std::string lineNumbers(const line_range_t& range)
+{
+	if( range.first == range.second )
+	{
+		return "number " + std::to_string(range.first) + " is";
+	}
+	return "numbers " + std::to_string(range.first) + " to " + std::to_string(range.second) + " are";
+}
+
+
+// --- The last record of a block record file --- //
+// The record is: number, first and last line, the byte offset after the
+// last line, root and signature. A missing or empty file gives zeros.
+// Returns false if the last record is incomplete or malformed.
+static bool readLastBlock(const std::string& blocks_file, uint64_t& block_nr, uint64_t& last_line, uint64_t& end_offset)
+{
+	block_nr = last_line = end_offset = 0;
+	std::ifstream blocks_in(blocks_file, std::ios::binary);
+	std::string content((std::istreambuf_iterator<char>(blocks_in)), std::istreambuf_iterator<char>());
+	if( content.empty() )
+	{
+		return true;
+	}
+	if( content.back() != '\n' )
+	{
+		return false;
+	}
+	size_t start = content.rfind('\n', content.size() - 2);
+	start = (start == std::string::npos) ? 0 : start + 1;
+	std::stringstream record(content.substr(start));
+	uint64_t first_line = 0;
+	std::string root, sign;
+	return (record >> block_nr >> first_line >> last_line >> end_offset >> root >> sign) && 
+		block_nr > 0 && first_line <= last_line;
+}
+
+// --- Set by SIGINT and SIGTERM to end the --follow mode --- //
+static volatile sig_atomic_t STOP_FOLLOWING = 0;
+static void stopFollowing(int) { STOP_FOLLOWING = 1; }
+
+
+// --- Running the hasher with the given hash policy --- //
+template <class P>
+int runHasher( hasher_options_t opt )
+{
+	// --- Constructing a MerkleHasher instance --- //
+	MerkleHasher<P> myHasher;
+	myHasher.setThreads(opt.THREADS);
+	myHasher.setDirectInput(opt.DIRECT);
+	MERKLE_STATS_PHASE("setup");
+
+	// The root of the Merkle tree, which is calculated 
+	// either during the hash chain extraction or separately
+	std::string root;
+	bool HAVE_ROOT=false;
+
+	// The leaves of the last pass over the log file are streamed
+	// into the leaves file, either a new one or appended to the old one
+	LeafWriter<P> leaves_out;
+	myHasher.setLeavesOutput(&leaves_out);
+	auto openLeaves = [&](bool append)
+		{
+			if( !leaves_out.open(opt.leaves_file, opt.LEAVES_BINARY, append) )
+			{
+				std::cout << "\nCan not write the leaves into " << opt.leaves_file 
+						  << (append ? " (are the leaves in it of the other format, see --leaves-binary?)" : "") << "!" << std::endl;
+				return false;
+			}
+			return true;
+		};
+	auto closeLeaves = [&]()
+		{
+			// Information massage 
+			std::cout << "Printing leaves ... "; 
+
+			bool ok = leaves_out.close();
+			MERKLE_STATS_PHASE("write_leaves");
+
+			// Information massage 
+			std::cout << (ok ? "completed" : "failed") << std::endl;
+			return ok;
+		};
+
+	// A log file which could not be read to its end 
+	// (e.g. a broken compressed file) is not signed
+	auto inputFailed = [&]()
+		{
+			if( !myHasher.inputFailed() )
+			{
+				return false;
+			}
+			std::cout << "\nReading " << opt.log_file << " failed (a broken compressed file?)!" << std::endl;
+			return true;
+		};
+
+	// The proof containers only hold fixed size digests
+	if((opt.PROOFS || opt.EXPORT_PROOFS) && P::DIGEST_SIZE == 0)
+	{
+		std::cout << "The proof containers are not supported with the " << P::name() << " hash!" << std::endl;
+		return -1;
+	}
+
+	// --- Serving hash chains if asked --- //
+	// Runs until stdin ends, the other options are not used.
+	if(opt.SERVE)
+	{
+		if(Decompressor::detectFile(opt.log_file) != Decompressor::PLAIN)
+		{
+			std::cout << "\n--serve needs an uncompressed log file!" << std::endl;
+			return -1;
+		}
+		MerkleQuery<P> query(opt.cache_mb << 20);
+		std::string error = query.open(opt.log_file);
+		if( !error.empty() )
+		{
+			std::cout << "\nCan not serve: " << error << "!" << std::endl;
+			return -1;
+		}
+		std::cerr << "Serving the hash chains of " << opt.log_file << " (" << query.leaves() << " lines) from stdin ..." << std::endl;
+
+		std::string request;
+		while( std::getline(std::cin, request) )
+		{
+			error = query.refresh();
+			if( !error.empty() )
+			{
+				std::cout << "ERROR " << error << "\n" << std::endl;
+				continue;
+			}
+			if( request == "root" )
+			{
+				std::cout << query.getRoot() << "\n" << std::endl;
+				continue;
+			}
+			if( request == "stats" )
+			{
+				std::cout << query.statsJson() << "\n" << std::endl;
+				continue;
+			}
+			std::vector<line_range_t> ranges;
+			if( !parseLineRanges(request.c_str(), ranges) )
+			{
+				std::cout << "ERROR malformed request " << request << "\n" << std::endl;
+				continue;
+			}
+			for (size_t r=0; r<ranges.size(); ++r)
+			{
+				if( ranges[r].first == 0 )
+				{
+					std::cout << "ERROR line number 0 is not in the log file of " << query.leaves() << " lines\n\n";
+				}
+				line_range_t present, past;
+				if( presentLines(ranges[r], query.leaves(), present) )
+				{
+					for (uint64_t line_nr=present.first; ; ++line_nr)
+					{
+						hash_chain_t chain = query.getHashChain(line_nr - 1);
+						for (size_t i=0; i<chain.size(); ++i)
+						{
+							std::cout << chain[i].first << "\t" << chain[i].second << "\n";
+						}
+						std::cout << "\n";
+						if( line_nr == present.second )
+						{
+							break;
+						}
+					}
+				}
+				if( pastLines(ranges[r], query.leaves(), past) )
+				{
+					std::cout << "ERROR line " << lineNumbers(past) << " not in the log file of " << query.leaves() << " lines\n\n";
+				}
+			}
+			std::cout.flush();
+		}
+		std::cerr << query.statsJson() << std::endl;
+		MERKLE_STATS_PHASE("serve");
+		return 0;
+	} // END SERVE
+
+	// --- Verifying hash chains against the signature if asked --- //
+	if(opt.VERIFY)
+	{
+		// The root that the signature covers
+		std::string signed_root = readSignedRoot(opt.log_signature_file);
+		if(signed_root.empty())
+		{
+			std::cout << "\nCan not verify the signature " << opt.log_signature_file << "!" << std::endl;
+			return -1;
+		}
+
+		// The chains are either the proofs of a container, named
+		// <container>:<id>, or text files with the id at the end
+		// of their names. The ids are the line numbers.
+		MerkleProofs<P> proofs;
+		bool CONTAINER = isMerkleProofsFile(opt.verify_chains);
+		std::vector<std::string> chain_files;
+		std::vector<uint64_t> chain_ids;
+		std::vector<hash_chain_t> chains;
+		if(CONTAINER)
+		{
+			std::string error = proofs.open(opt.verify_chains);
+			if( !error.empty() )
+			{
+				std::cout << "\nReading the proofs failed: " << error << std::endl;
+				return -1;
+			}
+			for (uint64_t k=0; k<proofs.count(); ++k)
+			{
+				uint64_t id = proofs.valid(k) ? proofs.id(k) : 0;
+				chain_files.push_back(opt.verify_chains + ":" + std::to_string(id));
+				chain_ids.push_back(id);
+			}
+		}
+		else
+		{
+			chain_files = listHashChains(opt.verify_chains);
+		}
+		if(chain_files.empty())
+		{
+			std::cout << "\nNo hash chains found in " << opt.verify_chains << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Reading " << chain_files.size() << " hash chains ... ";
+
+		if(!CONTAINER)
+		{
+			chains.resize(chain_files.size());
+			for (size_t k=0; k<chain_files.size(); ++k)
+			{
+				if( !readHashChain(chain_files[k], chains[k]) )
+				{
+					chains[k].clear();
+				}
+				chain_ids.push_back( chainLineNumber(chain_files[k]) );
+			}
+		}
+
+		// The lines to check the leaves against, by the ids
+		std::vector<std::string> verify_lines;
+		std::vector<const std::string*> chain_lines;
+		std::vector<uint64_t> missing_lines(chain_files.size(), 0);
+		if(!opt.verify_lines_file.empty())
+		{
+			std::ifstream lines(opt.verify_lines_file);
+			if( !lines.is_open() )
+			{
+				std::cout << "\nCan not open the lines file " << opt.verify_lines_file << "!" << std::endl;
+				return -1;
+			}
+			std::string line;
+			while( std::getline(lines, line) )
+			{
+				verify_lines.push_back(line);
+			}
+			chain_lines.resize(chain_files.size(), 0);
+			for (size_t k=0; k<chain_files.size(); ++k)
+			{
+				uint64_t line_nr = chain_ids[k];
+				if( line_nr >= 1 && line_nr <= verify_lines.size() )
+				{
+					chain_lines[k] = &verify_lines[line_nr - 1];
+				}
+				else
+				{
+					missing_lines[k] = line_nr;
+				}
+			}
+		}
+		MERKLE_STATS_PHASE("read_chains");
+
+		// Information massage 
+		std::cout << "completed" << std::endl;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::vector<int> status = CONTAINER ? myHasher.verifyProofs(proofs, chain_lines, signed_root)
+										   : myHasher.verifyHashChains(chains, chain_lines, signed_root);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		MERKLE_STATS_PHASE("verify");
+
+		// One record per chain file
+		size_t failed = 0;
+		for (size_t k=0; k<chain_files.size(); ++k)
+		{
+			if(status[k] == MerkleHasher<P>::CHAIN_OK)
+			{
+				std::cout << "PASS\t" << chain_files[k] << "\n";
+				continue;
+			}
+			++failed;
+			std::cout << "FAIL\t" << chain_files[k] << "\t";
+			if(missing_lines[k] != 0 || (!chain_lines.empty() && chain_lines[k] == 0))
+			{
+				std::cout << "line " << missing_lines[k] << " is not in " << opt.verify_lines_file << "\n";
+			}
+			else
+			{
+				std::cout << MerkleHasher<P>::chainStatusName(status[k]) << "\n";
+			}
+		}
+
+		// Information massage 
+		std::cout << "Verified " << chain_files.size() << " hash chains against " << opt.log_signature_file << ": "
+				  << chain_files.size() - failed << " passed, " << failed << " failed ("
+				  << seconds << " s, " << chain_files.size() / std::max(seconds, 1e-9) << " chains/s)" << std::endl;
+		return failed ? -1 : 0;
+	} // END VERIFY
+
+	// --- Verifying a consistency proof against the signatures if asked --- //
+	if(opt.VERIFY_CONSISTENCY)
+	{
+		// The proof file: the old and the new number of 
+		// lines with their roots, then the proof nodes
+		uint64_t sizes[2] = {0, 0};
+		typename P::digest_t roots[2];
+		std::vector<typename P::digest_t> proof;
+		bool ok = true;
+		std::ifstream proof_in(opt.consistency_file);
+		std::string line;
+		for (int r=0; r<2; ++r)
+		{
+			std::getline(proof_in, line);
+			size_t tab = line.find('\t');
+			ok = ok && tab != std::string::npos && P::fromString(line.substr(tab + 1), roots[r]);
+			sizes[r] = strtoull(line.c_str(), 0, 10);
+		}
+		while( ok && std::getline(proof_in, line) )
+		{
+			proof.push_back(typename P::digest_t());
+			ok = P::fromString(line, proof.back());
+		}
+		if(!ok)
+		{
+			std::cout << "\nCan not read the consistency proof " << opt.consistency_file << "!" << std::endl;
+			return -1;
+		}
+
+		// The new and the old root must be the signed ones
+		std::string signed_root = readSignedRoot(opt.log_signature_file);
+		if(signed_root.empty())
+		{
+			std::cout << "\nCan not verify the signature " << opt.log_signature_file << "!" << std::endl;
+			return -1;
+		}
+		std::string failure;
+		if(signed_root != P::toString(roots[1]))
+		{
+			failure = "the new root is not the one signed in " + opt.log_signature_file;
+		}
+		else if(readSignedRoot(opt.old_signature_file) != P::toString(roots[0]))
+		{
+			failure = "the old root is not the one signed in " + opt.old_signature_file;
+		}
+		else if(!myHasher.verifyConsistency(sizes[0], sizes[1], proof, roots[0], roots[1]))
+		{
+			failure = "the proof does not hash up to the roots";
+		}
+		MERKLE_STATS_PHASE("verify_consistency");
+
+		// Information massage 
+		if(!failure.empty())
+		{
+			std::cout << "FAIL\t" << opt.consistency_file << "\t" << failure << std::endl;
+			return -1;
+		}
+		std::cout << "PASS\t" << opt.consistency_file << "\tthe first " << sizes[0] << " of " << sizes[1] << " lines are unchanged" << std::endl;
+		return 0;
+	} // END VERIFY_CONSISTENCY
+
+	// --- Verifying a multi-proof against the signature if asked --- //
+	if(opt.VERIFY_MULTI_PROOF)
+	{
+		// The proof file: the number of lines with the root, the
+		// proven lines with their leaves, an empty line and the nodes
+		uint64_t n = 0;
+		typename P::digest_t proof_root;
+		std::vector<uint64_t> indices;
+		std::vector<typename P::digest_t> leaves, proof;
+		std::ifstream proof_in(opt.multi_proof_file);
+		std::string line;
+		std::getline(proof_in, line);
+		size_t tab = line.find('\t');
+		bool ok = tab != std::string::npos && P::fromString(line.substr(tab + 1), proof_root);
+		n = strtoull(line.c_str(), 0, 10);
+		while( ok && std::getline(proof_in, line) && !line.empty() )
+		{
+			tab = line.find('\t');
+			uint64_t line_nr = strtoull(line.c_str(), 0, 10);
+			leaves.push_back(typename P::digest_t());
+			ok = tab != std::string::npos && line_nr >= 1 && P::fromString(line.substr(tab + 1), leaves.back());
+			indices.push_back(line_nr - 1);
+		}
+		while( ok && std::getline(proof_in, line) )
+		{
+			proof.push_back(typename P::digest_t());
+			ok = P::fromString(line, proof.back());
+		}
+		if(!ok || indices.empty())
+		{
+			std::cout << "\nCan not read the multi-proof " << opt.multi_proof_file << "!" << std::endl;
+			return -1;
+		}
+
+		std::string signed_root = readSignedRoot(opt.log_signature_file);
+		if(signed_root.empty())
+		{
+			std::cout << "\nCan not verify the signature " << opt.log_signature_file << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Verifying the multi-proof of " << indices.size() << " lines (" << proof.size() << " nodes) ... ";
+
+		std::string failure;
+		if(signed_root != P::toString(proof_root))
+		{
+			failure = "the root is not the one signed in " + opt.log_signature_file;
+		}
+		else if(!myHasher.verifyMultiProof(n, indices, leaves, proof, proof_root))
+		{
+			failure = "the proof does not hash up to the root";
+		}
+
+		// The leaves against the lines of the lines file, 
+		// read through once as the lines are in order
+		if(failure.empty() && !opt.verify_lines_file.empty())
+		{
+			std::ifstream lines(opt.verify_lines_file);
+			uint64_t line_nr = 0;
+			size_t k = 0;
+			while( k < indices.size() && std::getline(lines, line) )
+			{
+				if( line_nr++ != indices[k] )
+				{
+					continue;
+				}
+				if( myHasher.hash(line) != leaves[k] )
+				{
+					failure = "line " + std::to_string(line_nr) + " of " + opt.verify_lines_file + " is not the proven one";
+					break;
+				}
+				++k;
+			}
+			if( failure.empty() && k < indices.size() )
+			{
+				failure = "line " + std::to_string(indices[k] + 1) + " is not in " + opt.verify_lines_file;
+			}
+		}
+		MERKLE_STATS_PHASE("verify_multi_proof");
+
+		// Information massage 
+		std::cout << (failure.empty() ? "completed" : "failed") << std::endl;
+		if(!failure.empty())
+		{
+			std::cout << "FAIL\t" << opt.multi_proof_file << "\t" << failure << std::endl;
+			return -1;
+		}
+		std::cout << "PASS\t" << opt.multi_proof_file << "\t" << indices.size() << " lines" << std::endl;
+		return 0;
+	} // END VERIFY_MULTI_PROOF
+
+	// --- Printing a proof container as text if asked --- //
+	if(opt.EXPORT_PROOFS)
+	{
+		MerkleProofs<P> proofs;
+		std::string error = proofs.open(opt.export_proofs_file);
+		if( !error.empty() )
+		{
+			std::cout << "Reading the proofs failed: " << error << std::endl;
+			return -1;
+		}
+
+		// A header line, then for every proof its id and
+		// its hash chain in the format of the chain files
+		std::cout << "# " << proofs.count() << " proofs, root " << P::toString(proofs.root()) << "\n";
+		for (uint64_t k=0; k<proofs.count(); ++k)
+		{
+			hash_chain_t chain = proofs.getHashChain(k);
+			if( chain.empty() )
+			{
+				std::cout << "# proof number " << k + 1 << " is broken\n";
+				continue;
+			}
+			std::cout << "proof " << proofs.id(k) << "\n";
+			for (size_t i=0; i<chain.size(); ++i)
+			{
+				std::cout << chain[i].first << "\t" << chain[i].second << "\n";
+			}
+		}
+		std::cout.flush();
+		return 0;
+	} // END EXPORT_PROOFS
+
+	// --- Signing a batch of log files together if asked --- //
+	if(opt.BATCH)
+	{
+		std::vector<std::string> files = listBatchFiles(opt.batch_files);
+		if(files.empty())
+		{
+			std::cout << "\nNo log files found in " << opt.batch_files << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Calculating the Merkle roots of " << files.size() << " log files on " << opt.THREADS << " threads ... ";
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		MerkleBatch<P> batch(opt.THREADS);
+		batch.setDirectInput(opt.DIRECT);
+		std::vector<typename MerkleBatch<P>::file_root_t> roots = batch.getRoots(files);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		MERKLE_STATS_PHASE("batch_roots");
+
+		// Information massage 
+		std::cout << "completed (" << seconds << " s)" << std::endl;
+
+		// The second-level tree is built over the roots of the
+		// files which have lines, numbered as in the batch
+		std::vector<typename P::digest_t> file_roots;
+		std::vector<uint64_t> file_nrs;
+		for (size_t n=0; n<roots.size(); ++n)
+		{
+			if(!roots[n].ok || roots[n].lines == 0)
+			{
+				std::cout << "Log file " << roots[n].file << (roots[n].ok ? " is empty" : " can not be read") << ", left out!" << std::endl;
+				continue;
+			}
+			file_roots.push_back(roots[n].root);
+			file_nrs.push_back(n + 1);
+		}
+		if(file_roots.empty())
+		{
+			std::cout << "\nThere is nothing to sign!" << std::endl;
+			return -1;
+		}
+		std::vector<hash_chain_t> file_chains = myHasher.getTreeChains(file_roots, root);
+		MERKLE_STATS_PHASE("batch_tree");
+
+		// One record per file: number, lines, root and path
+		std::ofstream batch_out(opt.batch_name + ".batch");
+		if( !batch_out.is_open() )
+		{
+			std::cout << "\nCan not write the batch records into " << opt.batch_name << ".batch!" << std::endl;
+			return -1;
+		}
+		for (size_t n=0; n<roots.size(); ++n)
+		{
+			bool signed_file = roots[n].ok && roots[n].lines > 0;
+			batch_out << n + 1 << "\t" << roots[n].lines << "\t" << (signed_file ? P::toString(roots[n].root) : "-") 
+					  << "\t" << roots[n].file << "\n";
+		}
+		batch_out.close();
+
+		// The chains from the file roots to the batch root
+		ChainOutput<P> chains_out(opt.PROOFS, opt.batch_name + ".hash_chain_file_", opt.batch_name + ".hash_chains_file");
+		if( !chains_out.open() )
+		{
+			std::cout << "\nCan not write the proofs into " << chains_out.proofsFile() << "!" << std::endl;
+			return -1;
+		}
+		for (size_t k=0; k<file_chains.size(); ++k)
+		{
+			chains_out.write(file_nrs[k], file_chains[k]);
+		}
+		if( !chains_out.close(root) )
+		{
+			std::cout << "\nWriting the proofs into " << chains_out.proofsFile() << " failed!" << std::endl;
+			return -1;
+		}
+		MERKLE_STATS_PHASE("write_chains");
+
+		// Information massage 
+		std::cout << "Signing the batch root ... ";
+
+		// One signature for the whole batch
+		std::ofstream signature_out(opt.batch_name + ".signature");
+		if(signature_out.is_open())
+		{
+			signature_out << signature( root ) << std::endl;
+		}
+		signature_out.close();
+		MERKLE_STATS_PHASE("sign");
+
+		// Information massage 
+		std::cout << "completed" << std::endl;
+		std::cout << "Signed " << file_roots.size() << " log files into " << opt.batch_name << ".signature" << std::endl;
+		return 0;
+	} // END BATCH
+
+	// --- Following the log file and signing it in blocks if asked --- //
+	if(opt.FOLLOW)
+	{
+		// Continue after the last recorded block, if there is one
+		uint64_t block_nr, recorded_lines, recorded_end;
+		if( !readLastBlock(opt.blocks_file, block_nr, recorded_lines, recorded_end) )
+		{
+			std::cout << "\nThe last record of " << opt.blocks_file << " is incomplete or malformed!" << std::endl;
+			return -1;
+		}
+		if( regularFileSize(opt.log_file) < recorded_end )
+		{
+			std::cout << "\nThe log file is shorter than the blocks in " << opt.blocks_file << " (rotated?)!" << std::endl;
+			return -1;
+		}
+		std::ofstream blocks_out(opt.blocks_file, std::ios::app);
+		if( !blocks_out.is_open() )
+		{
+			std::cout << "\nCan not write the block records into " << opt.blocks_file << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Following " << opt.log_file << " from line " << recorded_lines + 1 << ", block records go to " 
+				  << opt.blocks_file << " (Ctrl-C to stop)" << std::endl;
+
+		// One record per block: number, first and last line, 
+		// the byte offset after it, root and signature
+		uint64_t first_block = block_nr;
+		signal(SIGINT, stopFollowing);
+		signal(SIGTERM, stopFollowing);
+		bool ok = myHasher.followBlocks(opt.log_file, recorded_end, recorded_lines + 1, opt.block_lines, opt.block_seconds, &STOP_FOLLOWING,
+			[&](uint64_t first_line, uint64_t last_line, uint64_t end_offset, std::string block_root)
+			{
+				++block_nr;
+				blocks_out << block_nr << "\t" << first_line << "\t" << last_line << "\t" << end_offset << "\t" 
+						   << block_root << "\t" << signature( block_root ) << std::endl;
+			});
+		blocks_out.close();
+		MERKLE_STATS_PHASE("follow");
+
+		// Information massage 
+		std::cout << "Signed " << block_nr - first_block << " blocks" << std::endl;
+		if(inputFailed())
+		{
+			return -1;
+		}
+		if(!ok)
+		{
+			std::cout << "\nThe log file was truncated or replaced (rotated?), stopped following it!" << std::endl;
+			return -1;
+		}
+		return 0;
+	} // END FOLLOW
+
+	// --- Reading hash chains from the index if asked --- //
+	if(opt.INDEX_CHAIN)
+	{
+		if(P::DIGEST_SIZE == 0)
+		{
+			std::cout << "The index is not supported with the " << P::name() << " hash!" << std::endl;
+			return -1;
+		}
+
+		// Opening the index and checking that it belongs to the log file
+		MerkleIndex<P> index;
+		std::string error = index.open(opt.index_file);
+		if( error.empty() && !index.matchesLog(opt.log_file) )
+		{
+			error = "the index file " + opt.index_file + " does not match the log file (rebuild it with --index)";
+		}
+		if( !error.empty() )
+		{
+			std::cout << "Reading the index failed: " << error << std::endl;
+			return -1;
+		}
+
+		ChainOutput<P> chains_out(opt.PROOFS, opt.log_file + ".hash_chain_line_", opt.log_file + ".hash_chains_line");
+		if( !chains_out.open() )
+		{
+			std::cout << "\nCan not write the proofs into " << chains_out.proofsFile() << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Reading the hash chains from the index ... ";
+
+		for (size_t r=0; r<opt.index_chain_ranges.size(); ++r)
+		{
+			const line_range_t& range = opt.index_chain_ranges[r];
+			if( range.first == 0 )
+			{
+				std::cout << "\nLine number 0 is not in the log file of " << index.leaves() << " lines!" << std::endl;
+			}
+			line_range_t present, past;
+			if( presentLines(range, index.leaves(), present) )
+			{
+				for (uint64_t line_nr=present.first; ; ++line_nr)
+				{
+					// Printing the hash chain
+					chains_out.write(line_nr, index.getHashChain(line_nr - 1));
+					if( line_nr == present.second )
+					{
+						break;
+					}
+				}
+			}
+			if( pastLines(range, index.leaves(), past) )
+			{
+				std::cout << "\nLine " << lineNumbers(past) << " not in the log file of " << index.leaves() << " lines!" << std::endl;
+			}
+		}
+		if( !chains_out.close(P::toString(index.root())) )
+		{
+			std::cout << "\nWriting the proofs into " << chains_out.proofsFile() << " failed!" << std::endl;
+			return -1;
+		}
+
+		MERKLE_STATS_PHASE("index_chains");
+
+		// Information massage 
+		std::cout << "completed" << std::endl;
+	} // END INDEX_CHAIN
+
+	// --- Finding the hash chains of lines through the lookup table if asked --- //
+	if(opt.LOOKUP_CHAIN)
+	{
+		if(P::DIGEST_SIZE == 0)
+		{
+			std::cout << "The lookup table is not supported with the " << P::name() << " hash!" << std::endl;
+			return -1;
+		}
+
+		// Opening the lookup table and the index and checking 
+		// that they belong to the log file and to each other
+		MerkleLookup<P> lookup;
+		MerkleIndex<P> index;
+		std::string error = lookup.open(opt.lookup_file);
+		if( error.empty() && !lookup.matchesLog(opt.log_file) )
+		{
+			error = "the lookup file " + opt.lookup_file + " does not match the log file (rebuild it with --lookup)";
+		}
+		if( error.empty() )
+		{
+			error = index.open(opt.index_file);
+		}
+		if( error.empty() && (!(index.log() == lookup.log()) || index.root() != lookup.root()) )
+		{
+			error = "the index file " + opt.index_file + " does not match the lookup file (rebuild both with --lookup)";
+		}
+		if( !error.empty() )
+		{
+			std::cout << "Reading the lookup table failed: " << error << std::endl;
+			return -1;
+		}
+
+		// Reading the requested lines 
+		std::vector<std::string> chain_lines;
+		std::ifstream lines(opt.lookup_chain_lines_file);
+		std::string line;
+		while( std::getline(lines, line) )
+		{	
+			chain_lines.push_back(line);
+		}
+		lines.close();
+
+		ChainOutput<P> chains_out(opt.PROOFS, opt.log_file + ".hash_chain_", opt.log_file + ".hash_chains");
+		if( !chains_out.open() )
+		{
+			std::cout << "\nCan not write the proofs into " << chains_out.proofsFile() << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Looking up " + std::to_string(chain_lines.size()) + " hash chains ... ";
+
+		// As with --chain, the chain of the first equal line is given
+		std::vector<std::vector<uint64_t> > found(chain_lines.size());
+		uint64_t missing = 0;
+		uint64_t filtered = 0;
+		for (size_t n=0; n<chain_lines.size(); ++n)
+		{
+			typename P::digest_t leaf = myHasher.hash(chain_lines[n]);
+			found[n] = lookup.find(leaf);
+			if( found[n].empty() )
+			{
+				++missing;
+				filtered += lookup.mayContain(leaf) ? 0 : 1;
+			}
+		}
+		MERKLE_STATS_PHASE("lookup");
+
+		// Information massage 
+		std::cout << "completed (" << missing << " not present, " << filtered << " of them rejected by the Bloom filter)" << std::endl;
+
+		for (size_t n=0; n<found.size(); ++n)
+		{
+			int line_nr = n + 1;
+			if( found[n].empty() )
+			{
+				// Information massage 
+				std::cout << "Hash chain number " + std::to_string(line_nr) + " failed" << std::endl;
+				std::cout << "Input line number " << line_nr << " :\n" << chain_lines[n] << std::endl;
+				std::cout << "\nThe line is not present in the log file!\n" << std::endl;
+				continue;
+			}
+			chains_out.write(line_nr, index.getHashChain(found[n][0]));
+		}
+		if( !chains_out.close(P::toString(index.root())) )
+		{
+			std::cout << "\nWriting the proofs into " << chains_out.proofsFile() << " failed!" << std::endl;
+			return -1;
+		}
+		MERKLE_STATS_PHASE("lookup_chains");
+	} // END LOOKUP_CHAIN
+
+	// --- Writing the consistency proof of the first lines if asked --- //
+	if(opt.CONSISTENCY)
+	{
+		if(P::DIGEST_SIZE == 0)
+		{
+			std::cout << "The index is not supported with the " << P::name() << " hash!" << std::endl;
+			return -1;
+		}
+
+		// Opening the index and checking that it belongs to the log file
+		MerkleIndex<P> index;
+		std::string error = index.open(opt.index_file);
+		if( error.empty() && !index.matchesLog(opt.log_file) )
+		{
+			error = "the index file " + opt.index_file + " does not match the log file (rebuild it with --index)";
+		}
+		if( error.empty() && opt.consistency_lines > index.leaves() )
+		{
+			error = "the log file has only " + std::to_string(index.leaves()) + " lines";
+		}
+		if( !error.empty() )
+		{
+			std::cout << "Reading the index failed: " << error << std::endl;
+			return -1;
+		}
+
+		// The old and the new number of lines with 
+		// their roots, then the proof nodes
+		uint64_t m = opt.consistency_lines;
+		std::vector<typename P::digest_t> proof = index.consistencyProof(m);
+		std::string proof_file = opt.log_file + ".consistency_" + std::to_string(m);
+		std::ofstream proof_out(proof_file);
+		proof_out << m << "\t" << P::toString(index.rootAt(m)) << "\n";
+		proof_out << index.leaves() << "\t" << P::toString(index.root()) << "\n";
+		for (size_t k=0; k<proof.size(); ++k)
+		{
+			proof_out << P::toString(proof[k]) << "\n";
+		}
+		proof_out.close();
+		if(!proof_out)
+		{
+			std::cout << "\nWriting the consistency proof " << proof_file << " failed!" << std::endl;
+			return -1;
+		}
+		MERKLE_STATS_PHASE("consistency");
+
+		// Information massage 
+		std::cout << "Wrote the consistency proof of the first " << m << " of " << index.leaves() << " lines ("
+				  << proof.size() << " nodes) into " << proof_file << std::endl;
+	} // END CONSISTENCY
+
+	// --- Writing the multi-proof of the given lines if asked --- //
+	if(opt.MULTI_PROOF)
+	{
+		if(P::DIGEST_SIZE == 0)
+		{
+			std::cout << "The index is not supported with the " << P::name() << " hash!" << std::endl;
+			return -1;
+		}
+
+		// Opening the index and checking that it belongs to the log file
+		MerkleIndex<P> index;
+		std::string error = index.open(opt.index_file);
+		if( error.empty() && !index.matchesLog(opt.log_file) )
+		{
+			error = "the index file " + opt.index_file + " does not match the log file (rebuild it with --index)";
+		}
+		if( !error.empty() )
+		{
+			std::cout << "Reading the index failed: " << error << std::endl;
+			return -1;
+		}
+
+		// The lines in order, each once
+		std::vector<uint64_t> indices;
+		for (size_t r=0; r<opt.multi_proof_ranges.size(); ++r)
+		{
+			const line_range_t& range = opt.multi_proof_ranges[r];
+			line_range_t present, past;
+			if( range.first == 0 )
+			{
+				std::cout << "Line number 0 is not in the log file of " << index.leaves() << " lines!" << std::endl;
+				return -1;
+			}
+			if( pastLines(range, index.leaves(), past) )
+			{
+				std::cout << "Line " << lineNumbers(past) << " not in the log file of " << index.leaves() << " lines!" << std::endl;
+				return -1;
+			}
+			presentLines(range, index.leaves(), present);
+			for (uint64_t line_nr=present.first; line_nr<=present.second; ++line_nr)
+			{
+				indices.push_back(line_nr - 1);
+			}
+		}
+		std::sort(indices.begin(), indices.end());
+		indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+		std::vector<typename P::digest_t> proof;
+		if( !index.multiProof(indices, proof) )
+		{
+			std::cout << "\nThe multi-proof can not be read from the index " << opt.index_file << "!" << std::endl;
+			return -1;
+		}
+
+		// The number of lines with the root, the proven lines
+		// with their leaves, an empty line and the nodes
+		std::string proof_file = opt.log_file + ".multi_proof";
+		std::ofstream proof_out(proof_file);
+		proof_out << index.leaves() << "\t" << P::toString(index.root()) << "\n";
+		for (size_t k=0; k<indices.size(); ++k)
+		{
+			proof_out << indices[k] + 1 << "\t" << P::toString(index.node(0, indices[k])) << "\n";
+		}
+		proof_out << "\n";
+		for (size_t k=0; k<proof.size(); ++k)
+		{
+			proof_out << P::toString(proof[k]) << "\n";
+		}
+		proof_out.close();
+		if(!proof_out)
+		{
+			std::cout << "\nWriting the multi-proof " << proof_file << " failed!" << std::endl;
+			return -1;
+		}
+		MERKLE_STATS_PHASE("multi_proof");
+
+		// Information massage 
+		std::cout << "Wrote the multi-proof of " << indices.size() << " lines (" << proof.size() << " nodes) into " << proof_file << std::endl;
+	} // END MULTI_PROOF
+
+	// --- Generating the hash chains by line number if asked --- //
+	if(opt.CHAIN_LINES)
+	{
+		ChainOutput<P> chains_out(opt.PROOFS, opt.log_file + ".hash_chain_line_", opt.log_file + ".hash_chains_line");
+		if( !chains_out.open() )
+		{
+			std::cout << "\nCan not write the proofs into " << chains_out.proofsFile() << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Calculating the hash chains by line number ... ";
+
+		// The leaves are numbered from 0, the ranges are resolved 
+		// against the number of leaves while hashing the log
+		std::vector<typename MerkleHasher<P>::leaf_range_t> leaf_ranges;
+		for (size_t r=0; r<opt.chain_line_ranges.size(); ++r)
+		{
+			if( opt.chain_line_ranges[r].second >= 1 )
+			{
+				leaf_ranges.push_back( std::make_pair(std::max(opt.chain_line_ranges[r].first, uint64_t(1)) - 1, 
+					opt.chain_line_ranges[r].second - 1) );
+			}
+		}
+		// The leaves are saved by the last pass
+		bool saveLeaves = opt.LEAVES && !opt.HASH_CHAIN;
+		if(saveLeaves && !openLeaves(false))
+		{
+			return -1;
+		}
+		uint64_t lines = 0;
+		std::vector<hash_chain_t> hash_chains_out = myHasher.getHashChainsAt(opt.log_file, leaf_ranges, root, lines, saveLeaves);
+		if(inputFailed())
+		{
+			return -1;
+		}
+		HAVE_ROOT=true;
+		MERKLE_STATS_PHASE("chain_lines");
+
+		// Information massage 
+		std::cout << "completed" << std::endl;
+
+		// The chains come range by range, 
+		// the lines past the end are reported
+		size_t n = 0;
+		for (size_t r=0; r<opt.chain_line_ranges.size(); ++r)
+		{
+			const line_range_t& range = opt.chain_line_ranges[r];
+			if( range.first == 0 )
+			{
+				std::cout << "Line number 0 is not in the log file!" << std::endl;
+			}
+			line_range_t present, past;
+			if( presentLines(range, lines, present) )
+			{
+				for (uint64_t line_nr=present.first; line_nr<=present.second; ++line_nr)
+				{
+					chains_out.write(line_nr, hash_chains_out[n++]);
+				}
+			}
+			if( pastLines(range, lines, past) )
+			{
+				std::cout << "Line " << lineNumbers(past) << " not in the log file!" << std::endl;
+			}
+		}
+		if( !chains_out.close(root) )
+		{
+			std::cout << "\nWriting the proofs into " << chains_out.proofsFile() << " failed!" << std::endl;
+			return -1;
+		}
+		MERKLE_STATS_PHASE("write_chains");
+
+		// If --leaves was active, closing the leaves,
+		// unless there is another pass coming
+		if(saveLeaves)
+		{
+			if( !closeLeaves() )
+			{
+				return -1;
+			}
+
+			// Setting LEAVES to false (no need to print it again)
+			opt.LEAVES=false;
+		}
+	} // END CHAIN_LINES
+
+	// --- Generating the hash chains if asked --- //
+	if(opt.HASH_CHAIN)
+	{
+		// Reading the requested lines 
+		std::vector<std::string> chain_lines;
+		std::ifstream lines(opt.hash_chain_lines_file);
+		if( lines.is_open() )
+		{
+			std::string line;
+			while( std::getline(lines, line) )
+			{	
+				chain_lines.push_back(line);
+			}
+		}
+		lines.close();
+
+		ChainOutput<P> chains_out(opt.PROOFS, opt.log_file + ".hash_chain_", opt.log_file + ".hash_chains");
+		if( !chains_out.open() )
+		{
+			std::cout << "\nCan not write the proofs into " << chains_out.proofsFile() << "!" << std::endl;
+			return -1;
+		}
+
+		// Information massage 
+		std::cout << "Calculating " + std::to_string(chain_lines.size()) + " hash chains ... ";
+
+		// Calculating all the hash chains, the root and 
+		// the leaves in a single pass over the log file
+		if(opt.LEAVES && !openLeaves(false))
+		{
+			return -1;
+		}
+		std::vector<hash_chain_t> hash_chains_out = myHasher.getHashChains(opt.log_file, chain_lines, root, opt.LEAVES);
+		if(inputFailed())
+		{
+			return -1;
+		}
+		HAVE_ROOT=true;
+		MERKLE_STATS_PHASE("chains");
+
+		// Information massage 
+		std::cout << "completed" << std::endl;
+
+		// Looping the chains
+		for (uint n=0; n<hash_chains_out.size(); ++n)
+		{	
+			int line_nr = n + 1;
+			const hash_chain_t& hash_chain_out = hash_chains_out[n];
+
+			// Checking if the hash chain is empty or not
+			if( (hash_chain_out.empty()) )
+			{
+				// Information massage 
+				std::cout << "Hash chain number " + std::to_string(line_nr) + " failed" << std::endl;
+				std::cout << "Input line number " << line_nr << " :\n" << chain_lines[n] << std::endl;
+				std::cout << "\nThe line is not present in the log file!\n" << std::endl;
+			}
+			else
+			{
+				// Printing the hash chain
+				chains_out.write(line_nr, hash_chain_out);
+			}
+		}
+		if( !chains_out.close(root) )
+		{
+			std::cout << "\nWriting the proofs into " << chains_out.proofsFile() << " failed!" << std::endl;
+			return -1;
+		}
+		MERKLE_STATS_PHASE("write_chains");
+
+		// If --leaves was active, closing the leaves 
+		if(opt.LEAVES)
+		{
+			if( !closeLeaves() )
+			{
+				return -1;
+			}
 
+			// Setting LEAVES to false (no need to print it again)
+			opt.LEAVES=false;
+		} 
+	} // END HASH_CHAIN
 
 
+	// --- Signing the Merkle root if asked --- //
+	if(opt.SIGN)
+	{
+		// Information massage 
+		std::cout << "Calculating the Merkle root ... "; 
+		
+		// Calculating the root of the Merkle tree of the log file,
+		// unless it was already done during hash chain extraction.
+		// With --index the tree is saved while calculating the root
+		// and with --resume only the new lines are hashed.
+		MerkleState<P> state;
+		if(opt.RESUME)
+		{
+			// Without a state file start from the beginning
+			if( std::ifstream(opt.state_file).good() )
+			{
+				std::string error = state.load(opt.state_file);
+				if( error.empty() )
+				{
+					error = state.check(opt.log_file);
+				}
+				if( !error.empty() )
+				{
+					std::cout << "\nCan not resume: " << error << "!" << std::endl;
+					std::cout << "Remove " << opt.state_file << " to sign the log file from the beginning." << std::endl;
+					return -1;
+				}
+			}
+			// When resuming, the new leaves are appended
+			if(opt.LEAVES && !openLeaves(true))
+			{
+				return -1;
+			}
+			uint64_t old_lines = state.lines;
+			root = myHasher.resumeRoot(opt.log_file, state, opt.LEAVES);
+			std::cout << "(" << state.lines - old_lines << " new lines, " << state.lines << " in total) ";
+		}
+		else if(opt.INDEX)
+		{
+			if(P::DIGEST_SIZE == 0)
+			{
+				std::cout << "The index is not supported with the " << P::name() << " hash!" << std::endl;
+				return -1;
+			}
+			if(opt.LEAVES && !openLeaves(false))
+			{
+				return -1;
+			}
+			root = myHasher.buildIndex(opt.log_file, opt.index_file, opt.LOOKUP ? opt.lookup_file : "", opt.LEAVES);
+			if(inputFailed())
+			{
+				return -1;
+			}
+			if(root.empty())
+			{
+				std::cout << "\nWriting the index " << opt.index_file << (opt.LOOKUP ? " or the lookup table " + opt.lookup_file : "") << " failed!" << std::endl;
+				return -1;
+			}
+		}
+		else if(!HAVE_ROOT && opt.THREADS > 1 && !opt.LEAVES)
+		{
+			// The subtrees of the file are built in parallel
+			MerkleBatch<P> parallel(opt.THREADS);
+			parallel.setDirectInput(opt.DIRECT);
+			typename MerkleBatch<P>::file_root_t r = parallel.getRoot(opt.log_file);
+			if(!r.ok)
+			{
+				std::cout << "\nReading " << opt.log_file << " failed (a broken compressed file?)!" << std::endl;
+				return -1;
+			}
+			root = (r.lines > 0) ? P::toString(r.root) : std::string();
+		}
+		else if(!HAVE_ROOT)
+		{
+			if(opt.LEAVES && !openLeaves(false))
+			{
+				return -1;
+			}
+			root = myHasher.getRoot(opt.log_file, opt.LEAVES);
+		}
+		if(inputFailed())
+		{
+			return -1;
+		}
 
-int main( int argc, char **argv )
-{
+		MERKLE_STATS_PHASE("root");
 
-	// -------------------------------- //
-	// ------ COMMANDLINE PARSING ----- //
-	// -------------------------------- //
+		// Information massage 
+		std::cout << "completed" << std::endl;
+		std::cout << "Signing the Merkle root ... ";
 
-	// --- Initialise the variable to hold commandline options --- //
+		// Outputing the signed Merkle root
+		std::ofstream signature_out(opt.log_signature_file);
+		if(signature_out.is_open())
+		{
+			signature_out << signature( root ) << std::endl;
+		}
+		signature_out.close();
+		MERKLE_STATS_PHASE("sign");
 
-	//  Whether to generate the signature or not. 
-	// If no other option is given, the signature is created.
-	bool SIGN=false;			
-	
-	//  Whether to generate hash chains or not.
-	bool HASH_CHAIN=false;
+		// Information massage 
+		std::cout << "completed" << std::endl;
 
-	//  Whether to save the leaves (hashes of lines) or not.
-	bool LEAVES=false;
+		// If --leaves was active, closing the leaves, before the 
+		// state so that the next run can not skip leaves lost here
+		if(opt.LEAVES && !closeLeaves())
+		{
+			return -1;
+		}
 
-	// The path to the log file
-	std::string log_file;
+		// Saving the state for the next run, only 
+		// after the new root has been signed
+		if(opt.RESUME && !state.save(opt.state_file))
+		{
+			std::cout << "\nWriting the state " << opt.state_file << " failed!" << std::endl;
+			return -1;
+		}
 
-	// The file name for the log files signature.
-	// At the moment will be log_file + ".signature"
-	std::string log_signature_file;
+	} // END SIGN
 
-	// The path to the file which holds the lines
-	// for which to extract the hash chains
-	std::string hash_chain_lines_file;
+	return 0;
+} // END runHasher
 
-	// The file where to store the leaves.
-	// At the moment will be log_file + ".leaves"
-	std::string leaves_file;
 
 
+int main( int argc, char **argv )
+{
+
+	// -------------------------------- //
+	// ------ COMMANDLINE PARSING ----- //
+	// -------------------------------- //
+
+	// --- Initialise the variable to hold commandline options --- //
+	hasher_options_t opt;
+
 	// --- Combining the VERSION/NAME message and the USAGE_MESSAGE --- //
 	// The VERSION and EXE_NAME are variables defined during compilation
 	// for their details see the Makefile. 
@@ -89,7 +1816,22 @@ int main( int argc, char **argv )
 	#endif
 	std::string USAGE_MESSAGE = "Usage: \n\t./" + std::string(EXE_NAME) + " -i <log_file path> (--leaves)\n\t./"
 												+ std::string(EXE_NAME) + " -i <log_file path> --chain <lines_file> (--leaves)\n\t./"
-												+ std::string(EXE_NAME) + " -i <log_file path> --chain <lines_file> --sign (--leaves)";
+												+ std::string(EXE_NAME) + " -i <log_file path> --chain <lines_file> --sign (--leaves)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --chain-lines <line_nr,line_nr,...> (--sign) (--leaves)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --index (--leaves)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --index-chain <line_nr,line_nr,...>\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --lookup (--leaves)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --lookup-chain <lines_file>\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --consistency <M>\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --verify-consistency <proof_file> --old-signature <file> (--signature <file>)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --multi-proof <N-M,line_nr,...>\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --verify-multi-proof <proof_file> (--verify-lines <lines_file>) (--signature <file>)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --resume (--leaves)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --follow (--block-lines <N>) (--block-seconds <T>)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --verify <chain_dir or proof_file> (--verify-lines <lines_file>) (--signature <file>)\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --export-proofs <proof_file>\n\t./"
+												+ std::string(EXE_NAME) + " -i <log_file path> --serve (--cache-mb <M>)\n\t./"
+												+ std::string(EXE_NAME) + " --batch <log_dir, glob or @list_file> (--batch-name <name>) (--threads <N>) (--proofs)";
 
 	// --- Combining the HELP_MESSAGE --- //
 	std::string HELP_MESSAGE = "\n";
@@ -104,7 +1846,36 @@ int main( int argc, char **argv )
 	HELP_MESSAGE +=	 "\n";
 	HELP_MESSAGE +=  "\t--sign\t\t\tIf given, then the log file\n\t\t\t\twill be signed. (DEFAULT)\n";
 	HELP_MESSAGE +=  "\t--chain <file_name>\tIf given, then the hash chains\n\t\t\t\tcorresponding to lines in <file_name>\n\t\t\t\twill be retrived.\n";
+	HELP_MESSAGE +=  "\t--chain-lines <N,M,..>\tIf given, then the hash chains of\n\t\t\t\tthe given line numbers will be retrived.\n";
 	HELP_MESSAGE +=  "\t--leaves\t\tIf given, save the leaves.\n";
+	HELP_MESSAGE +=  "\t--leaves-binary\t\tIf given, save the leaves as\n\t\t\t\tbinary digests.\n";
+	HELP_MESSAGE +=  "\t--threads <N>\t\tHash the leaves on N threads.\n";
+	HELP_MESSAGE +=  "\t--direct\t\tIf given, read the log file past\n\t\t\t\tthe page cache (O_DIRECT, io_uring).\n";
+	HELP_MESSAGE +=  "\t--compat\t\tIf given, use the original hex-of-hex\n\t\t\t\ttree, so that old roots are reproduced.\n";
+	HELP_MESSAGE +=  "\t--hash <name>\t\tThe hash function: sha256 (DEFAULT),\n\t\t\t\tsha512-256 or blake2s-256.\n";
+	HELP_MESSAGE +=  "\t--index\t\t\tIf given, save the Merkle tree\n\t\t\t\tinto <log_file>.index while signing.\n";
+	HELP_MESSAGE +=  "\t--index-chain <N,M,..>\tIf given, read the hash chains of\n\t\t\t\tthe given line numbers from the index.\n";
+	HELP_MESSAGE +=  "\t--lookup\t\tAs --index, and also save a lookup\n\t\t\t\ttable of the leaves into\n\t\t\t\t<log_file>.lookup.\n";
+	HELP_MESSAGE +=  "\t--lookup-chain <file_name>\tAs --chain, but find the lines\n\t\t\t\tthrough the lookup table and read\n\t\t\t\tthe chains from the index.\n";
+	HELP_MESSAGE +=  "\t--consistency <M>\tIf given, write the proof that the\n\t\t\t\tfirst M lines are a prefix of the log\n\t\t\t\t(from the index) into\n\t\t\t\t<log_file>.consistency_<M>.\n";
+	HELP_MESSAGE +=  "\t--verify-consistency <file>\tIf given, verify the consistency\n\t\t\t\tproof <file> against the signature.\n";
+	HELP_MESSAGE +=  "\t--old-signature <file>\tThe signature of the first M lines,\n\t\t\t\tcompulsory with --verify-consistency.\n";
+	HELP_MESSAGE +=  "\t--multi-proof <N-M,..>\tIf given, write a single proof of the\n\t\t\t\tgiven lines (from the index) into\n\t\t\t\t<log_file>.multi_proof.\n";
+	HELP_MESSAGE +=  "\t--verify-multi-proof <file>\tIf given, verify the multi-proof\n\t\t\t\t<file> against the signature.\n";
+	HELP_MESSAGE +=  "\t--resume\t\tIf given, continue signing from\n\t\t\t\t<log_file>.state, hashing only the\n\t\t\t\tappended lines.\n";
+	HELP_MESSAGE +=  "\t--follow\t\tIf given, follow the growing log file\n\t\t\t\tand sign it in blocks, writing the\n\t\t\t\trecords into <log_file>.blocks.\n";
+	HELP_MESSAGE +=  "\t--block-lines <N>\tClose a block after N lines.\n";
+	HELP_MESSAGE +=  "\t--block-seconds <T>\tClose a block T seconds after its\n\t\t\t\tfirst line. (DEFAULT 10)\n";
+	HELP_MESSAGE +=  "\t--stats\t\t\tIf given, print counters and timings\n\t\t\t\tof the run as JSON into stderr.\n";
+	HELP_MESSAGE +=  "\t--verify <path>\t\tIf given, verify the hash chains in the\n\t\t\t\tdirectory, chain file or proof\n\t\t\t\tcontainer <path>\n\t\t\t\tagainst the signature.\n";
+	HELP_MESSAGE +=  "\t--verify-lines <file>\tIf given, also check the leaves against\n\t\t\t\tthe lines of <file> numbered as the\n\t\t\t\tchain files.\n";
+	HELP_MESSAGE +=  "\t--signature <file>\tThe signature to verify against.\n\t\t\t\t(DEFAULT <log_file>.signature)\n";
+	HELP_MESSAGE +=  "\t--proofs\t\tIf given, write the hash chains into\n\t\t\t\ta binary proof container\n\t\t\t\t(<log_file>.hash_chains or\n\t\t\t\t<log_file>.hash_chains_line).\n";
+	HELP_MESSAGE +=  "\t--export-proofs <file>\tIf given, print the proof\n\t\t\t\tcontainer <file> as text.\n";
+	HELP_MESSAGE +=  "\t--batch <files>\t\tIf given, sign the log files in the\n\t\t\t\tdirectory, glob or @list_file <files>\n\t\t\t\ttogether with one signature over\n\t\t\t\ttheir roots (instead of -i).\n";
+	HELP_MESSAGE +=  "\t--batch-name <name>\tThe name of the batch outputs.\n\t\t\t\t(DEFAULT batch)\n";
+	HELP_MESSAGE +=  "\t--serve\t\t\tIf given, serve the hash chains of the\n\t\t\t\tline numbers read from stdin,\n\t\t\t\tcaching subtree roots in between.\n";
+	HELP_MESSAGE +=  "\t--cache-mb <M>\t\tThe memory budget of the --serve\n\t\t\t\tcache. (DEFAULT 64)\n";
 	HELP_MESSAGE +=	 "\n";
 
 	// --- Help message parsing --- //
@@ -119,14 +1890,34 @@ int main( int argc, char **argv )
 		std::cout << NAME_HEAD << std::endl; 
 	}
 
+	// --- Batch option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--batch") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--batch");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the log files for --batch!" << std::endl;
+			return -1;
+		}
+		opt.BATCH=true;
+		opt.batch_files = std::string(tmp);
+		if(cmdOptionExists(argv, argv+argc, "--batch-name") )
+		{
+			tmp = getCmdOption(argv, argv + argc, "--batch-name");
+			opt.batch_name = tmp ? std::string(tmp) : opt.batch_name;
+		}
+		// All the cores, unless --threads is given
+		opt.THREADS = std::max(1u, std::thread::hardware_concurrency());
+	}
+
 	// --- Log file name parsing --- //
 	if(cmdOptionExists(argv, argv+argc, "-i") )
 	{
 		char * tmp = getCmdOption(argv, argv + argc, "-i");
-		log_file = std::string(tmp);
-		log_signature_file = log_file + ".signature";
+		opt.log_file = std::string(tmp);
+		opt.log_signature_file = opt.log_file + ".signature";
 	}
-	else
+	else if(!opt.BATCH)
 	{
 		std::cout << "\nMissing log file path! Log file path is compulsory." << std::endl;
 		std::cout << "For more details see: -h or --help" << std::endl;
@@ -136,164 +1927,325 @@ int main( int argc, char **argv )
 	// --- Signture and hash chain option parsing --- //
 	if(cmdOptionExists(argv, argv+argc, "--sign") )
 	{
-		SIGN=true; 
+		opt.SIGN=true; 
 	}
 	if(cmdOptionExists(argv, argv+argc, "--chain") )
 	{
-		HASH_CHAIN=true;
+		opt.HASH_CHAIN=true;
 		char * tmp = getCmdOption(argv, argv + argc, "--chain"); 
-		hash_chain_lines_file = std::string(tmp);
+		opt.hash_chain_lines_file = std::string(tmp);
+	}
+	if(cmdOptionExists(argv, argv+argc, "--index") )
+	{
+		opt.INDEX=true;
+		opt.SIGN=true;
+	}
+	opt.lookup_file = opt.log_file + ".lookup";
+	if(cmdOptionExists(argv, argv+argc, "--lookup") )
+	{
+		opt.LOOKUP=true;
+		opt.INDEX=true;
+		opt.SIGN=true;
+	}
+	if(cmdOptionExists(argv, argv+argc, "--lookup-chain") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--lookup-chain");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the lines file for --lookup-chain!" << std::endl;
+			return -1;
+		}
+		opt.LOOKUP_CHAIN=true;
+		opt.lookup_chain_lines_file = std::string(tmp);
+	}
+	opt.index_file = opt.log_file + ".index";
+	if(cmdOptionExists(argv, argv+argc, "--consistency") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--consistency");
+		opt.consistency_lines = tmp ? strtoull(tmp, 0, 10) : 0;
+		if(opt.consistency_lines < 1)
+		{
+			std::cout << "\nThe number of lines for --consistency must be a positive integer!" << std::endl;
+			return -1;
+		}
+		opt.CONSISTENCY=true;
+	}
+	if(cmdOptionExists(argv, argv+argc, "--multi-proof") )
+	{
+		opt.MULTI_PROOF=true;
+		if( !parseLineRanges(getCmdOption(argv, argv + argc, "--multi-proof"), opt.multi_proof_ranges) )
+		{
+			std::cout << "\nMissing or malformed line numbers for --multi-proof!" << std::endl;
+			return -1;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--verify-multi-proof") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--verify-multi-proof");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the proof file for --verify-multi-proof!" << std::endl;
+			return -1;
+		}
+		opt.VERIFY_MULTI_PROOF=true;
+		opt.multi_proof_file = std::string(tmp);
+		if(cmdOptionExists(argv, argv+argc, "--verify-lines") )
+		{
+			tmp = getCmdOption(argv, argv + argc, "--verify-lines");
+			opt.verify_lines_file = tmp ? std::string(tmp) : "";
+		}
+		if(cmdOptionExists(argv, argv+argc, "--signature") )
+		{
+			tmp = getCmdOption(argv, argv + argc, "--signature");
+			opt.log_signature_file = tmp ? std::string(tmp) : opt.log_signature_file;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--verify-consistency") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--verify-consistency");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the proof file for --verify-consistency!" << std::endl;
+			return -1;
+		}
+		opt.VERIFY_CONSISTENCY=true;
+		opt.consistency_file = std::string(tmp);
+		// Without the old signature the proof shows nothing about 
+		// the log that was signed before, so it is compulsory
+		tmp = getCmdOption(argv, argv + argc, "--old-signature");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the old signature (--old-signature) for --verify-consistency!" << std::endl;
+			return -1;
+		}
+		opt.old_signature_file = std::string(tmp);
+		if(cmdOptionExists(argv, argv+argc, "--signature") )
+		{
+			tmp = getCmdOption(argv, argv + argc, "--signature");
+			opt.log_signature_file = tmp ? std::string(tmp) : opt.log_signature_file;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--index-chain") )
+	{
+		opt.INDEX_CHAIN=true;
+		if( !parseLineRanges(getCmdOption(argv, argv + argc, "--index-chain"), opt.index_chain_ranges) )
+		{
+			std::cout << "\nMissing or malformed line numbers for --index-chain!" << std::endl;
+			return -1;
+		}
+	}
+	opt.state_file = opt.log_file + ".state";
+	if(cmdOptionExists(argv, argv+argc, "--resume") )
+	{
+		if(opt.log_file == "-" || opt.INDEX)
+		{
+			std::cout << "\n--resume needs a log file and can not be combined with --index!" << std::endl;
+			return -1;
+		}
+		if(Decompressor::detectFile(opt.log_file) != Decompressor::PLAIN)
+		{
+			std::cout << "\n--resume needs an uncompressed log file!" << std::endl;
+			return -1;
+		}
+		opt.RESUME=true;
+		opt.SIGN=true;
+	}
+	if(cmdOptionExists(argv, argv+argc, "--follow") )
+	{
+		if(opt.log_file == "-")
+		{
+			std::cout << "\n--follow needs a log file!" << std::endl;
+			return -1;
+		}
+		if(Decompressor::detectFile(opt.log_file) != Decompressor::PLAIN)
+		{
+			std::cout << "\n--follow needs an uncompressed log file!" << std::endl;
+			return -1;
+		}
+		opt.FOLLOW=true;
+		opt.blocks_file = opt.log_file + ".blocks";
+		if(cmdOptionExists(argv, argv+argc, "--block-lines") )
+		{
+			char * tmp = getCmdOption(argv, argv + argc, "--block-lines");
+			opt.block_lines = tmp ? strtoull(tmp, 0, 10) : 0;
+		}
+		if(cmdOptionExists(argv, argv+argc, "--block-seconds") )
+		{
+			char * tmp = getCmdOption(argv, argv + argc, "--block-seconds");
+			opt.block_seconds = tmp ? atof(tmp) : 0;
+		}
+		if(opt.block_lines == 0 && opt.block_seconds <= 0)
+		{
+			opt.block_seconds = 10;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--chain-lines") )
+	{
+		opt.CHAIN_LINES=true;
+		if( !parseLineRanges(getCmdOption(argv, argv + argc, "--chain-lines"), opt.chain_line_ranges) )
+		{
+			std::cout << "\nMissing or malformed line numbers for --chain-lines!" << std::endl;
+			return -1;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--verify") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--verify");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the hash chains for --verify!" << std::endl;
+			return -1;
+		}
+		opt.VERIFY=true;
+		opt.verify_chains = std::string(tmp);
+		if(cmdOptionExists(argv, argv+argc, "--verify-lines") )
+		{
+			tmp = getCmdOption(argv, argv + argc, "--verify-lines");
+			opt.verify_lines_file = tmp ? std::string(tmp) : "";
+		}
+		if(cmdOptionExists(argv, argv+argc, "--signature") )
+		{
+			tmp = getCmdOption(argv, argv + argc, "--signature");
+			opt.log_signature_file = tmp ? std::string(tmp) : opt.log_signature_file;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--proofs") )
+	{
+		opt.PROOFS=true;
+	}
+	if(cmdOptionExists(argv, argv+argc, "--export-proofs") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--export-proofs");
+		if(tmp == 0)
+		{
+			std::cout << "\nMissing the proof file for --export-proofs!" << std::endl;
+			return -1;
+		}
+		opt.EXPORT_PROOFS=true;
+		opt.export_proofs_file = std::string(tmp);
+	}
+	if(cmdOptionExists(argv, argv+argc, "--serve") )
+	{
+		opt.SERVE=true;
+		if(cmdOptionExists(argv, argv+argc, "--cache-mb") )
+		{
+			char * tmp = getCmdOption(argv, argv + argc, "--cache-mb");
+			long mb = tmp ? atol(tmp) : -1;
+			if(mb < 0)
+			{
+				std::cout << "\nThe cache budget must be a non-negative number of MB!" << std::endl;
+				return -1;
+			}
+			opt.cache_mb = mb;
+		}
 	}
-	if( !SIGN && !HASH_CHAIN )
+	if( !opt.SIGN && !opt.HASH_CHAIN && !opt.CHAIN_LINES && !opt.INDEX_CHAIN && !opt.LOOKUP_CHAIN && !opt.CONSISTENCY && !opt.VERIFY_CONSISTENCY && !opt.MULTI_PROOF && !opt.VERIFY_MULTI_PROOF && !opt.VERIFY && !opt.EXPORT_PROOFS && !opt.SERVE )
 	{
 		// If neither is given, then just generate the signature
-		SIGN=true; 
+		opt.SIGN=true; 
 	}
 
-	// --- Leaves saving option parsing --- //
-	if(cmdOptionExists(argv, argv+argc, "--leaves") )
+	// --- Compatibility mode option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--compat") )
 	{
-		LEAVES=true;
-		leaves_file = log_file + ".leaves";
+		opt.COMPAT=true;
 	}
 
-
-	// ---------------------------- //
-	// ----- RUNNING THE CODE ----- //
-	// ---------------------------- //
-
-	// --- Constructing a MerkleHasher instance --- //
-	#ifdef TEST
-		// For test use the identity_hash and myHashMerge functions 
-		MerkleHasher<identity_hash,myHashMerge> myHasher;
-	#else
-		// Ese the sha256 and myHashMerge functions
-		MerkleHasher<sha256,myHashMerge> myHasher;
-	#endif
-
-	// --- Generating the hash chains if asked --- //
-	if(HASH_CHAIN)
+	// --- Hash function option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--hash") )
 	{
-		// Opening the lines file for the hash chain
-		std::ifstream lines(hash_chain_lines_file);
-		if( lines.is_open() )
+		char * tmp = getCmdOption(argv, argv + argc, "--hash");
+		opt.hash_name = tmp ? std::string(tmp) : "";
+		if(opt.hash_name != Sha256Policy::name() && opt.hash_name != Sha512_256Policy::name() && opt.hash_name != Blake2sPolicy::name())
 		{
-			// Looping the lines
-			std::string line;
-			int line_nr = 0; 
-			while( std::getline(lines, line) )
-			{	
-				line_nr++;
-				// Information massage 
-				std::cout << "Calculating hash chain number " + std::to_string(line_nr) + " ... ";
-
-				// Calculating the hash chain
-				hash_chain_t hash_chain_out = myHasher.getHashChain(log_file, line, LEAVES);
-				
-				// Checking if the hash chain is empty or not
-				if( (hash_chain_out.empty()) )
-				{
-					// Information massage 
-					std::cout << "failed" << std::endl;
-					std::cout << "Input line number " << line_nr << " :\n" << line << std::endl;
-					std::cout << "\nThe line is not present in the log file!\n" << std::endl;
-				}
-				else
-				{
-					// Information massage 
-					std::cout << "completed" << std::endl;
-					
-					// Printing the hash chain
-					std::string hash_chain_file = log_file + ".hash_chain_" + std::to_string(line_nr);
-					std::ofstream hc_out(hash_chain_file);
-					if(hc_out.is_open())
-					{
-						for (uint i=0; i<hash_chain_out.size(); ++i)
-						{
-							hc_out << hash_chain_out[i].first << "\t" << hash_chain_out[i].second << std::endl; 
-						}
-					}
-					hc_out.close();
-
-
-					// If --leaves was active, printing the leaves (do it only once)
-					if(LEAVES)
-					{
-
-						// Information massage 
-						std::cout << "Printing leaves ... "; 
-						
-						std::vector<std::string> leaves = myHasher.getLeaves();
-						std::ofstream leaves_out(leaves_file);
-						if(leaves_out.is_open())
-						{
-							for (uint i=0; i<leaves.size(); ++i)
-							{
-								leaves_out << leaves[i] << std::endl; 
-							}
-						}
-						leaves_out.close();
-
-
-						// Information massage 
-						std::cout << "completed" << std::endl;
+			std::cout << "\nUnknown hash function " << opt.hash_name << "! Use sha256, sha512-256 or blake2s-256." << std::endl;
+			return -1;
+		}
+		if(opt.COMPAT && opt.hash_name != Sha256Policy::name())
+		{
+			std::cout << "\n--compat is only defined for sha256!" << std::endl;
+			return -1;
+		}
+	}
 
-						// Setting LEAVES to false (no need to print it again)
-						LEAVES=false;
-					} 
-				}
-			} 
+	// --- Thread count option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--threads") )
+	{
+		char * tmp = getCmdOption(argv, argv + argc, "--threads");
+		int n = tmp ? atoi(tmp) : 0;
+		if(n < 1)
+		{
+			std::cout << "\nThe number of threads must be a positive integer!" << std::endl;
+			return -1;
 		}
-		lines.close();
-	} // END HASH_CHAIN
+		opt.THREADS = n;
+	}
 
+	// --- Direct input option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--direct") )
+	{
+		opt.DIRECT=true;
+	}
 
-	// --- Signing the Merkle root if asked --- //
-	if(SIGN)
+	// --- Leaves saving option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--leaves") || cmdOptionExists(argv, argv+argc, "--leaves-binary") )
 	{
-		// Information massage 
-		std::cout << "Calculating the Merkle root ... "; 
-		
-		// Calculating the root of the Merkle tree of the log file
-		std::string root = myHasher.getRoot(log_file, LEAVES);
+		opt.LEAVES=true;
+		opt.LEAVES_BINARY=cmdOptionExists(argv, argv+argc, "--leaves-binary");
+		opt.leaves_file = opt.log_file + ".leaves";
+	}
 
-		// Information massage 
-		std::cout << "completed" << std::endl;
-		std::cout << "Signing the Merkle root ... ";
 
-		// Outputing the signed Merkle root
-		std::ofstream signature_out(log_signature_file);
-		if(signature_out.is_open())
-		{
-			signature_out << signature( root ) << std::endl;
-		}
-		signature_out.close();
+	// --- Statistics option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--stats") )
+	{
+		opt.STATS=true;
+	}
 
-		// Information massage 
-		std::cout << "completed" << std::endl;
 
-		// If --leaves was active, printing the leaves
-		if(LEAVES)
+	// ---------------------------- //
+	// ----- RUNNING THE CODE ----- //
+	// ---------------------------- //
+
+	// --- Choosing the hash policy --- //
+	int ret;
+	#ifdef TEST
+		// For test use the identity_hash and myHashMerge functions 
+		ret = runHasher<IdentityPolicy>(opt);
+	#else
+		// Use SHA256, either over binary digests or 
+		// in the original hex-of-hex compatibility mode,
+		// or one of the other hash functions
+		if(opt.hash_name == Sha512_256Policy::name() || opt.hash_name == Blake2sPolicy::name())
 		{
-			// Information massage 
-			std::cout << "Printing leaves ... "; 
-			
-			std::vector<std::string> leaves = myHasher.getLeaves();
-			std::ofstream leaves_out(leaves_file);
-			if(leaves_out.is_open())
+			bool sha512 = (opt.hash_name == Sha512_256Policy::name());
+			if( sha512 ? !Sha512_256Policy::available() : !Blake2sPolicy::available() )
 			{
-				for (uint i=0; i<leaves.size(); ++i)
-				{
-					leaves_out << leaves[i] << std::endl; 
-				}
+				std::cout << "\nThe OpenSSL library has no " << opt.hash_name << "!" << std::endl;
+				return -1;
 			}
-			leaves_out.close();
-
-			// Information massage 
-			std::cout << "completed" << std::endl;
+			ret = sha512 ? runHasher<Sha512_256Policy>(opt) : runHasher<Blake2sPolicy>(opt);
 		}
+		else if(opt.COMPAT)
+		{
+			ret = runHasher<Sha256HexPolicy>(opt);
+		}
+		else
+		{
+			ret = runHasher<Sha256Policy>(opt);
+		}
+	#endif
 
-	} // END SIGN
+	// --- Printing the statistics if asked --- //
+	if(opt.STATS)
+	{
+		#ifndef MERKLE_NO_STATS
+			std::cerr << merkleStatsJson() << std::endl;
+		#else
+			std::cerr << "{\"error\": \"statistics were compiled out (MERKLE_NO_STATS)\"}" << std::endl;
+		#endif
+	}
+	return ret;
 
 } // END MAIN
 
@@ -0,0 +1,233 @@
+/**
+ *	Author: Madis Ollikainen
+ *	File:	signd.cpp
+ *
+ *	The signing daemon, which signs log records sent by
+ *	local services over a Unix domain socket and answers
+ *	every record with its hash chain (see signDaemon.hpp
+ *	for the protocol). The records are signed in rounds,
+ *	one Merkle tree and one signature per round.
+ *
+ *	Commandline options:
+ *
+ *	-h	(--help) 		Produces help message
+ *	-v 	(--version)		Prints the code version
+ *						defined by the git version.
+ *
+ *	-s 	<socket>		The path of the socket (REQUIRED).
+ *	--round-records <N>	Close a round after N records.
+ *						(DEFAULT 4096)
+ *	--round-ms <T>		Close a round T milliseconds after
+ *						its first record. (DEFAULT 20)
+ *	--rounds-queued <Q>	At most Q closed rounds wait for
+ *						signing, after which the clients
+ *						are held back. (DEFAULT 4)
+ *	--rounds <file>		The file where a record of every
+ *						round (number, records, root and
+ *						signature) is written.
+ *						(DEFAULT <socket>.rounds)
+ *	--hash <name>		The hash function: sha256 (DEFAULT),
+ *						sha512-256 or blake2s-256.
+ *
+ *	Runs until interrupted (Ctrl-C or SIGTERM), signing the
+ *	last round before stopping.
+ */
+
+
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <csignal>
+#include <cstdlib>
+
+#include "readcmd.hpp"
+#include "myHashInterface.hpp"
+#include "mySignatureInterface.hpp"
+#include "signDaemon.hpp"
+
+
+// --- The commandline options --- //
+struct signd_options_t
+{
+	// The path of the socket
+	std::string socket_path;
+
+	// The round size limits
+	size_t round_records;
+	double round_ms;
+
+	// The number of closed rounds waiting for signing
+	size_t rounds_queued;
+
+	// The file where the round records are written
+	std::string rounds_file;
+
+	// The name of the hash function
+	std::string hash_name;
+
+	signd_options_t() : round_records(4096), round_ms(20), rounds_queued(4), hash_name("sha256") {}
+};
+
+
+// --- Stopping the daemon on a signal --- //
+static volatile sig_atomic_t STOP_DAEMON = 0;
+static void stopDaemon(int) { STOP_DAEMON = 1; }
+
+
+// --- Running the daemon with the given hash policy --- //
+template <class P>
+int runDaemon( const signd_options_t& opt )
+{
+	SignDaemon<P> daemon(opt.socket_path, opt.round_records, opt.round_ms / 1000, opt.rounds_queued);
+	if(!daemon.open())
+	{
+		std::cout << "\nCan not listen on the socket: " << daemon.error() << "!" << std::endl;
+		return -1;
+	}
+	std::ofstream rounds_out(opt.rounds_file);
+	if(!rounds_out.is_open())
+	{
+		std::cout << "\nCan not write the round records into " << opt.rounds_file << "!" << std::endl;
+		return -1;
+	}
+
+	// Information massage
+	std::cout << "Signing the records sent to " << opt.socket_path << " in rounds of up to "
+			  << opt.round_records << " records or " << opt.round_ms << " ms (Ctrl-C to stop) ..." << std::endl;
+
+	signal(SIGINT, stopDaemon);
+	signal(SIGTERM, stopDaemon);
+	signal(SIGPIPE, SIG_IGN);
+	daemon.run(&STOP_DAEMON, [&](uint64_t round, uint64_t records, std::string root)
+		{
+			std::string sign = signature( root );
+			rounds_out << round << "\t" << records << "\t" << root << "\t" << sign << std::endl;
+			return sign;
+		});
+
+	// Information massage
+	std::cout << "Signed " << daemon.records() << " records in " << daemon.rounds() << " rounds, records in "
+			  << opt.rounds_file << std::endl;
+	return 0;
+} // END runDaemon
+
+
+
+int main( int argc, char **argv )
+{
+
+	// -------------------------------- //
+	// ------ COMMANDLINE PARSING ----- //
+	// -------------------------------- //
+
+	signd_options_t opt;
+
+	std::string NAME_HEAD = "Guardtime trial excersise by Madis Ollikainen. Signing daemon.\nCode version (git): " + std::string(VERSION);
+	std::string USAGE_MESSAGE = "Usage: \n\t./" + std::string(EXE_NAME) + " -s <socket path> (--round-records <N>) (--round-ms <T>) (--rounds-queued <Q>) (--rounds <file>) (--hash <name>)\n";
+	std::string HELP_MESSAGE = NAME_HEAD + "\n\n" + USAGE_MESSAGE + "\n";
+	HELP_MESSAGE +=  "Options:\n";
+	HELP_MESSAGE +=  "\t-h\t(--help)\tProduces help message\n";
+	HELP_MESSAGE +=  "\t-v\t(--version)\tPrints the code version\n\t\t\t\tdefined by the git version.\n";
+	HELP_MESSAGE +=	 "\n";
+	HELP_MESSAGE +=  "\t-s\t<socket>\tThe path of the socket (REQUIRED).\n";
+	HELP_MESSAGE +=	 "\n";
+	HELP_MESSAGE +=  "\t--round-records <N>\tClose a round after N records.\n\t\t\t\t(DEFAULT 4096)\n";
+	HELP_MESSAGE +=  "\t--round-ms <T>\t\tClose a round T milliseconds after\n\t\t\t\tits first record. (DEFAULT 20)\n";
+	HELP_MESSAGE +=  "\t--rounds-queued <Q>\tAt most Q closed rounds wait for\n\t\t\t\tsigning. (DEFAULT 4)\n";
+	HELP_MESSAGE +=  "\t--rounds <file>\t\tWrite the round records into <file>.\n\t\t\t\t(DEFAULT <socket>.rounds)\n";
+	HELP_MESSAGE +=  "\t--hash <name>\t\tThe hash function: sha256 (DEFAULT),\n\t\t\t\tsha512-256 or blake2s-256.\n";
+	HELP_MESSAGE +=	 "\n";
+
+	// --- Help message parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "-h") || cmdOptionExists(argv, argv+argc, "--help") )
+	{
+		std::cout << HELP_MESSAGE << std::endl;
+		return 0;
+	}
+
+	// --- Version message parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "-v") || cmdOptionExists(argv, argv+argc, "--version") )
+	{
+		std::cout << NAME_HEAD << std::endl;
+		return 0;
+	}
+
+	// --- Socket path parsing --- //
+	char * tmp = getCmdOption(argv, argv + argc, "-s");
+	if(tmp == 0)
+	{
+		std::cout << "\nMissing the socket path!\n\n" << USAGE_MESSAGE << std::endl;
+		return -1;
+	}
+	opt.socket_path = std::string(tmp);
+	opt.rounds_file = opt.socket_path + ".rounds";
+
+	// --- Round option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--round-records") )
+	{
+		tmp = getCmdOption(argv, argv + argc, "--round-records");
+		long n = tmp ? atol(tmp) : 0;
+		if(n < 1)
+		{
+			std::cout << "\nThe number of records in a round must be a positive integer!" << std::endl;
+			return -1;
+		}
+		opt.round_records = n;
+	}
+	if(cmdOptionExists(argv, argv+argc, "--round-ms") )
+	{
+		tmp = getCmdOption(argv, argv + argc, "--round-ms");
+		opt.round_ms = tmp ? atof(tmp) : 0;
+		if(opt.round_ms <= 0)
+		{
+			std::cout << "\nThe round time must be a positive number of milliseconds!" << std::endl;
+			return -1;
+		}
+	}
+	if(cmdOptionExists(argv, argv+argc, "--rounds-queued") )
+	{
+		tmp = getCmdOption(argv, argv + argc, "--rounds-queued");
+		long n = tmp ? atol(tmp) : 0;
+		if(n < 1)
+		{
+			std::cout << "\nThe number of queued rounds must be a positive integer!" << std::endl;
+			return -1;
+		}
+		opt.rounds_queued = n;
+	}
+	if(cmdOptionExists(argv, argv+argc, "--rounds") )
+	{
+		tmp = getCmdOption(argv, argv + argc, "--rounds");
+		opt.rounds_file = tmp ? std::string(tmp) : opt.rounds_file;
+	}
+
+	// --- Hash function option parsing --- //
+	if(cmdOptionExists(argv, argv+argc, "--hash") )
+	{
+		tmp = getCmdOption(argv, argv + argc, "--hash");
+		opt.hash_name = tmp ? std::string(tmp) : "";
+		if(opt.hash_name != Sha256Policy::name() && opt.hash_name != Sha512_256Policy::name() && opt.hash_name != Blake2sPolicy::name())
+		{
+			std::cout << "\nUnknown hash function " << opt.hash_name << "! Use sha256, sha512-256 or blake2s-256." << std::endl;
+			return -1;
+		}
+	}
+
+
+	// ---------------------------- //
+	// ----- RUNNING THE CODE ----- //
+	// ---------------------------- //
+
+	if(opt.hash_name == Sha512_256Policy::name() || opt.hash_name == Blake2sPolicy::name())
+	{
+		bool sha512 = (opt.hash_name == Sha512_256Policy::name());
+		if( sha512 ? !Sha512_256Policy::available() : !Blake2sPolicy::available() )
+		{
+			std::cout << "\nThe OpenSSL library has no " << opt.hash_name << "!" << std::endl;
+			return -1;
+		}
+		return sha512 ? runDaemon<Sha512_256Policy>(opt) : runDaemon<Blake2sPolicy>(opt);
+	}
+	return runDaemon<Sha256Policy>(opt);
+
+} // END MAIN